@@ -1,5 +1,5 @@
 SELECT
-  fn.hash,
+  CASE typeof(fn.hash) WHEN 'blob' THEN lower(hex(fn.hash)) ELSE fn.hash END AS hash,
   fn.size,
   fn.path
 FROM files AS fn 
@@ -1,18 +1,19 @@
 WITH q AS (
   SELECT 
-    file_hash, 
-    count(1) AS dup 
-  FROM file_tags 
-  WHERE tag_key = 'path'
-  GROUP BY file_hash
+    hash, 
+    size, 
+    count(DISTINCT coalesce(device || ':' || inode, path)) AS dup 
+  FROM files 
+  WHERE partial IS NULL
+  GROUP BY hash, size
 ) 
 SELECT
-  fn.hash,
+  CASE typeof(fn.hash) WHEN 'blob' THEN lower(hex(fn.hash)) ELSE fn.hash END AS hash,
   fn.size,
   fn.path
 FROM files AS fn 
-  JOIN q ON q.file_hash = fn.hash 
+  JOIN q ON q.hash = fn.hash AND q.size = fn.size 
 WHERE dup > 1
+  AND fn.partial IS NULL
 ORDER BY fn.hash, fn.path
 ;
-
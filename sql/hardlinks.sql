@@ -0,0 +1,20 @@
+WITH q AS (
+  SELECT 
+    device, 
+    inode, 
+    count(DISTINCT path) AS links 
+  FROM files 
+  WHERE inode IS NOT NULL
+  GROUP BY device, inode
+) 
+SELECT
+  fn.device,
+  fn.inode,
+  CASE typeof(fn.hash) WHEN 'blob' THEN lower(hex(fn.hash)) ELSE fn.hash END AS hash,
+  fn.size,
+  fn.path
+FROM files AS fn 
+  JOIN q ON q.device = fn.device AND q.inode = fn.inode 
+WHERE links > 1
+ORDER BY fn.device, fn.inode, fn.path
+;
@@ -0,0 +1,231 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/if_alg.h>)
+#include <linux/if_alg.h>
+#define AFALG
+#endif
+#endif
+
+#include "afalg.h"
+
+/*
+ * Hashes whole files with the kernel's crypto API.  The file's pages are
+ * spliced into a pipe and on into an AF_ALG socket, so the data is never
+ * copied out to user space, and reading the digest back from the socket
+ * is what finishes it.  One socket serves the whole scan: every piece is
+ * sent with SPLICE_F_MORE, and once a digest has been read the next
+ * piece starts a new hash.
+ */
+static struct {
+    int tfm;
+    int op;
+    int pipe[2];
+} alg = {-1, -1, {-1, -1}};
+
+#if defined(AFALG)
+
+/* as much as an unresized pipe holds */
+static const size_t AFALG_STEP = 64 << 10;
+
+static int
+afalg_ready(void)
+{
+    if(0 <= alg.op) {
+        close(alg.op);
+    }
+
+    if(0 <= alg.pipe[0]) {
+        close(alg.pipe[0]);
+        close(alg.pipe[1]);
+    }
+
+    alg.pipe[0] = alg.pipe[1] = -1;
+
+    if(0 > (alg.op = accept4(alg.tfm, 0, 0, SOCK_CLOEXEC)) ||
+            0 != pipe2(alg.pipe, O_CLOEXEC)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* moves what is in the pipe on into the socket, more to follow */
+static int
+afalg_send(ssize_t in)
+{
+    while(in > 0) {
+        ssize_t out = splice(alg.pipe[0], 0, alg.op, 0, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if(out < 0 && EINTR == errno) {
+            continue;
+        }
+
+        if(out <= 0) {
+            afalg_ready();
+            return -1;
+        }
+
+        in -= out;
+    }
+
+    return 0;
+}
+
+static int
+afalg_digest(unsigned char * digest, size_t len)
+{
+    if((ssize_t)len != read(alg.op, digest, len)) {
+        afalg_ready();
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif
+
+/* name is the kernel's, e.g. "blake2b-256"; -1 with errno if it has none */
+int
+afalg_open(const char * const name)
+{
+#if defined(AFALG)
+    struct sockaddr_alg sa;
+    int err;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.salg_family = AF_ALG;
+    strncpy((char *)sa.salg_type, "hash", sizeof(sa.salg_type) - 1);
+    strncpy((char *)sa.salg_name, name, sizeof(sa.salg_name) - 1);
+
+    if(0 <= (alg.tfm = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) &&
+            0 == bind(alg.tfm, (struct sockaddr *)&sa, sizeof(sa)) &&
+            0 == afalg_ready()) {
+        return 0;
+    }
+
+    err = errno;
+    afalg_close();
+    errno = err;
+    return -1;
+#else
+    (void)name;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * The digest of the first size bytes of fd, without moving its offset.
+ * A file that comes up short, or a socket that fails, leaves the digest
+ * unset and -1 returned; the socket is made ready for the next one.
+ */
+int
+afalg_file(int fd, off_t size, unsigned char * digest, size_t len)
+{
+#if defined(AFALG)
+    off_t off = 0;
+
+    if(0 > alg.op) {
+        errno = EBADF;
+        return -1;
+    }
+
+    while(off < size) {
+        size_t want = (size_t)(size - off) < AFALG_STEP ? (size_t)(size - off) : AFALG_STEP;
+        ssize_t in = splice(fd, &off, alg.pipe[1], 0, want, SPLICE_F_MOVE);
+
+        if(in < 0 && EINTR == errno) {
+            continue;
+        }
+
+        if(in <= 0) {
+            errno = 0 == in ? ESTALE : errno;
+            afalg_ready();
+            return -1;
+        }
+
+        if(0 != afalg_send(in)) {
+            return -1;
+        }
+    }
+
+    return afalg_digest(digest, len);
+#else
+    (void)fd;
+    (void)size;
+    (void)digest;
+    (void)len;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * The digest of len bytes in memory, mapped into the pipe rather than
+ * copied there, for ixbench to set the socket against hashing in process.
+ */
+int
+afalg_buf(const void * buf, size_t size, unsigned char * digest, size_t len)
+{
+#if defined(AFALG)
+    size_t off = 0;
+
+    if(0 > alg.op) {
+        errno = EBADF;
+        return -1;
+    }
+
+    while(off < size) {
+        struct iovec iov = {(char *)buf + off, size - off < AFALG_STEP ? size - off : AFALG_STEP};
+        ssize_t in = vmsplice(alg.pipe[1], &iov, 1, 0);
+
+        if(in < 0 && EINTR == errno) {
+            continue;
+        }
+
+        if(in <= 0) {
+            afalg_ready();
+            return -1;
+        }
+
+        if(0 != afalg_send(in)) {
+            return -1;
+        }
+
+        off += in;
+    }
+
+    return afalg_digest(digest, len);
+#else
+    (void)buf;
+    (void)size;
+    (void)digest;
+    (void)len;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void
+afalg_close(void)
+{
+    int * fds[] = {&alg.op, &alg.tfm, &alg.pipe[0], &alg.pipe[1]};
+
+    for(size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if(0 <= *fds[i]) {
+            close(*fds[i]);
+        }
+
+        *fds[i] = -1;
+    }
+}
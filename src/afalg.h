@@ -0,0 +1,11 @@
+#ifndef _SRC_AFALG_H_
+#define _SRC_AFALG_H_
+
+#include <sys/types.h>
+
+int afalg_open(const char * const);
+int afalg_file(int, off_t, unsigned char *, size_t);
+int afalg_buf(const void *, size_t, unsigned char *, size_t);
+void afalg_close(void);
+
+#endif /*_SRC_AFALG_H_*/
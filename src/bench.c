@@ -0,0 +1,447 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <x86intrin.h>
+#define BENCH_TSC
+#endif
+
+#include "afalg.h"
+#include "chunk.h"
+#include "hash.h"
+#include "fnv/fnv.h"
+
+/*
+ * ixbench: how fast every hash kernel ix can use goes, one tab separated
+ * line per kernel, buffer size, cache state and thread count, so that runs
+ * of two releases can be diffed or loaded as they are.
+ *
+ * Warm runs hash the same buffer over and over.  Cold runs move on to the
+ * next buffer each time across an arena of at least BENCH_COLD bytes, more
+ * than any last level cache, so every byte comes from memory.  Threaded
+ * runs hash side by side, each its own way through the arena.
+ *
+ * Cycles are those of the time stamp counter, which runs at the nominal
+ * clock whatever the core does; 0 where there is none.
+ */
+
+static const size_t BENCH_COLD = 256 << 20;
+static const size_t BENCH_PAGE = 4096;
+
+/* where every digest ends up, so no hashing can be optimised away */
+static volatile uint64_t bench_sink;
+
+struct kernel {
+    const char * name;
+    const char * engine;
+    const char * isa;
+    uint64_t (*raw)(const void *, size_t);
+};
+
+static uint64_t
+raw_fnv1_32(const void * buf, size_t len)
+{
+    return fnv_32_buf((void *)buf, len, FNV1_32_INIT);
+}
+
+static uint64_t
+raw_fnv1a_32(const void * buf, size_t len)
+{
+    return fnv_32a_buf((void *)buf, len, FNV1_32A_INIT);
+}
+
+static uint64_t
+raw_fnv1_64(const void * buf, size_t len)
+{
+    return fnv_64_buf((void *)buf, len, FNV1_64_INIT);
+}
+
+static uint64_t
+raw_fnv1a_64(const void * buf, size_t len)
+{
+    return fnv_64a_buf((void *)buf, len, FNV1A_64_INIT);
+}
+
+/* the buffer cut into FNV_64A_LANES pieces, the way a batch of small files is hashed */
+static uint64_t
+raw_fnv1a_64_lanes(const void * buf, size_t len)
+{
+    void * bufs[FNV_64A_LANES];
+    size_t lens[FNV_64A_LANES];
+    Fnv64_t h[FNV_64A_LANES];
+    size_t part = len / FNV_64A_LANES;
+    uint64_t sum = 0;
+
+    for(int i = 0; i < FNV_64A_LANES; i++) {
+        bufs[i] = (char *)buf + i * part;
+        lens[i] = i + 1 < FNV_64A_LANES ? part : len - i * part;
+        h[i] = FNV1A_64_INIT;
+    }
+
+    fnv_64a_lanes(bufs, lens, h, FNV_64A_LANES);
+
+    for(int i = 0; i < FNV_64A_LANES; i++) {
+        sum ^= h[i];
+    }
+
+    return sum;
+}
+
+/* the engine's hash in the kernel's crypto API, as -K does it; one socket, so one thread */
+static uint64_t
+raw_afalg(const void * buf, size_t len)
+{
+    unsigned char digest[HASH_MAX];
+
+    if(0 != afalg_buf(buf, len, digest, hash_engine->size)) {
+        return 0;
+    }
+
+    return hash_id(digest);
+}
+
+static const struct kernel KERNELS[] = {
+    {"fnv1_32", 0, 0, raw_fnv1_32},
+    {"fnv1a_32", 0, 0, raw_fnv1a_32},
+    {"fnv1_64", 0, 0, raw_fnv1_64},
+    {"fnv1a_64", 0, 0, raw_fnv1a_64},
+    {"fnv1a_64_lanes", 0, 0, raw_fnv1a_64_lanes},
+    {"fnv64", "fnv64", 0, 0},
+    {"ixh128/scalar", "ixh128", "scalar", 0},
+    {"ixh128/sse2", "ixh128", "sse2", 0},
+    {"ixh128/avx2", "ixh128", "avx2", 0},
+    {"ixh128/avx512", "ixh128", "avx512", 0},
+    {"blake2b", "blake2b", 0, 0},
+    {"afalg/blake2b", "blake2b", 0, raw_afalg},
+};
+
+struct run {
+    const struct kernel * k;
+    const unsigned char * arena;
+    size_t span;
+    size_t size;
+    int cold;
+    int thread;
+    int threads;
+    double secs;
+    pthread_barrier_t * start;
+    uint64_t reps;
+    double elapsed;
+    uint64_t ticks;
+    uint64_t sink;
+};
+
+static double
+now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static uint64_t
+ticks(void)
+{
+#if defined(BENCH_TSC)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t
+hash_once(const struct kernel * k, const unsigned char * buf, size_t len)
+{
+    union hash_state s;
+    unsigned char digest[HASH_MAX];
+
+    if(0 != k->raw) {
+        return k->raw(buf, len);
+    }
+
+    hash_engine->init(&s);
+    hash_engine->update(&s, buf, len);
+    hash_engine->final(&s, digest);
+    return hash_id(digest);
+}
+
+/*
+ * Hashes for at least r->secs, checking the clock after batches that grow
+ * until one takes a millisecond, so that the clock does not get timed too.
+ */
+static void *
+run_thread(void * arg)
+{
+    struct run * r = arg;
+    const size_t stride = (r->size + BENCH_PAGE - 1) / BENCH_PAGE * BENCH_PAGE;
+    const size_t last = r->span - r->size;
+    size_t off = r->cold ? (r->span / r->threads * r->thread) / BENCH_PAGE * BENCH_PAGE : 0;
+    uint64_t batch = 1;
+    uint64_t t0;
+    double start;
+    double lap;
+
+    if(off > last) {
+        off = 0;
+    }
+
+    // a warm buffer is in cache before the clock starts
+    if(!r->cold) {
+        r->sink ^= hash_once(r->k, r->arena, r->size);
+    }
+
+    pthread_barrier_wait(r->start);
+    start = now();
+    t0 = ticks();
+
+    do {
+        lap = now();
+
+        for(uint64_t i = 0; i < batch; i++) {
+            r->sink ^= hash_once(r->k, r->arena + off, r->size);
+
+            if(r->cold && (off += stride) > last) {
+                off = 0;
+            }
+        }
+
+        r->reps += batch;
+
+        if(now() - lap < 1e-3) {
+            batch *= 2;
+        }
+    } while(now() - start < r->secs);
+
+    r->ticks = ticks() - t0;
+    r->elapsed = now() - start;
+    return 0;
+}
+
+static int
+bench(const struct kernel * k, const unsigned char * arena, size_t span, size_t size,
+      int cold, int threads, double secs)
+{
+    struct run * runs = calloc(threads, sizeof(struct run));
+    pthread_t * ids = calloc(threads, sizeof(pthread_t));
+    pthread_barrier_t start;
+    double bytes = 0;
+    double elapsed = 0;
+    double cycles = 0;
+    uint64_t reps = 0;
+    uint64_t sink = 0;
+    int n = 0;
+    int rc = 0;
+
+    if(0 == runs || 0 == ids) {
+        fprintf(stderr, "Can't alloc space... bailing\n");
+        free(runs);
+        free(ids);
+        return -1;
+    }
+
+    pthread_barrier_init(&start, 0, threads);
+
+    for(int i = 0; i < threads; i++) {
+        runs[i] = (struct run) {
+            k, arena, span, size, cold, i, threads, secs, &start, 0, 0, 0, 0
+        };
+    }
+
+    while(n + 1 < threads && 0 == (rc = pthread_create(&ids[n], 0, run_thread, &runs[n + 1]))) {
+        n++;
+    }
+
+    // the others would wait at the barrier for ever
+    if(0 != rc) {
+        fprintf(stderr, "Can't start %d threads; %s\n", threads, strerror(rc));
+        exit(1);
+    }
+
+    run_thread(&runs[0]);
+
+    while(n > 0) {
+        pthread_join(ids[--n], 0);
+    }
+
+    for(int i = 0; i < threads; i++) {
+        reps += runs[i].reps;
+        bytes += (double)runs[i].reps * size;
+        cycles += (double)runs[i].ticks;
+        elapsed = runs[i].elapsed > elapsed ? runs[i].elapsed : elapsed;
+        sink ^= runs[i].sink;
+    }
+
+    bench_sink ^= sink;
+    fprintf(stdout, "%s\t%zu\t%s\t%d\t%llu\t%0.0f\t%0.6f\t%0.3f\t%0.3f\n",
+            k->name, size, cold ? "cold" : "warm", threads, (unsigned long long)reps,
+            bytes, elapsed, bytes / elapsed / 1e9, cycles / bytes);
+    fflush(stdout);
+
+    pthread_barrier_destroy(&start);
+    free(runs);
+    free(ids);
+    return 0;
+}
+
+/* "<min>:<max>" or "<max>", with k, m or g suffixes */
+static int
+parse_sizes(const char * s, size_t * lo, size_t * hi)
+{
+    char * end;
+
+    if(0 != parse_bytes(s, &end, hi)) {
+        return -1;
+    }
+
+    if(':' == *end) {
+        *lo = *hi;
+
+        if(0 != parse_bytes(end + 1, &end, hi)) {
+            return -1;
+        }
+    }
+
+    return '\0' == *end && *lo <= *hi ? 0 : -1;
+}
+
+int
+main(int argc, char ** argv)
+{
+    size_t lo = 16;
+    size_t hi = (size_t)1 << 30;
+    double secs = 0.2;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? (int)cpus : 1;
+    int caches = 3;
+    const char * only = 0;
+    unsigned char * arena;
+    size_t span;
+    int ch;
+
+    while((ch = getopt(argc, argv, "c:j:k:s:t:")) != -1) {
+        switch(ch) {
+        case 'c':
+            caches = 0 == strcmp(optarg, "warm") ? 1 : 0 == strcmp(optarg, "cold") ? 2 : 0;
+
+            if(0 == caches) {
+                fprintf(stderr, "Invalid cache state %s\n", optarg);
+                return(1);
+            }
+
+            break;
+
+        case 'j':
+            threads = atoi(optarg);
+
+            if(threads < 1) {
+                fprintf(stderr, "Invalid thread count %s\n", optarg);
+                return(1);
+            }
+
+            break;
+
+        case 'k':
+            only = optarg;
+            break;
+
+        case 's':
+            if(0 != parse_sizes(optarg, &lo, &hi)) {
+                fprintf(stderr, "Invalid sizes %s\n", optarg);
+                return(1);
+            }
+
+            break;
+
+        case 't':
+            secs = atof(optarg);
+
+            if(secs <= 0) {
+                fprintf(stderr, "Invalid run time %s\n", optarg);
+                return(1);
+            }
+
+            break;
+
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-k <kernel>] [-s [<min>:]<max>] [-c warm|cold] [-j <threads>]\n"
+                    "           [-t <secs>]\n",
+                    argv[0]);
+            return(1);
+        }
+    }
+
+    span = hi > BENCH_COLD ? hi : BENCH_COLD;
+
+    if(0 != posix_memalign((void **)&arena, BENCH_PAGE, span)) {
+        fprintf(stderr, "Can't alloc %zu bytes... bailing\n", span);
+        return(1);
+    }
+
+    // anything but zeros, and every page really there before it is timed
+    for(size_t i = 0; i < span; i++) {
+        arena[i] = (unsigned char)((i * 0x9e3779b1U) >> 13);
+    }
+
+    fprintf(stdout, "kernel\tsize\tcache\tthreads\treps\tbytes\tsecs\tgb_per_s\tcycles_per_byte\n");
+
+    for(size_t i = 0; i < sizeof(KERNELS) / sizeof(KERNELS[0]); i++) {
+        const struct kernel * k = &KERNELS[i];
+
+        if(0 != only && 0 != strncmp(k->name, only, strlen(only))) {
+            continue;
+        }
+
+        if(0 != k->engine) {
+            hash_engine = hash_find(k->engine);
+        }
+
+        if(0 != k->isa && 0 != hash_use_kernel(k->isa)) {
+            fprintf(stderr, "Skipping %s; not supported here\n", k->name);
+            continue;
+        }
+
+        if(raw_afalg == k->raw && 0 != afalg_open(hash_engine->crypto)) {
+            fprintf(stderr, "Skipping %s; can't open an AF_ALG socket for %s; %s\n",
+                    k->name, hash_engine->crypto, strerror(errno));
+            continue;
+        }
+
+        for(size_t size = lo; size <= hi; size *= 4) {
+            for(int cold = 0; cold < 2; cold++) {
+                if(!(caches & (1 << cold))) {
+                    continue;
+                }
+
+                // one thread, then all of them
+                for(int t = 0; t < (threads > 1 && raw_afalg != k->raw ? 2 : 1); t++) {
+                    if(0 != bench(k, arena, span, size, cold, 0 == t ? 1 : threads, secs)) {
+                        afalg_close();
+                        free(arena);
+                        return(1);
+                    }
+                }
+            }
+
+            if(size > hi / 4) {
+                break;
+            }
+        }
+
+        afalg_close();
+    }
+
+    free(arena);
+    return(0);
+}
@@ -0,0 +1,255 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "cache.h"
+
+int cache_neutral = 0;
+
+const size_t CACHE_ALIGN = 4096;
+const size_t CACHE_WINDOW = 8 << 20;
+const size_t CACHE_SPAN = 64 << 20;
+
+/*
+ * A cache-neutral scan leaves the page cache the way it found it, so that
+ * indexing does not push out what the other programs on the host are
+ * using.  Files are read with O_DIRECT where the filesystem takes it, and
+ * otherwise through the cache with the next window asked for ahead of the
+ * cursor.  Either way, the pages behind the cursor that were not cached
+ * before it got there are dropped, and those that were are left be.
+ *
+ * Which pages were cached is noted a span or two ahead of the cursor, not
+ * as it gets there: reading a page someone else read ahead of starts the
+ * kernel reading ahead again, whatever the file's advice, so by the time
+ * the cursor reaches a page it may well be cached because of the scan.
+ */
+static struct {
+    pthread_mutex_t lock;
+    double read;
+    double before;
+    double after;
+} cache = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0};
+
+static size_t
+cache_page(void)
+{
+    static size_t page = 0;
+
+    if(0 == page) {
+        long n = sysconf(_SC_PAGESIZE);
+        page = n > 0 ? (size_t)n : 4096;
+    }
+
+    return page;
+}
+
+/*
+ * 0 if reads of fd now go around the cache, with buffers and offsets
+ * CACHE_ALIGN'd; else -1 and they go through it, as cache_buffered().
+ */
+int
+cache_direct(int fd)
+{
+#if defined(O_DIRECT)
+    int flags = fcntl(fd, F_GETFL);
+
+    if(flags >= 0 && 0 == fcntl(fd, F_SETFL, flags | O_DIRECT)) {
+        return 0;
+    }
+#endif
+
+    cache_buffered(fd);
+    return -1;
+}
+
+/*
+ * Reads of fd go through the cache, for a filesystem that does not take
+ * O_DIRECT or takes it and then fails the reads.  The kernel reads ahead
+ * no more than it has to; cache_ahead() asks for the rest.
+ */
+void
+cache_buffered(int fd)
+{
+#if defined(O_DIRECT)
+    int flags = fcntl(fd, F_GETFL);
+
+    if(flags >= 0 && (flags & O_DIRECT)) {
+        fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+    }
+#endif
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+}
+
+void
+cache_ahead(int fd, off_t off, size_t len)
+{
+    posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED);
+}
+
+/* mapping the pages to ask does not read them; if it fails, all of them are dropped */
+static void
+cache_mark(struct cache_mark * m, int fd, off_t off, size_t len)
+{
+    void * p;
+
+    memset(m, 0, sizeof(*m));
+    m->off = off;
+    m->len = len;
+
+    if(MAP_FAILED == (p = mmap(0, len, PROT_READ, MAP_SHARED, fd, off))) {
+        return;
+    }
+
+    if(0 == (m->vec = malloc(len / cache_page())) || 0 != mincore(p, len, m->vec)) {
+        free(m->vec);
+        m->vec = 0;
+        munmap(p, len);
+        return;
+    }
+
+    m->map = p;
+}
+
+/* how many bytes the cursor read are on cached pages of m between from and to */
+static double
+cache_resident(const struct cache_cursor * c, const struct cache_mark * m, size_t from, size_t to)
+{
+    const size_t page = cache_page();
+    double n = 0;
+
+    for(size_t i = from / page; i < to / page; i++) {
+        off_t lo = m->off + (off_t)(i * page);
+        off_t hi = lo + (off_t)page;
+
+        lo = lo > c->start ? lo : c->start;
+        hi = hi < c->at ? hi : c->at;
+        n += (m->vec[i] & 1) && hi > lo ? (double)(hi - lo) : 0;
+    }
+
+    return n;
+}
+
+/* drops the pages of m before upto, a page boundary, that were not cached before */
+static void
+cache_drop(struct cache_cursor * c, struct cache_mark * m, off_t upto)
+{
+    const size_t page = cache_page();
+    size_t end = upto > m->off ? (size_t)(upto - m->off) : 0;
+    double before = 0;
+    double after = 0;
+
+    end = end < m->len ? end : m->len;
+
+    if(end <= m->done) {
+        return;
+    }
+
+    if(0 == m->vec) {
+        posix_fadvise(c->fd, m->off + (off_t)m->done, end - m->done, POSIX_FADV_DONTNEED);
+    } else {
+        before = cache_resident(c, m, m->done, end);
+
+        for(size_t i = m->done / page, j; i < end / page; i = j) {
+            for(j = i + 1; j < end / page && (m->vec[i] & 1) == (m->vec[j] & 1); j++) {
+            }
+
+            if(!(m->vec[i] & 1)) {
+                posix_fadvise(c->fd, m->off + (off_t)(i * page), (j - i) * page,
+                              POSIX_FADV_DONTNEED);
+            }
+        }
+
+        if(0 == mincore(m->map + m->done, end - m->done, m->vec + m->done / page)) {
+            after = cache_resident(c, m, m->done, end);
+        }
+
+        munmap(m->map + m->done, end - m->done);
+    }
+
+    m->done = end;
+
+    if(m->done == m->len) {
+        free(m->vec);
+        m->vec = 0;
+        m->map = 0;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    cache.before += before;
+    cache.after += after;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/*
+ * Starts reading fd from off, marking what is cached of the two spans
+ * ahead.  No single advance may skip more than span bytes.  Pages are let
+ * go of a whole window at a time, since the kernel keeps file data in
+ * pieces of up to a few megabytes and drops none it is only asked to drop
+ * part of.
+ */
+void
+cache_open(struct cache_cursor * c, int fd, off_t off, size_t span)
+{
+    const size_t page = cache_page();
+    const off_t base = off & ~(off_t)(page - 1);
+
+    c->fd = fd;
+    c->start = off;
+    c->at = off;
+    c->span = span > page ? (span + page - 1) & ~(page - 1) : page;
+
+    if(c->span > CACHE_WINDOW) {
+        c->span = (c->span + CACHE_WINDOW - 1) / CACHE_WINDOW * CACHE_WINDOW;
+    }
+    cache_mark(&c->near, fd, base, c->span);
+    cache_mark(&c->far, fd, base + (off_t)c->span, c->span);
+}
+
+/* the cursor has read up to upto; drops what is behind it that was not cached before */
+void
+cache_advance(struct cache_cursor * c, off_t upto)
+{
+    c->at = upto > c->at ? upto : c->at;
+
+    while(c->at >= c->far.off) {
+        cache_drop(c, &c->near, c->far.off);
+        c->near = c->far;
+        cache_mark(&c->far, c->fd, c->near.off + (off_t)c->near.len, c->span);
+    }
+
+    cache_drop(c, &c->near, c->at / (off_t)CACHE_WINDOW * (off_t)CACHE_WINDOW);
+}
+
+/* drops the rest of what the scan brought in, read or read ahead */
+void
+cache_close(struct cache_cursor * c)
+{
+    cache_drop(c, &c->near, c->near.off + (off_t)c->near.len);
+    cache_drop(c, &c->far, c->far.off + (off_t)c->far.len);
+
+    pthread_mutex_lock(&cache.lock);
+    cache.read += (double)(c->at - c->start);
+    pthread_mutex_unlock(&cache.lock);
+
+    memset(c, 0, sizeof(*c));
+}
+
+/* how much of what was read was cached before and after, so the scan's footprint shows */
+void
+cache_report(void)
+{
+    if(cache_neutral && cache.read > 0) {
+        fprintf(stderr, "Read %0.1f MB cache-neutrally; %0.1f MB of it was cached before, "
+                "%0.1f MB after\n", cache.read / 1e6, cache.before / 1e6, cache.after / 1e6);
+    }
+
+    cache.read = cache.before = cache.after = 0;
+}
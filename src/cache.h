@@ -0,0 +1,39 @@
+#ifndef _SRC_CACHE_H_
+#define _SRC_CACHE_H_
+
+#include <sys/types.h>
+
+extern int cache_neutral;
+
+extern const size_t CACHE_ALIGN;
+extern const size_t CACHE_WINDOW;
+extern const size_t CACHE_SPAN;
+
+/* which pages of part of a file were cached before it was read; the first done bytes are let go */
+struct cache_mark {
+    char * map;
+    off_t off;
+    size_t len;
+    size_t done;
+    unsigned char * vec;
+};
+
+/* a file read front to back from start, up to at so far; a zeroed one can be closed */
+struct cache_cursor {
+    int fd;
+    off_t start;
+    off_t at;
+    size_t span;
+    struct cache_mark near;
+    struct cache_mark far;
+};
+
+int cache_direct(int);
+void cache_buffered(int);
+void cache_ahead(int, off_t, size_t);
+void cache_open(struct cache_cursor *, int, off_t, size_t);
+void cache_advance(struct cache_cursor *, off_t);
+void cache_close(struct cache_cursor *);
+void cache_report(void);
+
+#endif /*_SRC_CACHE_H_*/
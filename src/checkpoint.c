@@ -0,0 +1,204 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "checkpoint.h"
+#include "index.h"
+#include "walk.h"
+#include "sqlite/sqlite3.h"
+
+const size_t CHECKPOINT_ENTRIES = 10000;
+const int CHECKPOINT_SECS = 30;
+
+/*
+ * A scan that owns its transaction commits every CHECKPOINT_ENTRIES entries
+ * or CHECKPOINT_SECS seconds, and each commit also stores the last entry
+ * retired so far under "checkpoint:<root>".  The walk order is fixed, so
+ * that one path stands for the whole frontier: every directory on the way
+ * down to it is partly done, everything that sorts before it is done, and
+ * the rest is pending.  A resumed scan hands it to the walker as walk_after.
+ */
+static struct {
+    char * key;
+    char * last;
+    size_t root_len;
+    size_t entries;
+    struct timespec since;
+    int txn;
+} progress;
+
+static struct timespec deadline;
+
+/* "90", "90s", "15m" or "8h" from now */
+int
+set_deadline(const char * const spec)
+{
+    char * end = 0;
+    double secs = strtod(spec, &end);
+
+    if(end == spec || secs <= 0) {
+        return -1;
+    }
+
+    switch(*end) {
+    case 'h':
+        secs *= 60;
+        /* fall through */
+    case 'm':
+        secs *= 60;
+        /* fall through */
+    case 's':
+        end++;
+        break;
+    }
+
+    if('\0' != *end) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)secs;
+    deadline.tv_nsec += (long)((secs - (time_t)secs) * 1e9);
+
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    return 0;
+}
+
+int
+past_deadline(void)
+{
+    struct timespec now;
+
+    if(0 == deadline.tv_sec) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline.tv_sec ||
+           (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+static int
+checkpoint(int done)
+{
+    char * zErrMsg = 0;
+    int rc = SQLITE_OK;
+
+    if(0 != progress.key) {
+        rc = set_meta(progress.key, done ? 0 : progress.last);
+    }
+
+    if(SQLITE_OK == rc) {
+        rc = sqlite3_exec(DB, "COMMIT", 0, 0, &zErrMsg);
+    }
+
+    if(SQLITE_OK == rc && !done) {
+        rc = sqlite3_exec(DB, "BEGIN", 0, 0, &zErrMsg);
+    }
+
+    if(SQLITE_OK != rc) {
+        fprintf(stderr, "Can't checkpoint %s; %s\n", progress.key ? progress.key : "scan",
+                zErrMsg ? zErrMsg : sqlite3_errmsg(DB));
+        sqlite3_free(zErrMsg);
+        progress.txn = sqlite3_get_autocommit(DB) ? 0 : progress.txn;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &progress.since);
+    progress.entries = 0;
+    return rc;
+}
+
+void
+note_progress(const char * const path)
+{
+    struct timespec now;
+
+    if(!progress.txn) {
+        return;
+    }
+
+    if(0 != progress.last) {
+        const char * rel = path + progress.root_len;
+
+        while('/' == *rel) {
+            rel++;
+        }
+
+        snprintf(progress.last, MAX_PATH, "%s", rel);
+    }
+
+    if(++progress.entries < CHECKPOINT_ENTRIES) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if(now.tv_sec - progress.since.tv_sec < CHECKPOINT_SECS) {
+            return;
+        }
+    }
+
+    checkpoint(0);
+}
+
+/* only a scan that is not already inside someone else's transaction checkpoints */
+void
+start_progress(const char * const dir)
+{
+    char * zErrMsg = 0;
+    char * root;
+
+    memset(&progress, 0, sizeof(progress));
+
+    if(!sqlite3_get_autocommit(DB)) {
+        return;
+    }
+
+    if(SQLITE_OK != sqlite3_exec(DB, "BEGIN", 0, 0, &zErrMsg)) {
+        fprintf(stderr, "Can't begin scan of %s; %s\n", dir, zErrMsg);
+        sqlite3_free(zErrMsg);
+        return;
+    }
+
+    progress.txn = 1;
+    progress.root_len = strlen(dir);
+    clock_gettime(CLOCK_MONOTONIC, &progress.since);
+
+    if(0 == (root = realpath(dir, NULL))) {
+        return;
+    }
+
+    if(0 != (progress.key = malloc(strlen(root) + sizeof("checkpoint:")))) {
+        sprintf(progress.key, "checkpoint:%s", root);
+    }
+
+    free(root);
+
+    if(0 == progress.key || 0 == (progress.last = calloc(1, MAX_PATH))) {
+        return;
+    }
+
+    if(resume_scan && 0 != (walk_after = get_meta(progress.key))) {
+        fprintf(stderr, "Resuming %s after %s\n", dir, walk_after);
+    }
+}
+
+/* a finished scan drops its checkpoint, an interrupted one keeps the last */
+void
+end_progress(int result)
+{
+    if(progress.txn) {
+        checkpoint(0 == result);
+    }
+
+    free((char *)walk_after);
+    free(progress.key);
+    free(progress.last);
+    walk_after = 0;
+    memset(&progress, 0, sizeof(progress));
+}
@@ -0,0 +1,15 @@
+#ifndef _SRC_CHECKPOINT_H_
+#define _SRC_CHECKPOINT_H_
+
+#include <stddef.h>
+
+extern const size_t CHECKPOINT_ENTRIES;
+extern const int CHECKPOINT_SECS;
+
+int set_deadline(const char * const);
+int past_deadline(void);
+void start_progress(const char * const);
+void note_progress(const char * const);
+void end_progress(int);
+
+#endif /*_SRC_CHECKPOINT_H_*/
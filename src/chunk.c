@@ -0,0 +1,224 @@
+#define _XOPEN_SOURCE 700
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chunk.h"
+
+size_t chunk_min = 0;
+size_t chunk_avg = 0;
+size_t chunk_max = 0;
+size_t chunk_fixed = 0;
+
+/*
+ * FastCDC: a gear hash, h = (h << 1) + GEAR[byte], rolls over the data and
+ * a chunk ends where the bits of h under a mask are all zero.  Nothing
+ * before chunk_min is looked at, a stricter mask is used up to chunk_avg
+ * and a looser one after it, which keeps sizes close to the average, and
+ * chunk_max is a hard cut.  The masks take the high bits of h, which
+ * depend on the last 63 bytes; the low bits only see the last few.  Bit 63
+ * is left out so that h can be rolled two bytes per step, checking the
+ * half-way value shifted up by one against the mask shifted up by one.
+ *
+ * The gear table comes from a fixed splitmix64 sequence.  It must never
+ * change, or existing databases stop sharing blobs with new scans.
+ */
+static uint64_t GEAR[256];
+static uint64_t GEAR2[256];
+static uint64_t mask_s;
+static uint64_t mask_l;
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void
+gear_init(void)
+{
+    uint64_t x = 0x6978636463676561ULL;
+
+    for(int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        GEAR[i] = z ^ (z >> 31);
+        GEAR2[i] = GEAR[i] << 1;
+    }
+}
+
+/* n bits from bit 62 down */
+static uint64_t
+high_bits(int n)
+{
+    return n <= 0 ? 0 : n >= 63 ? ~0ULL >> 1 : (~0ULL << (64 - n)) >> 1;
+}
+
+/* a byte count with an optional k, m or g suffix; *end is left after it */
+int
+parse_bytes(const char * s, char ** end, size_t * out)
+{
+    double v = strtod(s, end);
+
+    if(*end == s || v <= 0) {
+        return -1;
+    }
+
+    switch(tolower((unsigned char)**end)) {
+    case 'g':
+        v *= 1024;
+        /* fall through */
+    case 'm':
+        v *= 1024;
+        /* fall through */
+    case 'k':
+        v *= 1024;
+        (*end)++;
+        break;
+    }
+
+    *out = (size_t)v;
+    return 0;
+}
+
+/*
+ * "<avg>" or "<min>:<avg>:<max>", with k, m or g suffixes; a lone average
+ * gets a quarter of it as minimum and eight times it as maximum.  The
+ * average is rounded down to a power of two, which the masks need.
+ * "fixed:<size>" cuts every size bytes instead, whatever the content.
+ */
+int
+chunk_tune(const char * const spec)
+{
+    size_t v[3] = {0, 0, 0};
+    const char * s = spec;
+    char * end;
+    int n = 0;
+    int bits = 0;
+
+    if(0 == strncmp(spec, "fixed:", 6)) {
+        if(0 != parse_bytes(spec + 6, &end, &v[0]) || '\0' != *end || v[0] < 64) {
+            return -1;
+        }
+
+        chunk_min = chunk_avg = chunk_max = 0;
+        chunk_fixed = v[0];
+        return 0;
+    }
+
+    while(n < 3 && 0 == parse_bytes(s, &end, &v[n])) {
+        n++;
+
+        if(':' != *end) {
+            break;
+        }
+
+        s = end + 1;
+    }
+
+    if('\0' != *end || (1 != n && 3 != n)) {
+        return -1;
+    }
+
+    if(1 == n) {
+        v[1] = v[0];
+        v[0] = v[1] / 4;
+        v[2] = v[1] * 8;
+    }
+
+    while(((size_t)2 << bits) <= v[1]) {
+        bits++;
+    }
+
+    v[1] = (size_t)1 << bits;
+
+    if(v[0] < 64 || v[0] >= v[1] || v[1] >= v[2] || bits < 8) {
+        return -1;
+    }
+
+    pthread_once(&gear_once, gear_init);
+    chunk_fixed = 0;
+    chunk_min = v[0];
+    chunk_avg = v[1];
+    chunk_max = v[2];
+    mask_s = high_bits(bits + 2);
+    mask_l = high_bits(bits - 2);
+    return 0;
+}
+
+/* the settings as chunk_tune() takes them, for recording with the database */
+int
+chunk_spec(char * buf, size_t len)
+{
+    if(0 != chunk_fixed) {
+        return snprintf(buf, len, "fixed:%zu", chunk_fixed);
+    }
+
+    return snprintf(buf, len, "%zu:%zu:%zu", chunk_min, chunk_avg, chunk_max);
+}
+
+/* rolls *h over p[i..end); the length up to the first cut, or 0 if there is none */
+static size_t
+roll(const unsigned char * p, size_t i, size_t end, uint64_t * h, uint64_t mask)
+{
+    uint64_t x = *h;
+
+    for(; i + 1 < end; i += 2) {
+        x = (x << 2) + GEAR2[p[i]];
+
+        if(0 == (x & (mask << 1))) {
+            return i + 1;
+        }
+
+        x += GEAR[p[i + 1]];
+
+        if(0 == (x & mask)) {
+            return i + 2;
+        }
+    }
+
+    if(i < end) {
+        x = (x << 1) + GEAR[p[i]];
+
+        if(0 == (x & mask)) {
+            return i + 1;
+        }
+    }
+
+    *h = x;
+    return 0;
+}
+
+/* how long the chunk starting at p is, given len bytes are left */
+size_t
+chunk_cut(const unsigned char * p, size_t len)
+{
+    size_t normal = chunk_avg;
+    size_t cut;
+    uint64_t h = 0;
+
+    if(0 != chunk_fixed) {
+        return len < chunk_fixed ? len : chunk_fixed;
+    }
+
+    if(len <= chunk_min) {
+        return len;
+    }
+
+    if(len > chunk_max) {
+        len = chunk_max;
+    }
+
+    if(normal > len) {
+        normal = len;
+    }
+
+    if(0 != (cut = roll(p, chunk_min, normal, &h, mask_s)) ||
+            0 != (cut = roll(p, normal, len, &h, mask_l))) {
+        return cut;
+    }
+
+    return len;
+}
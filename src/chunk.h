@@ -0,0 +1,21 @@
+#ifndef _SRC_CHUNK_H_
+#define _SRC_CHUNK_H_
+
+#include <unistd.h>
+
+/*
+ * content-defined chunk sizes in bytes, or with chunk_fixed set, chunks
+ * of that many bytes each; with neither, a file is one blob up to the
+ * largest the database takes
+ */
+extern size_t chunk_min;
+extern size_t chunk_avg;
+extern size_t chunk_max;
+extern size_t chunk_fixed;
+
+int parse_bytes(const char *, char **, size_t *);
+int chunk_tune(const char * const);
+int chunk_spec(char *, size_t);
+size_t chunk_cut(const unsigned char *, size_t);
+
+#endif /*_SRC_CHUNK_H_*/
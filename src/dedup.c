@@ -0,0 +1,278 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "hash.h"
+#include "index.h"
+#include "walk.h"
+#include "sqlite/sqlite3.h"
+
+const size_t DEDUP_EDGE = 4 << 10;
+
+/*
+ * A dedup scan only hashes what could be a duplicate.  The whole walk is
+ * collected first and grouped by size; a size only one inode has is
+ * recorded with hash 0 and partial 0.  Inodes that share a size are told
+ * apart by a hash of their first and last DEDUP_EDGE bytes, and only those
+ * whose edges also match are hashed in full.  Rows are written in walk
+ * order once every file has been placed.
+ */
+enum {
+    DEDUP_FULL,
+    DEDUP_SIZE,
+    DEDUP_EDGES,
+};
+
+struct candidate {
+    struct walk_entry e;
+    size_t order;
+    struct hash_key edges;
+    int state;
+};
+
+static struct {
+    struct candidate * v;
+    size_t count;
+    size_t cap;
+} dedup;
+
+static int
+collect_entry(const struct walk_entry * const e, void * arg)
+{
+    if(WALK_F != e->type) {
+        index_entry(e);
+        return 0;
+    }
+
+    if(dedup.count == dedup.cap) {
+        size_t cap = 0 != dedup.cap ? 2 * dedup.cap : 1024;
+        struct candidate * v = realloc(dedup.v, cap * sizeof(struct candidate));
+
+        if(0 == v) {
+            return errno = ENOMEM;
+        }
+
+        dedup.v = v;
+        dedup.cap = cap;
+    }
+
+    struct candidate * c = &dedup.v[dedup.count];
+
+    memset(c, 0, sizeof(struct candidate));
+    c->e = *e;
+    c->order = dedup.count;
+
+    if(0 == (c->e.path = strdup(e->path))) {
+        return errno = ENOMEM;
+    }
+
+    dedup.count++;
+    return 0;
+}
+
+static int
+same_inode(const struct candidate * x, const struct candidate * y)
+{
+    return x->e.dev == y->e.dev && x->e.ino == y->e.ino;
+}
+
+static int
+by_size(const void * a, const void * b)
+{
+    const struct candidate * x = a;
+    const struct candidate * y = b;
+
+    if(x->e.size != y->e.size) {
+        return x->e.size < y->e.size ? -1 : 1;
+    }
+
+    if(x->e.dev != y->e.dev) {
+        return x->e.dev < y->e.dev ? -1 : 1;
+    }
+
+    if(x->e.ino != y->e.ino) {
+        return x->e.ino < y->e.ino ? -1 : 1;
+    }
+
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int
+by_edges(const void * a, const void * b)
+{
+    const struct candidate * x = a;
+    const struct candidate * y = b;
+
+    int c = memcmp(x->edges.b, y->edges.b, hash_key_bytes);
+
+    if(0 != c) {
+        return c;
+    }
+
+    return by_size(a, b);
+}
+
+static int
+by_order(const void * a, const void * b)
+{
+    const struct candidate * x = a;
+    const struct candidate * y = b;
+
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* inodes in v[0..n), which are sorted so that the links of one are together */
+static size_t
+count_inodes(const struct candidate * v, size_t n)
+{
+    size_t inodes = 0;
+
+    for(size_t i = 0; i < n; i++) {
+        inodes += 0 == i || !same_inode(&v[i - 1], &v[i]);
+    }
+
+    return inodes;
+}
+
+/* hash of the first and last DEDUP_EDGE bytes, or -1 if the file can't be read */
+static int
+hash_edges(const struct walk_entry * const e, struct hash_key * edges)
+{
+    unsigned char digest[HASH_MAX];
+    union hash_state h;
+    FILE * fp = open_regular(e->path);
+    char * buf = malloc(2 * DEDUP_EDGE);
+    int rc = -1;
+
+    if(0 != fp && 0 != buf &&
+            (ssize_t)DEDUP_EDGE == pread(fileno(fp), buf, DEDUP_EDGE, 0) &&
+            (ssize_t)DEDUP_EDGE == pread(fileno(fp), buf + DEDUP_EDGE, DEDUP_EDGE,
+                                         e->size - DEDUP_EDGE)) {
+        hash_engine->init(&h);
+        hash_engine->update(&h, buf, 2 * DEDUP_EDGE);
+        hash_engine->final(&h, digest);
+        *edges = hash_key(digest);
+        rc = 0;
+    }
+
+    if(0 != fp) {
+        fclose(fp);
+    }
+
+    free(buf);
+    return rc;
+}
+
+/* places the inodes of one size in v[0..n), whose edges are worth comparing */
+static void
+split_edges(struct candidate * v, size_t n)
+{
+    for(size_t i = 0; i < n; i++) {
+        if(0 != i && same_inode(&v[i - 1], &v[i])) {
+            v[i].edges = v[i - 1].edges;
+            v[i].state = v[i - 1].state;
+        } else if(0 != hash_edges(&v[i].e, &v[i].edges)) {
+            // let the full read report it
+            v[i].state = DEDUP_FULL;
+        } else {
+            v[i].state = DEDUP_EDGES;
+        }
+    }
+
+    qsort(v, n, sizeof(struct candidate), by_edges);
+
+    for(size_t i = 0, j; i < n; i = j) {
+        for(j = i + 1; j < n && 0 == memcmp(v[j].edges.b, v[i].edges.b, hash_key_bytes); j++);
+
+        if(DEDUP_EDGES == v[i].state && count_inodes(v + i, j - i) > 1) {
+            for(size_t k = i; k < j; k++) {
+                v[k].state = DEDUP_FULL;
+            }
+        }
+    }
+}
+
+static void
+retire_candidate(struct candidate * c)
+{
+    const struct walk_entry * const e = &c->e;
+    char name[2 * HASH_MAX + 1];
+
+    if(DEDUP_FULL == c->state) {
+        index_entry(e);
+        return;
+    }
+
+    fprintf(stdout, " ... %s (%0.0f) ", e->path, (double)e->size);
+
+    if(DEDUP_SIZE == c->state) {
+        // c->edges is still all zero
+        record_file(e, &c->edges, e->size, 0);
+        fprintf(stdout, "(unique size)\n");
+    } else {
+        record_file(e, &c->edges, e->size, (sqlite3_int64)(2 * DEDUP_EDGE));
+        hash_key_str(&c->edges, name, sizeof(name));
+        fprintf(stdout, "%s (edges only)\n", name);
+    }
+}
+
+static void
+dedup_files(void)
+{
+    struct candidate * v = dedup.v;
+    size_t n = dedup.count;
+
+    qsort(v, n, sizeof(struct candidate), by_size);
+
+    for(size_t i = 0, j; i < n; i = j) {
+        for(j = i + 1; j < n && v[j].e.size == v[i].e.size; j++);
+
+        if(1 == count_inodes(v + i, j - i)) {
+            for(size_t k = i; k < j; k++) {
+                v[k].state = DEDUP_SIZE;
+            }
+        } else if((size_t)v[i].e.size > 2 * DEDUP_EDGE) {
+            split_edges(v + i, j - i);
+        }
+    }
+
+    qsort(v, n, sizeof(struct candidate), by_order);
+
+    for(size_t i = 0; i < n; i++) {
+        retire_candidate(&v[i]);
+        free((char *)v[i].e.path);
+    }
+
+    free(dedup.v);
+    memset(&dedup, 0, sizeof(dedup));
+}
+
+/* a scan in one transaction of its own; there is no walk order to checkpoint */
+int
+dedup_directory(const char * const dir)
+{
+    char * zErrMsg = 0;
+    int txn = sqlite3_get_autocommit(DB) &&
+              SQLITE_OK == sqlite3_exec(DB, "BEGIN", 0, 0, NULL);
+    int result = walk_tree(dir, collect_entry, 0);
+
+    if(result < 0) {
+        result = errno;
+    }
+
+    dedup_files();
+
+    if(txn && SQLITE_OK != sqlite3_exec(DB, "COMMIT", 0, 0, &zErrMsg)) {
+        fprintf(stderr, "Can't commit scan of %s; %s\n", dir, zErrMsg);
+        sqlite3_free(zErrMsg);
+        result = EIO;
+    }
+
+    return result;
+}
@@ -0,0 +1,10 @@
+#ifndef _SRC_DEDUP_H_
+#define _SRC_DEDUP_H_
+
+#include <stddef.h>
+
+extern const size_t DEDUP_EDGE;
+
+int dedup_directory(const char * const);
+
+#endif /*_SRC_DEDUP_H_*/
@@ -0,0 +1,584 @@
+#define _XOPEN_SOURCE 700
+
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "filter.h"
+#include "table.h"
+#include "walk.h"
+#include "fnv/fnv.h"
+
+/*
+ * Rules, one per line, '#' starting a comment:
+ *
+ *     exclude name|path <glob>    drop matching entries; a directory takes
+ *                                 its whole subtree with it
+ *     include name|path <glob>    once any is given, only files matching
+ *                                 one of them are indexed
+ *     size <range>                files between these sizes, 10k..2G
+ *     mtime <range>               files modified in this range; times are
+ *                                 @<epoch>, YYYY-MM-DD[THH:MM[:SS]] or an
+ *                                 age such as 7d, 12h, 30m
+ *     type <f|d|l|o>...           only report these kinds of entries;
+ *                                 directories are still descended
+ *     maxdepth <n>                go no deeper than n below the root
+ *     xdev                        do not descend into other filesystems
+ *
+ * A range is lo..hi with either end optional, or a single exact value.
+ * Name globs see the entry's name and path globs its path below the
+ * root, where '*' also matches '/'.  Everything is compiled once: plain
+ * names go into a hash table and "*.ext" or "prefix*" patterns become
+ * suffix and prefix compares, leaving fnmatch for the rest.  Exclusions
+ * and depth are decided from the name before the entry is even stat'ed.
+ */
+
+enum {
+    GLOB_ALL,
+    GLOB_PREFIX,
+    GLOB_SUFFIX,
+    GLOB_MATCH,
+};
+
+struct glob {
+    int kind;
+    char * pat;
+    size_t len;
+};
+
+struct globs {
+    struct table literal;
+    struct glob * v;
+    size_t n;
+};
+
+struct filter {
+    struct globs exclude_name;
+    struct globs exclude_path;
+    struct globs include_name;
+    struct globs include_path;
+    int64_t size_min;
+    int64_t size_max;
+    int64_t mtime_min;
+    int64_t mtime_max;
+    unsigned types;
+    int maxdepth;
+    int xdev;
+};
+
+static const size_t FILTER_LINE = 4096;
+
+static int
+same_string(const void * val, const void * arg)
+{
+    return 0 == strcmp((const char *)val, (const char *)arg);
+}
+
+static int
+globs_add(struct globs * g, const char * const pat)
+{
+    size_t len = strlen(pat);
+    char * copy;
+    struct glob * v;
+
+    if(0 == len || 0 == (copy = strdup(pat))) {
+        return -1;
+    }
+
+    if(0 == strpbrk(pat, "*?[\\")) {
+        if(0 != table_put(&g->literal, fnv_64a_str(copy, FNV1A_64_INIT), copy)) {
+            free(copy);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if(0 == (v = realloc(g->v, (g->n + 1) * sizeof(struct glob)))) {
+        free(copy);
+        return -1;
+    }
+
+    g->v = v;
+    v = &g->v[g->n++];
+    v->pat = copy;
+    v->len = len;
+    v->kind = GLOB_MATCH;
+
+    if(0 == strcmp(pat, "*")) {
+        v->kind = GLOB_ALL;
+    } else if('*' == pat[0] && 0 == strpbrk(pat + 1, "*?[\\")) {
+        v->kind = GLOB_SUFFIX;
+        memmove(v->pat, v->pat + 1, len);
+        v->len = len - 1;
+    } else if('*' == pat[len - 1] && strpbrk(pat, "*?[\\") == pat + len - 1) {
+        v->kind = GLOB_PREFIX;
+        v->pat[--v->len] = '\0';
+    }
+
+    return 0;
+}
+
+static int
+globs_match(const struct globs * g, const char * const s)
+{
+    size_t len;
+
+    if(0 != g->literal.count &&
+            0 != table_get(&g->literal, fnv_64a_str((char *)s, FNV1A_64_INIT), same_string, s)) {
+        return 1;
+    }
+
+    len = 0 != g->n ? strlen(s) : 0;
+
+    for(size_t i = 0; i < g->n; i++) {
+        const struct glob * v = &g->v[i];
+
+        switch(v->kind) {
+        case GLOB_ALL:
+            return 1;
+
+        case GLOB_PREFIX:
+            if(0 == strncmp(s, v->pat, v->len)) {
+                return 1;
+            }
+
+            break;
+
+        case GLOB_SUFFIX:
+            if(len >= v->len && 0 == memcmp(s + len - v->len, v->pat, v->len)) {
+                return 1;
+            }
+
+            break;
+
+        default:
+            if(0 == fnmatch(v->pat, s, 0)) {
+                return 1;
+            }
+
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int
+globs_empty(const struct globs * g)
+{
+    return 0 == g->n && 0 == g->literal.count;
+}
+
+static void
+globs_free(struct globs * g)
+{
+    table_free(&g->literal, free);
+
+    for(size_t i = 0; i < g->n; i++) {
+        free(g->v[i].pat);
+    }
+
+    free(g->v);
+    memset(g, 0, sizeof(struct globs));
+}
+
+static int
+parse_size(const char * s, const char * end, int64_t * out)
+{
+    char buf[64];
+    char * unit;
+    double v;
+    size_t len = end - s;
+
+    if(0 == len || len >= sizeof(buf)) {
+        return -1;
+    }
+
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    end = buf + len;
+    v = strtod(buf, &unit);
+
+    if(unit == buf || v < 0) {
+        return -1;
+    }
+
+    if(unit < end) {
+        switch(tolower((unsigned char)*unit++)) {
+        case 't':
+            v *= 1024;
+            /* fall through */
+        case 'g':
+            v *= 1024;
+            /* fall through */
+        case 'm':
+            v *= 1024;
+            /* fall through */
+        case 'k':
+            v *= 1024;
+            break;
+
+        default:
+            return -1;
+        }
+
+        if(unit < end && 'b' == tolower((unsigned char)*unit)) {
+            unit++;
+        }
+    }
+
+    *out = (int64_t)v;
+    return unit == end ? 0 : -1;
+}
+
+static int
+parse_time(const char * s, const char * end, int64_t * out)
+{
+    char buf[64];
+    struct tm tm = {0};
+    long long v = 0;
+    char unit = 0;
+    int used = 0;
+    size_t len = end - s;
+
+    if(0 == len || len >= sizeof(buf)) {
+        return -1;
+    }
+
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+
+    if('@' == buf[0] && 1 == sscanf(buf + 1, "%lld%n", &v, &used) && '\0' == buf[1 + used]) {
+        *out = (int64_t)v * 1000000000;
+        return 0;
+    }
+
+    if(3 == sscanf(buf, "%d-%d-%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &used)) {
+        int more = 0;
+
+        if('T' == buf[used] &&
+                2 > sscanf(buf + used, "T%d:%d%n:%d%n", &tm.tm_hour, &tm.tm_min,
+                           &more, &tm.tm_sec, &more)) {
+            return -1;
+        }
+
+        if('\0' != buf[used + more]) {
+            return -1;
+        }
+
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        *out = (int64_t)mktime(&tm) * 1000000000;
+        return 0;
+    }
+
+    if(2 == sscanf(buf, "%lld%c%n", &v, &unit, &used) && '\0' == buf[used]) {
+        static const char units[] = "smhdw";
+        static const long long secs[] = {1, 60, 3600, 86400, 604800};
+        const char * u = strchr(units, unit);
+
+        if(0 == u || '\0' == unit) {
+            return -1;
+        }
+
+        *out = ((int64_t)time(0) - v * secs[u - units]) * 1000000000;
+        return 0;
+    }
+
+    return -1;
+}
+
+static int
+parse_range(const char * s, int (*parse)(const char *, const char *, int64_t *),
+            int64_t * lo, int64_t * hi)
+{
+    const char * dots = strstr(s, "..");
+    const char * end = s + strlen(s);
+    int64_t a = INT64_MIN;
+    int64_t b = INT64_MAX;
+
+    if(0 == dots) {
+        if(0 != parse(s, end, &a)) {
+            return -1;
+        }
+
+        b = a;
+    } else if((dots > s && 0 != parse(s, dots, &a)) ||
+              (dots + 2 < end && 0 != parse(dots + 2, end, &b)) ||
+              (dots == s && dots + 2 == end)) {
+        return -1;
+    }
+
+    // several rules narrow the range further
+    *lo = a > *lo ? a : *lo;
+    *hi = b < *hi ? b : *hi;
+    return 0;
+}
+
+static int
+invalid(void)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+struct filter *
+filter_new(void)
+{
+    struct filter * f = calloc(1, sizeof(struct filter));
+
+    if(0 == f) {
+        return 0;
+    }
+
+    f->size_min = f->mtime_min = INT64_MIN;
+    f->size_max = f->mtime_max = INT64_MAX;
+    f->maxdepth = -1;
+    return f;
+}
+
+/* parses a single rule; returns -1 with errno set when it is not one */
+int
+filter_rule(struct filter * f, const char * const line)
+{
+    char word[16];
+    char kind[8];
+    int used = 0;
+    int more = 0;
+    const char * arg;
+
+    if(1 != sscanf(line, "%15s%n", word, &used)) {
+        return invalid();
+    }
+
+    arg = line + used;
+
+    while(isspace((unsigned char)*arg)) {
+        arg++;
+    }
+
+    if(0 == strcmp(word, "exclude") || 0 == strcmp(word, "include")) {
+        int ex = 'e' == word[0];
+        struct globs * g;
+
+        if(1 != sscanf(arg, "%7s%n", kind, &more)) {
+            return invalid();
+        }
+
+        if(0 == strcmp(kind, "name")) {
+            g = ex ? &f->exclude_name : &f->include_name;
+        } else if(0 == strcmp(kind, "path")) {
+            g = ex ? &f->exclude_path : &f->include_path;
+        } else {
+            return invalid();
+        }
+
+        arg += more;
+
+        while(isspace((unsigned char)*arg)) {
+            arg++;
+        }
+
+        return 0 == globs_add(g, arg) ? 0 : invalid();
+    }
+
+    if(0 == strcmp(word, "size")) {
+        return 0 == parse_range(arg, parse_size, &f->size_min, &f->size_max)
+               ? 0 : invalid();
+    }
+
+    if(0 == strcmp(word, "mtime")) {
+        return 0 == parse_range(arg, parse_time, &f->mtime_min, &f->mtime_max)
+               ? 0 : invalid();
+    }
+
+    if(0 == strcmp(word, "type")) {
+        static const char letters[] = "fdlo";
+        static const int types[] = {WALK_F, WALK_D, WALK_SL, WALK_OTHER};
+
+        for(; '\0' != *arg; arg++) {
+            const char * l = strchr(letters, *arg);
+
+            if(isspace((unsigned char)*arg)) {
+                continue;
+            }
+
+            if(0 == l) {
+                return invalid();
+            }
+
+            f->types |= 1u << types[l - letters];
+        }
+
+        return 0 != f->types ? 0 : invalid();
+    }
+
+    if(0 == strcmp(word, "maxdepth")) {
+        return 1 == sscanf(arg, "%d%n", &f->maxdepth, &more) && '\0' == arg[more] &&
+               f->maxdepth >= 0 ? 0 : invalid();
+    }
+
+    if(0 == strcmp(word, "xdev") && '\0' == *arg) {
+        f->xdev = 1;
+        return 0;
+    }
+
+    return invalid();
+}
+
+int
+filter_file(struct filter * f, const char * const path)
+{
+    char * line = malloc(FILTER_LINE);
+    FILE * fd = fopen(path, "r");
+    int lineno = 0;
+    int rc = 0;
+
+    if(0 == fd || 0 == line) {
+        fprintf(stderr, "Can't open file %s; %s\n", path, strerror(errno));
+        free(line);
+
+        if(0 != fd) {
+            fclose(fd);
+        }
+
+        return -1;
+    }
+
+    while(0 == rc && 0 != fgets(line, FILTER_LINE, fd)) {
+        char * p = line;
+        size_t len = strlen(line);
+
+        lineno++;
+
+        while(len > 0 && isspace((unsigned char)line[len - 1])) {
+            line[--len] = '\0';
+        }
+
+        while(isspace((unsigned char)*p)) {
+            p++;
+        }
+
+        if('\0' == *p || '#' == *p) {
+            continue;
+        }
+
+        if(0 != (rc = filter_rule(f, p))) {
+            fprintf(stderr, "%s:%d: Invalid filter rule %s\n", path, lineno, p);
+        }
+    }
+
+    fclose(fd);
+    free(line);
+    return rc;
+}
+
+/* builds "dir/name" in buf, or returns 0 when it does not fit */
+static const char *
+rel_name(char * buf, size_t cap, const char * const dir, const char * const name)
+{
+    int len = '\0' == *dir ? snprintf(buf, cap, "%s", name)
+              : snprintf(buf, cap, "%s/%s", dir, name);
+
+    return len >= 0 && (size_t)len < cap ? buf : 0;
+}
+
+static int
+drop_name(const char * const dir, const char * const name, int depth, void * arg)
+{
+    const struct filter * f = arg;
+    char buf[4096];
+    const char * path;
+
+    if(f->maxdepth >= 0 && depth > f->maxdepth) {
+        return 1;
+    }
+
+    if(globs_match(&f->exclude_name, name)) {
+        return 1;
+    }
+
+    if(!globs_empty(&f->exclude_path) && 0 != (path = rel_name(buf, sizeof(buf), dir, name))) {
+        return globs_match(&f->exclude_path, path);
+    }
+
+    return 0;
+}
+
+static int
+judge_entry(const char * const dir, const char * const name,
+            const struct walk_entry * const e, void * arg)
+{
+    const struct filter * f = arg;
+    char buf[4096];
+    const char * path;
+
+    if(WALK_D == e->type) {
+        int prune = f->maxdepth >= 0 && e->depth >= f->maxdepth;
+
+        if(0 != f->types && !(f->types & (1u << WALK_D))) {
+            return prune ? WALK_SKIP : WALK_HIDE;
+        }
+
+        return prune ? WALK_PRUNE : WALK_KEEP;
+    }
+
+    if(0 != f->types && !(f->types & (1u << e->type))) {
+        return WALK_SKIP;
+    }
+
+    if(WALK_F == e->type &&
+            (e->size < f->size_min || e->size > f->size_max ||
+             e->mtime_ns < f->mtime_min || e->mtime_ns > f->mtime_max)) {
+        return WALK_SKIP;
+    }
+
+    if(globs_empty(&f->include_name) && globs_empty(&f->include_path)) {
+        return WALK_KEEP;
+    }
+
+    if(globs_match(&f->include_name, name)) {
+        return WALK_KEEP;
+    }
+
+    if(0 != (path = rel_name(buf, sizeof(buf), dir, name)) &&
+            globs_match(&f->include_path, path)) {
+        return WALK_KEEP;
+    }
+
+    return WALK_SKIP;
+}
+
+void
+filter_hooks(struct filter * f, struct walk_filter * hooks)
+{
+    memset(hooks, 0, sizeof(struct walk_filter));
+    hooks->arg = f;
+    hooks->xdev = f->xdev;
+    hooks->entry = judge_entry;
+
+    if(f->maxdepth >= 0 || !globs_empty(&f->exclude_name) || !globs_empty(&f->exclude_path)) {
+        hooks->name = drop_name;
+    }
+}
+
+void
+filter_free(struct filter * f)
+{
+    if(0 == f) {
+        return;
+    }
+
+    globs_free(&f->exclude_name);
+    globs_free(&f->exclude_path);
+    globs_free(&f->include_name);
+    globs_free(&f->include_path);
+    free(f);
+}
@@ -0,0 +1,13 @@
+#ifndef _SRC_FILTER_H_
+#define _SRC_FILTER_H_
+
+struct filter;
+struct walk_filter;
+
+struct filter * filter_new(void);
+int filter_rule(struct filter *, const char * const);
+int filter_file(struct filter *, const char * const);
+void filter_hooks(struct filter *, struct walk_filter *);
+void filter_free(struct filter *);
+
+#endif /*_SRC_FILTER_H_*/
@@ -233,6 +233,10 @@ extern Fnv64_t fnv_64_str(char *buf, Fnv64_t hashval);
 extern Fnv64_t fnv_64a_buf(void *buf, size_t len, Fnv64_t hashval);
 extern Fnv64_t fnv_64a_str(char *buf, Fnv64_t hashval);
 
+/* hash_64a_lanes.c */
+#define FNV_64A_LANES 8		/* buffers hashed side by side */
+extern void fnv_64a_lanes(void **buf, size_t *len, Fnv64_t *hashval, int n);
+
 /* test_fnv.c */
 extern struct test_vector fnv_test_str[];
 extern struct fnv0_32_test_vector fnv0_32_vector[];
@@ -50,6 +50,8 @@
  * Share and Enjoy!	:-)
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -63,16 +65,20 @@
 #define WIDTH 32		/* bit width of hash */
 
 #define BUF_SIZE (32*1024)	/* number of bytes to hash at a time */
+#define JOB_BUF_SIZE (1024*1024)	/* bytes per read with -j or -0 */
+#define JOB_ALIGN 4096		/* alignment of each -j read buffer */
 
 static char *usage =
-"usage: %s [-b bcnt] [-m] [-s arg] [-t code] [-v] [arg ...]\n"
+"usage: %s [-b bcnt] [-j jobs] [-m] [-s arg] [-t code] [-v] [-0] [arg ...]\n"
 "\n"
 "\t-b bcnt\tmask off all but the lower bcnt bits (default 32)\n"
+"\t-j jobs\thash each file on its own, jobs files at a time (implies -m)\n"
 "\t-m\tmultiple hashes, one per line for each arg\n"
 "\t-s\thash arg as a string (ignoring terminating NUL bytes)\n"
 "\t-t code\t  test hash code: (0 ==> generate test vectors\n"
 "\t\t\t\t   1 ==> validate against FNV test vectors)\n"
 "\t-v\tverbose mode, print arg after hash (implies -m)\n"
+"\t-0\tread NUL terminated filenames from stdin, as -j 1 unless -j given\n"
 "\targ\tstring (if -s was given) or filename (default stdin)\n"
 "\n"
 "\tNOTE: Programs that begin with fnv0 implement the FNV-0 hash.\n"
@@ -224,6 +230,251 @@ test_fnv32(enum fnv_type hash_type, Fnv32_t init_hval,
 }
 
 
+/*
+ * file_job - one file hashed by -j or -0, kept in the order given
+ */
+struct file_job {
+    char *name;			/* file to hash */
+    Fnv32_t hval;		/* its hash, once done */
+    int err;			/* errno if it could not be hashed, else 0 */
+    int done;			/* 1 => hval or err is final */
+};
+
+static struct {
+    struct file_job *job;	/* every file, in input order */
+    int cnt;			/* number of files */
+    int next;			/* next file for a worker to take */
+    enum fnv_type hash_type;	/* type of FNV hash to perform */
+    Fnv32_t init_hval;		/* initial hash value of each file */
+    pthread_mutex_t lock;	/* guards next and every done */
+    pthread_cond_t cond;	/* signaled when a file is done */
+} pool;
+
+
+/*
+ * hash_job - hash one whole file from the initial hash value
+ *
+ * given:
+ *	job	file to hash
+ *	buf	JOB_BUF_SIZE byte read buffer
+ */
+static void
+hash_job(struct file_job *job, char *buf)
+{
+    Fnv32_t hval = pool.init_hval;	/* current hash value */
+    ssize_t readcnt;			/* number of bytes read */
+    int fd;				/* open file to process */
+
+    fd = open(job->name, O_RDONLY);
+    if (fd < 0) {
+	job->err = errno;
+	return;
+    }
+#if defined(POSIX_FADV_SEQUENTIAL)
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    while ((readcnt = read(fd, buf, JOB_BUF_SIZE)) != 0) {
+	if (readcnt < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    job->err = errno;
+	    break;
+	}
+	switch (pool.hash_type) {
+	case FNV0_32:
+	case FNV1_32:
+	    hval = fnv_32_buf(buf, readcnt, hval);
+	    break;
+	case FNV1a_32:
+	    hval = fnv_32a_buf(buf, readcnt, hval);
+	    break;
+	default:
+	    unknown_hash_type(program, pool.hash_type, 17);	/* exit(17) */
+	    /*NOTREACHED*/
+	}
+    }
+    close(fd);
+    job->hval = hval;
+}
+
+
+/*
+ * hash_worker - take files off the pool until none are left
+ */
+static void *
+hash_worker(void *arg)
+{
+    char *buf;		/* aligned read buffer */
+    int i;
+
+    (void) arg;
+    if (posix_memalign((void **)&buf, JOB_ALIGN, JOB_BUF_SIZE) != 0) {
+	buf = NULL;
+    }
+    for (;;) {
+	pthread_mutex_lock(&pool.lock);
+	i = pool.next++;
+	pthread_mutex_unlock(&pool.lock);
+	if (i >= pool.cnt) {
+	    break;
+	}
+	if (buf == NULL) {
+	    pool.job[i].err = ENOMEM;
+	} else {
+	    hash_job(&pool.job[i], buf);
+	}
+	pthread_mutex_lock(&pool.lock);
+	pool.job[i].done = 1;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+
+/*
+ * read_names - read NUL terminated filenames from stdin, as find -print0
+ *		writes them
+ *
+ * given:
+ *	names	where to return the filename vector
+ *
+ * returns:	number of filenames, the last one need not be terminated
+ */
+static int
+read_names(char ***names)
+{
+    char *buf = NULL;		/* all of stdin */
+    size_t len = 0;		/* bytes in buf */
+    size_t cap = 0;		/* bytes allocated for buf */
+    ssize_t readcnt;		/* number of bytes read */
+    size_t off;
+    int cnt = 0;
+
+    for (;;) {
+	if (len + BUF_SIZE + 1 > cap) {
+	    cap = cap ? 2*cap : 4*BUF_SIZE;
+	    if ((buf = realloc(buf, cap)) == NULL) {
+		fprintf(stderr, "%s: cannot allocate filename buffer\n",
+			program);
+		exit(18);
+	    }
+	}
+	readcnt = read(0, buf+len, BUF_SIZE);
+	if (readcnt < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (readcnt < 0) {
+	    fprintf(stderr, "%s: unable to read filenames from stdin\n",
+		    program);
+	    exit(18);
+	}
+	if (readcnt == 0) {
+	    break;
+	}
+	len += readcnt;
+    }
+    if (len > 0 && buf[len-1] != '\0') {
+	buf[len++] = '\0';
+    }
+
+    for (off = 0; off < len; off += strlen(buf+off) + 1) {
+	++cnt;
+    }
+    if ((*names = malloc((cnt+1) * sizeof(char *))) == NULL) {
+	fprintf(stderr, "%s: cannot allocate filename vector\n", program);
+	exit(18);
+    }
+    for (off = 0, cnt = 0; off < len; off += strlen(buf+off) + 1) {
+	(*names)[cnt++] = buf+off;
+    }
+    return cnt;
+}
+
+
+/*
+ * hash_files - hash each file on its own, jobs files at a time
+ *
+ * Every file starts from the initial hash value, unlike the serial
+ * -m mode, and the hashes are printed in the order the files were
+ * given no matter which finishes first.
+ *
+ * given:
+ *	names	  filenames to hash
+ *	cnt	  number of filenames
+ *	jobs	  number of files to hash at once
+ *	hash_type type of FNV hash to perform
+ *	init_hval initial hash value
+ *	mask	  lower bit mask
+ *	v_flag	  1 => print filename after hash
+ *
+ * returns:	0 ==> all files hashed, else 4
+ */
+static int
+hash_files(char **names, int cnt, int jobs, enum fnv_type hash_type,
+	   Fnv32_t init_hval, Fnv32_t mask, int v_flag)
+{
+    pthread_t *tid;		/* worker threads */
+    int started = 0;		/* number of workers running */
+    int ret = 0;
+    int i;
+
+    pool.job = calloc(cnt > 0 ? cnt : 1, sizeof(struct file_job));
+    tid = calloc(jobs, sizeof(pthread_t));
+    if (pool.job == NULL || tid == NULL) {
+	fprintf(stderr, "%s: cannot allocate file jobs\n", program);
+	exit(19);
+    }
+    for (i = 0; i < cnt; ++i) {
+	pool.job[i].name = names[i];
+    }
+    pool.cnt = cnt;
+    pool.next = 0;
+    pool.hash_type = hash_type;
+    pool.init_hval = init_hval;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    while (started < jobs && started < cnt &&
+	   pthread_create(&tid[started], NULL, hash_worker, NULL) == 0) {
+	++started;
+    }
+    if (started == 0) {
+	hash_worker(NULL);
+    }
+
+    /*
+     * print each file as soon as it and all before it are done
+     */
+    for (i = 0; i < cnt; ++i) {
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.job[i].done) {
+	    pthread_cond_wait(&pool.cond, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	if (pool.job[i].err != 0) {
+	    fflush(stdout);
+	    fprintf(stderr, "%s: unable to hash file: %s: %s\n",
+		    program, pool.job[i].name, strerror(pool.job[i].err));
+	    ret = 4;
+	} else {
+	    print_fnv32(pool.job[i].hval, mask, v_flag, pool.job[i].name);
+	}
+    }
+
+    while (started > 0) {
+	pthread_join(tid[--started], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    free(pool.job);
+    free(tid);
+    return ret;
+}
+
+
 /*
  * main - the main function
  *
@@ -240,6 +491,8 @@ main(int argc, char *argv[])
     int v_flag = 0;		/* 1 => verbose hash print */
     int b_flag = WIDTH;		/* -b flag value */
     int t_flag = -1;		/* FNV test vector code (0=>print, 1=>test) */
+    int j_flag = 0;		/* -j files hashed at once, 0 => serial */
+    int z_flag = 0;		/* 1 => -0 was given, read names from stdin */
     enum fnv_type hash_type = FNV_NONE;	/* type of FNV hash to perform */
     Fnv32_t bmask;		/* mask to apply to output */
     extern char *optarg;	/* option argument */
@@ -252,11 +505,20 @@ main(int argc, char *argv[])
      * parse args
      */
     program = argv[0];
-    while ((i = getopt(argc, argv, "b:mst:v")) != -1) {
+    while ((i = getopt(argc, argv, "b:j:mst:v0")) != -1) {
 	switch (i) {
 	case 'b':	/* bcnt bit mask count */
 	    b_flag = atoi(optarg);
 	    break;
+	case 'j':	/* hash files in parallel */
+	    j_flag = atoi(optarg);
+	    if (j_flag < 1) {
+		fprintf(stderr, "%s: -j jobs must be at least 1\n", program);
+		fprintf(stderr, usage, program, FNV_VERSION);
+		exit(1);
+	    }
+	    m_flag = 1;
+	    break;
 	case 'm':	/* print multiple hashes, one per arg */
 	    m_flag = 1;
 	    break;
@@ -276,6 +538,10 @@ main(int argc, char *argv[])
 	    m_flag = 1;
 	    v_flag = 1;
 	    break;
+	case '0':	/* NUL terminated filenames on stdin */
+	    m_flag = 1;
+	    z_flag = 1;
+	    break;
 	default:
 	    fprintf(stderr, usage, program, FNV_VERSION);
 	    exit(1);
@@ -296,6 +562,16 @@ main(int argc, char *argv[])
 	    exit(4);
 	}
     }
+    /* -j and -0 hash files, -0 only those named on stdin */
+    if ((j_flag > 0 || z_flag) && (s_flag || t_flag >= 0)) {
+	fprintf(stderr, "%s: -j and -0 incompatible with -s and -t\n",
+		program);
+	exit(20);
+    }
+    if (z_flag && optind < argc) {
+	fprintf(stderr, "%s: -0 incompatible with args\n", program);
+	exit(20);
+    }
     /* -s requires at least 1 arg */
     if (s_flag && optind >= argc) {
 	fprintf(stderr, usage, program, FNV_VERSION);
@@ -365,6 +641,20 @@ main(int argc, char *argv[])
 	}
     }
 
+    /*
+     * files hashed on their own and in parallel
+     */
+    if (z_flag || (j_flag > 0 && optind < argc)) {
+	char **names = argv + optind;	/* files to hash */
+	int cnt = argc - optind;	/* number of files */
+
+	if (z_flag) {
+	    cnt = read_names(&names);
+	}
+	exit(hash_files(names, cnt, j_flag > 0 ? j_flag : 1, hash_type,
+			hval, bmask, v_flag));
+    }
+
     /*
      * string hashing
      */
@@ -0,0 +1,330 @@
+/*
+ * hash_64a_lanes - 64 bit FNV-1a hash of several buffers side by side
+ *
+ ***
+ *
+ * FNV-1a is a single chain of xor and multiply per buffer: every byte
+ * waits for the product of the one before it, so one buffer keeps one
+ * multiplier busy and the rest of the core idle.  fnv_64a_lanes() hashes
+ * up to FNV_64A_LANES independent buffers at once, one byte of each per
+ * step, so their chains overlap.  On x86-64 the lanes live in SSE2, AVX2
+ * or AVX-512 registers, picked at run time; elsewhere they are plain
+ * 64 bit variables the compiler can schedule together.
+ *
+ * Vector units lack a full 64x64 multiply (AVX-512DQ has a slow one), but
+ * the FNV prime is 2^40 + 0x1b3, so
+ *
+ *	hval * FNV_64_PRIME == (hval << 40) + lo32(hval) * 0x1b3
+ *			       + ((hi32(hval) * 0x1b3) << 32)	(mod 2^64)
+ *
+ * which needs only the 32x32->64 multiplies every SIMD level has.  Each
+ * result is therefore exactly what fnv_64a_buf() returns for that buffer.
+ *
+ ***
+ *
+ * Please do not copyright this code.  This code is in the public domain.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "fnv.h"
+
+#if defined(HAVE_64BIT_LONG_LONG)
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define FNV_LANES_X86
+#endif
+
+#define FNV_64_PRIME_LOW ((Fnv64_t)0x1b3)
+
+typedef void (*lane_fn)(const unsigned char **, Fnv64_t *, size_t);
+
+#if !defined(FNV_LANES_X86)
+
+/*
+ * lanes_scalar - every lane advanced by len octets, one octet per step
+ */
+static void
+lanes_scalar(const unsigned char **p, Fnv64_t *hval, size_t len)
+{
+    Fnv64_t h[FNV_64A_LANES];
+    size_t off;
+    int i;
+
+    memcpy(h, hval, sizeof(h));
+    for (off = 0; off < len; ++off) {
+	for (i = 0; i < FNV_64A_LANES; ++i) {
+	    h[i] ^= (Fnv64_t)p[i][off];
+	    h[i] *= (Fnv64_t)0x100000001b3ULL;
+	}
+    }
+    memcpy(hval, h, sizeof(h));
+}
+
+#else /* FNV_LANES_X86 */
+
+/*
+ * the next (up to) 8 octets of each lane as little-endian words, zero filled
+ */
+static void
+lane_words(const unsigned char **p, size_t off, size_t n, Fnv64_t *w)
+{
+    int i;
+
+    for (i = 0; i < FNV_64A_LANES; ++i) {
+	w[i] = 0;
+	memcpy(&w[i], p[i] + off, n);
+    }
+}
+
+__attribute__((target("sse2")))
+static void
+lanes_sse2(const unsigned char **p, Fnv64_t *hval, size_t len)
+{
+    const __m128i low = _mm_set1_epi64x(FNV_64_PRIME_LOW);
+    const __m128i octet = _mm_set1_epi64x(0xff);
+    __m128i h[FNV_64A_LANES / 2];
+    Fnv64_t w[FNV_64A_LANES];
+    size_t off;
+    int i;
+    int k;
+
+    for (i = 0; i < FNV_64A_LANES / 2; ++i) {
+	h[i] = _mm_loadu_si128((const __m128i *)hval + i);
+    }
+    for (off = 0; off < len; off += 8) {
+	size_t n = len - off < 8 ? len - off : 8;
+	__m128i v[FNV_64A_LANES / 2];
+
+	lane_words(p, off, n, w);
+	for (i = 0; i < FNV_64A_LANES / 2; ++i) {
+	    v[i] = _mm_loadu_si128((const __m128i *)w + i);
+	}
+	for (k = 0; k < (int)n; ++k) {
+	    for (i = 0; i < FNV_64A_LANES / 2; ++i) {
+		__m128i x = _mm_xor_si128(h[i], _mm_and_si128(v[i], octet));
+
+		h[i] = _mm_add_epi64(
+		    _mm_add_epi64(_mm_slli_epi64(x, 40), _mm_mul_epu32(x, low)),
+		    _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), low), 32));
+		v[i] = _mm_srli_epi64(v[i], 8);
+	    }
+	}
+    }
+    for (i = 0; i < FNV_64A_LANES / 2; ++i) {
+	_mm_storeu_si128((__m128i *)hval + i, h[i]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+lanes_avx2(const unsigned char **p, Fnv64_t *hval, size_t len)
+{
+    const __m256i low = _mm256_set1_epi64x(FNV_64_PRIME_LOW);
+    const __m256i octet = _mm256_set1_epi64x(0xff);
+    __m256i h[FNV_64A_LANES / 4];
+    Fnv64_t w[FNV_64A_LANES];
+    size_t off;
+    int i;
+    int k;
+
+    for (i = 0; i < FNV_64A_LANES / 4; ++i) {
+	h[i] = _mm256_loadu_si256((const __m256i *)hval + i);
+    }
+    for (off = 0; off < len; off += 8) {
+	size_t n = len - off < 8 ? len - off : 8;
+	__m256i v[FNV_64A_LANES / 4];
+
+	lane_words(p, off, n, w);
+	for (i = 0; i < FNV_64A_LANES / 4; ++i) {
+	    v[i] = _mm256_loadu_si256((const __m256i *)w + i);
+	}
+	for (k = 0; k < (int)n; ++k) {
+	    for (i = 0; i < FNV_64A_LANES / 4; ++i) {
+		__m256i x = _mm256_xor_si256(h[i], _mm256_and_si256(v[i], octet));
+
+		h[i] = _mm256_add_epi64(
+		    _mm256_add_epi64(_mm256_slli_epi64(x, 40),
+				     _mm256_mul_epu32(x, low)),
+		    _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32),
+						       low), 32));
+		v[i] = _mm256_srli_epi64(v[i], 8);
+	    }
+	}
+    }
+    for (i = 0; i < FNV_64A_LANES / 4; ++i) {
+	_mm256_storeu_si256((__m256i *)hval + i, h[i]);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void
+lanes_avx512(const unsigned char **p, Fnv64_t *hval, size_t len)
+{
+    const __m512i low = _mm512_set1_epi64(FNV_64_PRIME_LOW);
+    const __m512i octet = _mm512_set1_epi64(0xff);
+    __m512i h[FNV_64A_LANES / 8];
+    Fnv64_t w[FNV_64A_LANES];
+    size_t off;
+    int i;
+    int k;
+
+    for (i = 0; i < FNV_64A_LANES / 8; ++i) {
+	h[i] = _mm512_loadu_si512(hval + 8 * i);
+    }
+    for (off = 0; off < len; off += 8) {
+	size_t n = len - off < 8 ? len - off : 8;
+	__m512i v[FNV_64A_LANES / 8];
+
+	lane_words(p, off, n, w);
+	for (i = 0; i < FNV_64A_LANES / 8; ++i) {
+	    v[i] = _mm512_loadu_si512(w + 8 * i);
+	}
+	for (k = 0; k < (int)n; ++k) {
+	    for (i = 0; i < FNV_64A_LANES / 8; ++i) {
+		__m512i x = _mm512_xor_si512(h[i], _mm512_and_si512(v[i], octet));
+
+		h[i] = _mm512_add_epi64(
+		    _mm512_add_epi64(_mm512_slli_epi64(x, 40),
+				     _mm512_mul_epu32(x, low)),
+		    _mm512_slli_epi64(_mm512_mul_epu32(_mm512_srli_epi64(x, 32),
+						       low), 32));
+		v[i] = _mm512_srli_epi64(v[i], 8);
+	    }
+	}
+    }
+    for (i = 0; i < FNV_64A_LANES / 8; ++i) {
+	_mm512_storeu_si512(hval + 8 * i, h[i]);
+    }
+}
+
+#endif /* FNV_LANES_X86 */
+
+static lane_fn
+lane_kernel(void)
+{
+    static lane_fn fn = NULL;
+
+    if (fn == NULL) {
+#if defined(FNV_LANES_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+	    fn = lanes_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+	    fn = lanes_avx2;
+	} else {
+	    fn = lanes_sse2;
+	}
+#else /* FNV_LANES_X86 */
+	fn = lanes_scalar;
+#endif /* FNV_LANES_X86 */
+    }
+    return fn;
+}
+
+#endif /* HAVE_64BIT_LONG_LONG */
+
+
+/*
+ * fnv_64a_lanes - perform a 64 bit FNV-1a hash on n buffers at once
+ *
+ * input:
+ *	buf	- start of each buffer to hash
+ *	len	- length of each buffer in octets
+ *	hval	- previous hash value of each buffer, replaced by its new one
+ *	n	- number of buffers
+ *
+ * Buffers join a free lane as others finish, so lengths need not match;
+ * once fewer than two are left the rest go through fnv_64a_buf().
+ *
+ * NOTE: To use the recommended 64 bit FNV-1a hash, use FNV1A_64_INIT as
+ *	 each hval, just as for fnv_64a_buf().
+ */
+void
+fnv_64a_lanes(void **buf, size_t *len, Fnv64_t *hval, int n)
+{
+#if defined(HAVE_64BIT_LONG_LONG)
+    const unsigned char *p[FNV_64A_LANES];	/* next octet of each lane */
+    size_t left[FNV_64A_LANES];		/* octets left in each lane */
+    int slot[FNV_64A_LANES];		/* buffer in each lane, -1 if idle */
+    Fnv64_t h[FNV_64A_LANES];		/* running hash of each lane */
+    lane_fn kernel = lane_kernel();
+    int next = 0;			/* next buffer to start */
+    int busy;
+    int i;
+
+    for (i = 0; i < FNV_64A_LANES; ++i) {
+	slot[i] = -1;
+    }
+
+    for (;;) {
+	size_t step = 0;
+	int any = -1;
+
+	/*
+	 * fill idle lanes
+	 */
+	busy = 0;
+	for (i = 0; i < FNV_64A_LANES; ++i) {
+	    while (slot[i] < 0 && next < n) {
+		if (len[next] > 0) {
+		    slot[i] = next;
+		    p[i] = (const unsigned char *)buf[next];
+		    left[i] = len[next];
+		    h[i] = hval[next];
+		}
+		++next;
+	    }
+	    if (slot[i] >= 0) {
+		if (busy == 0 || left[i] < step) {
+		    step = left[i];
+		}
+		any = i;
+		++busy;
+	    }
+	}
+	if (busy < 2) {
+	    break;
+	}
+
+	/*
+	 * idle lanes shadow a busy one; their results are thrown away
+	 */
+	for (i = 0; i < FNV_64A_LANES; ++i) {
+	    if (slot[i] < 0) {
+		p[i] = p[any];
+	    }
+	}
+
+	kernel(p, h, step);
+
+	for (i = 0; i < FNV_64A_LANES; ++i) {
+	    if (slot[i] < 0) {
+		continue;
+	    }
+	    p[i] += step;
+	    left[i] -= step;
+	    if (left[i] == 0) {
+		hval[slot[i]] = h[i];
+		slot[i] = -1;
+	    }
+	}
+    }
+
+    /*
+     * every buffer has been started; the last busy lane finishes alone
+     */
+    for (i = 0; i < FNV_64A_LANES; ++i) {
+	if (slot[i] >= 0) {
+	    hval[slot[i]] = fnv_64a_buf((void *)p[i], left[i], h[i]);
+	}
+    }
+#else /* HAVE_64BIT_LONG_LONG */
+    int i;
+
+    for (i = 0; i < n; ++i) {
+	hval[i] = fnv_64a_buf(buf[i], len[i], hval[i]);
+    }
+#endif /* HAVE_64BIT_LONG_LONG */
+}
@@ -0,0 +1,770 @@
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HASH_X86
+#endif
+
+#include "hash.h"
+#include "fnv/fnv.h"
+
+size_t hash_key_bytes = 8;
+const size_t HASH_TILE = 16 * 1024;
+const int HASH_LANES = 2 * FNV_64A_LANES;
+
+static uint64_t
+load_le64(const unsigned char * p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+           (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+           (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static void
+store_le64(unsigned char * p, uint64_t v)
+{
+    for(int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+uint64_t
+hash_id(const unsigned char * const digest)
+{
+    return load_le64(digest);
+}
+
+struct hash_key
+hash_key(const unsigned char * const digest)
+{
+    struct hash_key k;
+
+    memset(&k, 0, sizeof(k));
+    memcpy(k.b, digest, hash_key_bytes);
+    return k;
+}
+
+int
+hash_key_zero(const struct hash_key * const k)
+{
+    static const struct hash_key zero;
+
+    return 0 == memcmp(k->b, zero.b, hash_key_bytes);
+}
+
+/* hex as it is printed: an eight byte key the way %llx prints its hash_id() */
+int
+hash_key_str(const struct hash_key * const k, char * buf, size_t len)
+{
+    int n = 0;
+
+    if(8 == hash_key_bytes) {
+        return snprintf(buf, len, "%llx", (unsigned long long)hash_id(k->b));
+    }
+
+    for(size_t i = 0; i < hash_key_bytes && (size_t)n < len; i++) {
+        n += snprintf(buf + n, len - n, "%02x", k->b[i]);
+    }
+
+    return n;
+}
+
+/* fnv64: the original FNV-1a 64, one byte per step */
+
+static const uint64_t FNV64_PRIME = 0x100000001b3ULL;
+
+static void
+fnv_init(union hash_state * s)
+{
+    s->fnv = FNV1A_64_INIT;
+}
+
+static void
+fnv_update(union hash_state * s, const void * buf, size_t len)
+{
+    s->fnv = fnv_64a_buf((void *)buf, len, s->fnv);
+}
+
+static void
+fnv_final(union hash_state * s, unsigned char * out)
+{
+    store_le64(out, s->fnv);
+}
+
+/* two independent multiply chains per byte load, so the second costs almost nothing */
+static void
+fnv_update2(union hash_state * a, union hash_state * b, const void * buf, size_t len)
+{
+    const unsigned char * p = buf;
+    const unsigned char * end = p + len;
+    uint64_t x = a->fnv;
+    uint64_t y = b->fnv;
+
+    for(; p < end; p++) {
+        x = (x ^ *p) * FNV64_PRIME;
+        y = (y ^ *p) * FNV64_PRIME;
+    }
+
+    a->fnv = x;
+    b->fnv = y;
+}
+
+/* each zero byte only multiplies by the prime, so n of them multiply by its nth power */
+static void
+fnv_zeros(union hash_state * s, uint64_t n)
+{
+    uint64_t p = FNV64_PRIME;
+    uint64_t h = s->fnv;
+
+    for(; n > 0; n >>= 1) {
+        if(n & 1) {
+            h *= p;
+        }
+
+        p *= p;
+    }
+
+    s->fnv = h;
+}
+
+/*
+ * ixh128: a multiply-accumulate hash in the style of XXH3.  Input is taken
+ * in 64-byte stripes across eight 64-bit lanes; each lane adds the product
+ * of the two 32-bit halves of (data ^ key) to itself and the raw data to
+ * its neighbour, and every 16 stripes the lanes are scrambled.  Every step
+ * is lane-wise, so the SSE2, AVX2 and AVX-512 kernels compute exactly what
+ * the scalar one does, just two, four or eight lanes at a time.
+ */
+#define IXH_STRIPE 64
+#define IXH_BLOCK 16
+
+static const uint64_t IXH_SECRET[24] = {
+    0xde289a2fa76d84f0ULL, 0x26fba96f3735eac6ULL, 0xc506b8d7392cc43aULL,
+    0x2e8dacdc6f7036a5ULL, 0xb7d6ce9fd5b7db07ULL, 0x51e85d918faae85cULL,
+    0x0ea247a67fd24405ULL, 0x0e009967b20e33d6ULL, 0x502ecabe4ece9697ULL,
+    0xc12b1e325d7ede39ULL, 0x68e15a11905d522bULL, 0xf72f01097d889345ULL,
+    0x11ad5db10f9b4e5aULL, 0x00790113047ee664ULL, 0x87ee97e00a9cb62bULL,
+    0x5bc43532b5e306c8ULL, 0xa9bf7feecda5b455ULL, 0xdcb87f3a8247a678ULL,
+    0x825bb4101b28cbc8ULL, 0xed7c43bfd0a8a8bdULL, 0xdac16e968bd583e4ULL,
+    0x74b9ca18dd4249c7ULL, 0x8634cfedde6c3377ULL, 0x37a0dd884db0de94ULL,
+};
+
+static const uint64_t IXH_PRIME32 = 0x9e3779b1ULL;
+static const uint64_t IXH_PRIME64_1 = 0x9e3779b185ebca87ULL;
+static const uint64_t IXH_PRIME64_2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t IXH_PRIME64_3 = 0x165667b19e3779f9ULL;
+
+struct ixh_kernel {
+    const char * isa;
+    void (*accumulate)(uint64_t *, const unsigned char *, size_t, const uint64_t *);
+    void (*scramble)(uint64_t *, const uint64_t *);
+};
+
+/* n stripes from p; stripe j is keyed with secret + j */
+static void
+ixh_accumulate_scalar(uint64_t * acc, const unsigned char * p, size_t n,
+                      const uint64_t * secret)
+{
+    for(size_t j = 0; j < n; j++, p += IXH_STRIPE, secret++) {
+        for(int i = 0; i < 8; i++) {
+            uint64_t d = load_le64(p + 8 * i);
+            uint64_t k = d ^ secret[i];
+
+            acc[i ^ 1] += d;
+            acc[i] += (k & 0xffffffffULL) * (k >> 32);
+        }
+    }
+}
+
+static void
+ixh_scramble_scalar(uint64_t * acc, const uint64_t * secret)
+{
+    for(int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+
+        a ^= a >> 47;
+        a ^= secret[i];
+        acc[i] = a * IXH_PRIME32;
+    }
+}
+
+#if defined(HASH_X86)
+__attribute__((target("sse2")))
+static void
+ixh_accumulate_sse2(uint64_t * acc, const unsigned char * p, size_t n,
+                    const uint64_t * secret)
+{
+    __m128i a[4];
+
+    for(int i = 0; i < 4; i++) {
+        a[i] = _mm_loadu_si128((const __m128i *)acc + i);
+    }
+
+    for(size_t j = 0; j < n; j++, p += IXH_STRIPE, secret++) {
+        for(int i = 0; i < 4; i++) {
+            __m128i d = _mm_loadu_si128((const __m128i *)p + i);
+            __m128i k = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)(secret + 2 * i)));
+            __m128i m = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(2, 3, 0, 1)));
+
+            a[i] = _mm_add_epi64(a[i], _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+            a[i] = _mm_add_epi64(a[i], m);
+        }
+    }
+
+    for(int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i *)acc + i, a[i]);
+    }
+}
+
+__attribute__((target("sse2")))
+static void
+ixh_scramble_sse2(uint64_t * acc, const uint64_t * secret)
+{
+    const __m128i prime = _mm_set1_epi32((int)IXH_PRIME32);
+
+    for(int i = 0; i < 4; i++) {
+        __m128i a = _mm_loadu_si128((const __m128i *)acc + i);
+
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(secret + 2 * i)));
+        a = _mm_add_epi64(_mm_mul_epu32(a, prime),
+                          _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), prime), 32));
+        _mm_storeu_si128((__m128i *)acc + i, a);
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+ixh_accumulate_avx2(uint64_t * acc, const unsigned char * p, size_t n,
+                    const uint64_t * secret)
+{
+    __m256i a[2];
+
+    for(int i = 0; i < 2; i++) {
+        a[i] = _mm256_loadu_si256((const __m256i *)acc + i);
+    }
+
+    for(size_t j = 0; j < n; j++, p += IXH_STRIPE, secret++) {
+        for(int i = 0; i < 2; i++) {
+            __m256i d = _mm256_loadu_si256((const __m256i *)p + i);
+            __m256i k = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i *)(secret + 4 * i)));
+            __m256i m = _mm256_mul_epu32(k, _mm256_shuffle_epi32(k, _MM_SHUFFLE(2, 3, 0, 1)));
+
+            a[i] = _mm256_add_epi64(a[i], _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+            a[i] = _mm256_add_epi64(a[i], m);
+        }
+    }
+
+    for(int i = 0; i < 2; i++) {
+        _mm256_storeu_si256((__m256i *)acc + i, a[i]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+ixh_scramble_avx2(uint64_t * acc, const uint64_t * secret)
+{
+    const __m256i prime = _mm256_set1_epi32((int)IXH_PRIME32);
+
+    for(int i = 0; i < 2; i++) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)acc + i);
+
+        a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+        a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)(secret + 4 * i)));
+        a = _mm256_add_epi64(_mm256_mul_epu32(a, prime),
+                             _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime), 32));
+        _mm256_storeu_si256((__m256i *)acc + i, a);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void
+ixh_accumulate_avx512(uint64_t * acc, const unsigned char * p, size_t n,
+                      const uint64_t * secret)
+{
+    __m512i a = _mm512_loadu_si512(acc);
+
+    for(size_t j = 0; j < n; j++, p += IXH_STRIPE, secret++) {
+        __m512i d = _mm512_loadu_si512(p);
+        __m512i k = _mm512_xor_si512(d, _mm512_loadu_si512(secret));
+        __m512i m = _mm512_mul_epu32(k, _mm512_shuffle_epi32(k, _MM_PERM_CDAB));
+
+        a = _mm512_add_epi64(a, _mm512_shuffle_epi32(d, _MM_PERM_BADC));
+        a = _mm512_add_epi64(a, m);
+    }
+
+    _mm512_storeu_si512(acc, a);
+}
+
+__attribute__((target("avx512f")))
+static void
+ixh_scramble_avx512(uint64_t * acc, const uint64_t * secret)
+{
+    const __m512i prime = _mm512_set1_epi32((int)IXH_PRIME32);
+    __m512i a = _mm512_loadu_si512(acc);
+
+    a = _mm512_xor_si512(a, _mm512_srli_epi64(a, 47));
+    a = _mm512_xor_si512(a, _mm512_loadu_si512(secret));
+    a = _mm512_add_epi64(_mm512_mul_epu32(a, prime),
+                         _mm512_slli_epi64(_mm512_mul_epu32(_mm512_srli_epi64(a, 32), prime), 32));
+    _mm512_storeu_si512(acc, a);
+}
+#endif
+
+static const struct ixh_kernel IXH_KERNELS[] = {
+#if defined(HASH_X86)
+    {"avx512", ixh_accumulate_avx512, ixh_scramble_avx512},
+    {"avx2", ixh_accumulate_avx2, ixh_scramble_avx2},
+    {"sse2", ixh_accumulate_sse2, ixh_scramble_sse2},
+#endif
+    {"scalar", ixh_accumulate_scalar, ixh_scramble_scalar},
+};
+
+static struct ixh_kernel ixh = {
+    "scalar", ixh_accumulate_scalar, ixh_scramble_scalar,
+};
+static pthread_once_t ixh_once = PTHREAD_ONCE_INIT;
+
+/* whether the CPU (and the OS, for the wider registers) runs kernel k */
+static int
+ixh_supported(const struct ixh_kernel * k)
+{
+#if defined(HASH_X86)
+    __builtin_cpu_init();
+
+    if(0 == strcmp(k->isa, "avx512")) {
+        return __builtin_cpu_supports("avx512f");
+    }
+
+    if(0 == strcmp(k->isa, "avx2")) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+
+    (void)k;
+    return 1;
+}
+
+/* picked once, the widest that is supported */
+static void
+ixh_dispatch(void)
+{
+    for(size_t i = 0; i < sizeof(IXH_KERNELS) / sizeof(IXH_KERNELS[0]); i++) {
+        if(ixh_supported(&IXH_KERNELS[i])) {
+            ixh = IXH_KERNELS[i];
+            return;
+        }
+    }
+}
+
+static uint64_t
+ixh_fold(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 m = (unsigned __int128)a * b;
+    return (uint64_t)m ^ (uint64_t)(m >> 64);
+#else
+    uint64_t al = a & 0xffffffffULL, ah = a >> 32;
+    uint64_t bl = b & 0xffffffffULL, bh = b >> 32;
+    uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+    uint64_t mid = (ll >> 32) + (lh & 0xffffffffULL) + (hl & 0xffffffffULL);
+    uint64_t lo = (mid << 32) | (ll & 0xffffffffULL);
+    uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    return lo ^ hi;
+#endif
+}
+
+static uint64_t
+ixh_avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= IXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static void
+ixh_stripes(struct ixh_state * x, const unsigned char * p, size_t n)
+{
+    while(n > 0) {
+        size_t k = IXH_BLOCK - x->stripe < n ? IXH_BLOCK - x->stripe : n;
+
+        ixh.accumulate(x->acc, p, k, IXH_SECRET + x->stripe);
+        p += k * IXH_STRIPE;
+        n -= k;
+
+        if((x->stripe += k) == IXH_BLOCK) {
+            ixh.scramble(x->acc, IXH_SECRET + 16);
+            x->stripe = 0;
+        }
+    }
+}
+
+static void
+ixh_init(union hash_state * s)
+{
+    struct ixh_state * x = &s->ixh;
+
+    pthread_once(&ixh_once, ixh_dispatch);
+    memset(x, 0, sizeof(struct ixh_state));
+
+    for(int i = 0; i < 8; i++) {
+        x->acc[i] = IXH_SECRET[i] ^ IXH_SECRET[23 - i];
+    }
+}
+
+static void
+ixh_update(union hash_state * s, const void * data, size_t len)
+{
+    struct ixh_state * x = &s->ixh;
+    const unsigned char * p = data;
+
+    x->len += len;
+
+    if(x->nbuf > 0) {
+        size_t take = IXH_STRIPE - x->nbuf < len ? IXH_STRIPE - x->nbuf : len;
+
+        memcpy(x->buf + x->nbuf, p, take);
+        x->nbuf += take;
+        p += take;
+        len -= take;
+
+        if(x->nbuf < IXH_STRIPE) {
+            return;
+        }
+
+        ixh_stripes(x, x->buf, 1);
+        x->nbuf = 0;
+    }
+
+    ixh_stripes(x, p, len / IXH_STRIPE);
+    p += len / IXH_STRIPE * IXH_STRIPE;
+    x->nbuf = len % IXH_STRIPE;
+    memcpy(x->buf, p, x->nbuf);
+}
+
+static void
+ixh_final(union hash_state * s, unsigned char * out)
+{
+    struct ixh_state * x = &s->ixh;
+    uint64_t lo = x->len * IXH_PRIME64_1;
+    uint64_t hi = ~x->len * IXH_PRIME64_2;
+
+    // the tail is zero-padded; the length folded in above tells them apart
+    if(x->nbuf > 0) {
+        memset(x->buf + x->nbuf, 0, IXH_STRIPE - x->nbuf);
+        ixh_stripes(x, x->buf, 1);
+    }
+
+    ixh.scramble(x->acc, IXH_SECRET + 16);
+
+    for(int i = 0; i < 4; i++) {
+        lo += ixh_fold(x->acc[2 * i] ^ IXH_SECRET[2 * i],
+                       x->acc[2 * i + 1] ^ IXH_SECRET[2 * i + 1]);
+        hi += ixh_fold(x->acc[2 * i] ^ IXH_SECRET[2 * i + 11],
+                       x->acc[2 * i + 1] ^ IXH_SECRET[2 * i + 12]);
+    }
+
+    store_le64(out, ixh_avalanche(lo));
+    store_le64(out + 8, ixh_avalanche(hi));
+}
+
+/* blake2b: BLAKE2b-256 as in RFC 7693, unkeyed */
+
+static const uint64_t B2_IV[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+static const unsigned char B2_SIGMA[12][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+};
+
+#define B2_ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define B2_G(v, a, b, c, d, x, y) do {              \
+        v[a] += v[b] + (x);                         \
+        v[d] = B2_ROTR(v[d] ^ v[a], 32);            \
+        v[c] += v[d];                               \
+        v[b] = B2_ROTR(v[b] ^ v[c], 24);            \
+        v[a] += v[b] + (y);                         \
+        v[d] = B2_ROTR(v[d] ^ v[a], 16);            \
+        v[c] += v[d];                               \
+        v[b] = B2_ROTR(v[b] ^ v[c], 63);            \
+    } while(0)
+
+static void
+b2_compress(struct blake2b_state * b, const unsigned char * block, int last)
+{
+    uint64_t m[16];
+    uint64_t v[16];
+
+    for(int i = 0; i < 16; i++) {
+        m[i] = load_le64(block + 8 * i);
+    }
+
+    for(int i = 0; i < 8; i++) {
+        v[i] = b->h[i];
+        v[i + 8] = B2_IV[i];
+    }
+
+    v[12] ^= b->t[0];
+    v[13] ^= b->t[1];
+
+    if(last) {
+        v[14] = ~v[14];
+    }
+
+    for(int r = 0; r < 12; r++) {
+        const unsigned char * s = B2_SIGMA[r];
+
+        B2_G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        B2_G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        B2_G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        B2_G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        B2_G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        B2_G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        B2_G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        B2_G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+
+    for(int i = 0; i < 8; i++) {
+        b->h[i] ^= v[i] ^ v[i + 8];
+    }
+}
+
+static void
+b2_count(struct blake2b_state * b, size_t n)
+{
+    b->t[0] += n;
+    b->t[1] += b->t[0] < n;
+}
+
+static void
+b2_init(union hash_state * s)
+{
+    struct blake2b_state * b = &s->b2;
+
+    memset(b, 0, sizeof(struct blake2b_state));
+    memcpy(b->h, B2_IV, sizeof(b->h));
+    b->h[0] ^= 0x01010000ULL ^ 32;
+}
+
+/* the last block is always held back, it has to be compressed as such */
+static void
+b2_update(union hash_state * s, const void * data, size_t len)
+{
+    struct blake2b_state * b = &s->b2;
+    const unsigned char * p = data;
+
+    if(0 == len) {
+        return;
+    }
+
+    if(b->nbuf > 0 || len <= sizeof(b->buf)) {
+        size_t take = sizeof(b->buf) - b->nbuf < len ? sizeof(b->buf) - b->nbuf : len;
+
+        memcpy(b->buf + b->nbuf, p, take);
+        b->nbuf += take;
+        p += take;
+        len -= take;
+
+        if(0 == len) {
+            return;
+        }
+
+        b2_count(b, sizeof(b->buf));
+        b2_compress(b, b->buf, 0);
+        b->nbuf = 0;
+    }
+
+    for(; len > sizeof(b->buf); p += sizeof(b->buf), len -= sizeof(b->buf)) {
+        b2_count(b, sizeof(b->buf));
+        b2_compress(b, p, 0);
+    }
+
+    memcpy(b->buf, p, len);
+    b->nbuf = len;
+}
+
+static void
+b2_final(union hash_state * s, unsigned char * out)
+{
+    struct blake2b_state * b = &s->b2;
+
+    b2_count(b, b->nbuf);
+    memset(b->buf + b->nbuf, 0, sizeof(b->buf) - b->nbuf);
+    b2_compress(b, b->buf, 1);
+
+    for(int i = 0; i < 4; i++) {
+        store_le64(out + 8 * i, b->h[i]);
+    }
+}
+
+static const struct hash_engine FNV64 = {
+    "fnv64", 0, 8, FNV_64A_LANES, fnv_init, fnv_update, fnv_final, fnv_zeros,
+};
+static const struct hash_engine IXH128 = {
+    "ixh128", 0, 16, 1, ixh_init, ixh_update, ixh_final, 0,
+};
+static const struct hash_engine BLAKE2B = {
+    "blake2b", "blake2b-256", 32, 1, b2_init, b2_update, b2_final, 0,
+};
+
+const struct hash_engine * const HASH_ENGINES[] = {&FNV64, &IXH128, &BLAKE2B, 0};
+const struct hash_engine * hash_engine = &FNV64;
+const struct hash_engine * const HASH_STRONG = &BLAKE2B;
+
+/*
+ * Feeds n zero bytes to s, a state of e: a hole in a sparse file costs
+ * next to nothing with an engine that can skip them, and no reading with
+ * any other.
+ */
+void
+hash_zeros(const struct hash_engine * e, union hash_state * s, uint64_t n)
+{
+    static const unsigned char zero[64 << 10];
+
+    if(0 != e->zeros) {
+        e->zeros(s, n);
+        return;
+    }
+
+    for(; n > 0; n -= n < sizeof(zero) ? n : sizeof(zero)) {
+        e->update(s, zero, n < sizeof(zero) ? n : sizeof(zero));
+    }
+}
+
+/* the blake2b-256 digest of buf, whatever the current engine; HASH_STRONG piece by piece */
+void
+hash_strong(const void * buf, size_t len, unsigned char * digest)
+{
+    union hash_state s;
+
+    BLAKE2B.init(&s);
+    BLAKE2B.update(&s, buf, len);
+    BLAKE2B.final(&s, digest);
+}
+
+const struct hash_engine *
+hash_find(const char * const name)
+{
+    for(int i = 0; 0 != HASH_ENGINES[i]; i++) {
+        if(0 == strcmp(name, HASH_ENGINES[i]->name)) {
+            return HASH_ENGINES[i];
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Feeds buf to two states of the current engine in a single pass over
+ * memory: fnv64 interleaves both chains byte by byte, the others take
+ * HASH_TILE bytes at a time so the second update reads from cache.
+ */
+void
+hash_update2(union hash_state * a, union hash_state * b, const void * buf, size_t len)
+{
+    const unsigned char * p = buf;
+
+    if(&FNV64 == hash_engine) {
+        fnv_update2(a, b, buf, len);
+        return;
+    }
+
+    while(len > 0) {
+        size_t n = len < HASH_TILE ? len : HASH_TILE;
+
+        hash_engine->update(a, p, n);
+        hash_engine->update(b, p, n);
+        p += n;
+        len -= n;
+    }
+}
+
+/*
+ * Feeds each of up to HASH_LANES states its own buffer; fnv64 runs them
+ * through fnv_64a_lanes(), the others one after another.
+ */
+void
+hash_lanes(union hash_state * states, void ** bufs, size_t * lens, int n)
+{
+    Fnv64_t h[2 * FNV_64A_LANES];
+
+    if(&FNV64 != hash_engine || n > HASH_LANES) {
+        for(int i = 0; i < n; i++) {
+            hash_engine->update(&states[i], bufs[i], lens[i]);
+        }
+
+        return;
+    }
+
+    for(int i = 0; i < n; i++) {
+        h[i] = states[i].fnv;
+    }
+
+    fnv_64a_lanes(bufs, lens, h, n);
+
+    for(int i = 0; i < n; i++) {
+        states[i].fnv = h[i];
+    }
+}
+
+/* which ixh128 kernel this CPU runs */
+const char *
+hash_kernel(void)
+{
+    pthread_once(&ixh_once, ixh_dispatch);
+    return ixh.isa;
+}
+
+/*
+ * Makes ixh128 run the named kernel from now on, if this CPU can; for
+ * measuring them against each other, not to be called while hashing.
+ */
+int
+hash_use_kernel(const char * const isa)
+{
+    pthread_once(&ixh_once, ixh_dispatch);
+
+    for(size_t i = 0; i < sizeof(IXH_KERNELS) / sizeof(IXH_KERNELS[0]); i++) {
+        if(0 == strcmp(isa, IXH_KERNELS[i].isa) && ixh_supported(&IXH_KERNELS[i])) {
+            ixh = IXH_KERNELS[i];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* the id of buf under the current engine */
+uint64_t
+hash_buf(const void * buf, size_t len)
+{
+    union hash_state s;
+    unsigned char digest[HASH_MAX];
+
+    hash_engine->init(&s);
+    hash_engine->update(&s, buf, len);
+    hash_engine->final(&s, digest);
+    return hash_id(digest);
+}
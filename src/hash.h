@@ -0,0 +1,79 @@
+#ifndef _SRC_HASH_H_
+#define _SRC_HASH_H_
+
+#include <stdint.h>
+#include <unistd.h>
+
+#define HASH_MAX 32
+
+struct ixh_state {
+    uint64_t acc[8];
+    unsigned char buf[64];
+    size_t nbuf;
+    size_t stripe;
+    uint64_t len;
+};
+
+struct blake2b_state {
+    uint64_t h[8];
+    uint64_t t[2];
+    unsigned char buf[128];
+    size_t nbuf;
+};
+
+union hash_state {
+    uint64_t fnv;
+    struct ixh_state ixh;
+    struct blake2b_state b2;
+};
+
+/*
+ * A content hash.  Files and blobs are keyed by hash_id() of the digest,
+ * its first eight bytes read little-endian, which for fnv64 is the FNV-1a
+ * value itself so databases written before engines existed still match.
+ * `lanes` is how many separate buffers it hashes side by side in
+ * hash_lanes(); 1 means nothing is gained by batching them.  `crypto` is
+ * the name the kernel's crypto API knows the same hash by, if it does.
+ * `zeros`, if set, feeds a run of zero bytes without touching memory.
+ */
+struct hash_engine {
+    const char * name;
+    const char * crypto;
+    size_t size;
+    int lanes;
+    void (*init)(union hash_state *);
+    void (*update)(union hash_state *, const void *, size_t);
+    void (*final)(union hash_state *, unsigned char *);
+    void (*zeros)(union hash_state *, uint64_t);
+};
+
+/*
+ * What files and blobs are keyed by: the first hash_key_bytes of a digest,
+ * zero filled.  Eight bytes are stored as the integer hash_id() of the
+ * key, as they always were; 16 or 32 as a blob of that many bytes.
+ */
+struct hash_key {
+    unsigned char b[HASH_MAX];
+};
+
+extern size_t hash_key_bytes;
+extern const size_t HASH_TILE;
+extern const int HASH_LANES;
+extern const struct hash_engine * hash_engine;
+extern const struct hash_engine * const HASH_ENGINES[];
+extern const struct hash_engine * const HASH_STRONG;
+
+const struct hash_engine * hash_find(const char * const);
+const char * hash_kernel(void);
+int hash_use_kernel(const char * const);
+uint64_t hash_id(const unsigned char * const);
+uint64_t hash_buf(const void *, size_t);
+struct hash_key hash_key(const unsigned char * const);
+int hash_key_zero(const struct hash_key * const);
+int hash_key_str(const struct hash_key * const, char *, size_t);
+void hash_strong(const void *, size_t, unsigned char *);
+void hash_zeros(const struct hash_engine *, union hash_state *, uint64_t);
+void hash_update2(union hash_state *, union hash_state *, const void *, size_t);
+void hash_lanes(union hash_state *, void **, size_t *, int);
+
+#endif /*_SRC_HASH_H_*/
@@ -1,14 +1,31 @@
 #define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 #include <errno.h>
-#include <ftw.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
+#include "afalg.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "chunk.h"
+#include "dedup.h"
+#include "hash.h"
 #include "index.h"
+#include "layout.h"
+#include "map.h"
+#include "pool.h"
+#include "reader.h"
+#include "stream.h"
+#include "table.h"
+#include "tree.h"
+#include "walk.h"
 #include "fnv/fnv.h"
 #include "sqlite/sqlite3.h"
 
@@ -16,20 +33,34 @@ sqlite3 * DB = 0;
 char * db_name = 0;
 char * sql_file = 0;
 char * root_dir = 0;
+int incremental = 0;
+int prune_missing = 0;
+int resume_scan = 0;
+int dedup_scan = 0;
+int verify_blobs = 0;
+int hash_only = 0;
+int kernel_hash = 0;
 
 
 const size_t MAX_PATH = 4096;
 const size_t MAX_LEN = 1 << 30;
+const size_t STORE_NODES = 4096;
 const char * const INIT_DB =
     "CREATE TABLE IF NOT EXISTS files ("
     " path TEXT,"
     " hash INTEGER,"
     " size INTEGER,"
+    " device INTEGER,"
+    " inode INTEGER,"
+    " mtime_ns INTEGER,"
+    " ctime_ns INTEGER,"
+    " partial INTEGER,"
     " UNIQUE(path, hash, size));"
     "CREATE TABLE IF NOT EXISTS blobs ("
     " hash INTEGER,"
     " size INTEGER,"
     " blob BLOB,"
+    " strong BLOB,"
     " UNIQUE(hash, size));"
     "CREATE TABLE IF NOT EXISTS file_blobs ("
     " file_hash INTEGER,"
@@ -41,35 +72,110 @@ const char * const INIT_DB =
     " tag_key TEXT,"
     " tag_val TEXT,"
     " UNIQUE(file_hash, tag_key, tag_val));"
+    "CREATE TABLE IF NOT EXISTS file_leaves ("
+    " file_hash INTEGER,"
+    " leaf INTEGER,"
+    " digest BLOB,"
+    " first_blob INTEGER,"
+    " blobs INTEGER,"
+    " extents INTEGER,"
+    " UNIQUE(file_hash, leaf));"
+    "CREATE TABLE IF NOT EXISTS meta ("
+    " key TEXT PRIMARY KEY,"
+    " value TEXT);"
     ;
 const char * const ADD_FILE =
-    "INSERT OR IGNORE INTO files (path, hash, size)"
-    " VALUES(?, ?, ?)"
+    "INSERT INTO files (path, hash, size, device, inode, mtime_ns, ctime_ns, partial)"
+    " VALUES(?, ?, ?, ?, ?, ?, ?, ?)"
+    " ON CONFLICT(path, hash, size) DO UPDATE SET"
+    " device = excluded.device, inode = excluded.inode,"
+    " mtime_ns = excluded.mtime_ns, ctime_ns = excluded.ctime_ns,"
+    " partial = excluded.partial"
+    ;
+const char * const GET_FILES =
+    "SELECT path, hash, size, device, inode, mtime_ns, ctime_ns, partial FROM files"
+    " WHERE ctime_ns IS NOT NULL"
+    " AND (path = ?1 OR (path >= ?2 AND path < ?3))"
+    " ORDER BY path, ctime_ns"
+    ;
+const char * const DEL_FILES =
+    "DELETE FROM files"
+    " WHERE path = ?1 OR (path >= ?2 AND path < ?3)"
     ;
 const char * const ADD_BLOB =
     "INSERT OR IGNORE INTO blobs (hash, size, blob)"
     " VALUES(?, ?, ?)"
     ;
+const char * const GET_BLOB =
+    "SELECT strong, rowid FROM blobs WHERE hash = ? AND size = ?"
+    ;
+const char * const SET_BLOB_STRONG =
+    "UPDATE blobs SET strong = ? WHERE hash = ? AND size = ?"
+    ;
+const char * const FIND_BLOBS =
+    "SELECT rowid FROM blobs WHERE hash = ?"
+    ;
+const char * const DEL_BLOB =
+    "DELETE FROM blobs WHERE rowid = ?"
+    ;
 const char * const ADD_FILE_BLOB =
     "INSERT OR IGNORE INTO file_blobs (file_hash, blob_hash, ordinal)"
     " VALUES(?, ?, ?)"
     ;
+const char * const GET_UNFILED_BLOBS =
+    "SELECT blob_hash FROM file_blobs WHERE file_hash IS NULL ORDER BY ordinal DESC"
+    ;
+const char * const SET_UNFILED_BLOBS =
+    "UPDATE OR IGNORE file_blobs SET file_hash = ? WHERE file_hash IS NULL"
+    ;
+const char * const DEL_UNFILED_BLOBS =
+    "DELETE FROM file_blobs WHERE file_hash IS NULL"
+    ;
 const char * const ADD_FILE_TAG =
     "INSERT OR IGNORE INTO file_tags (file_hash, tag_key, tag_val)"
     " VALUES(?, ?, ?)"
     ;
+const char * const ADD_FILE_LEAF =
+    "INSERT INTO file_leaves (file_hash, leaf, digest, first_blob, blobs, extents)"
+    " VALUES(?, ?, ?, ?, ?, ?)"
+    " ON CONFLICT(file_hash, leaf) DO UPDATE SET extents = excluded.extents"
+    ;
+const char * const GET_FILE_LEAVES =
+    "SELECT leaf, digest, first_blob, blobs, extents FROM file_leaves"
+    " WHERE file_hash = ? ORDER BY leaf"
+    ;
+const char * const GET_LEAF_BLOBS =
+    "SELECT blob_hash FROM file_blobs"
+    " WHERE file_hash = ? AND ordinal >= ? AND ordinal < ? ORDER BY ordinal"
+    ;
+const char * const GET_META =
+    "SELECT value FROM meta WHERE key = ?"
+    ;
+const char * const SET_META =
+    "INSERT INTO meta (key, value) VALUES(?, ?)"
+    " ON CONFLICT(key) DO UPDATE SET value = excluded.value"
+    ;
+const char * const DEL_META =
+    "DELETE FROM meta WHERE key = ?"
+    ;
+
 
+/*
+ * The largest blob a database takes: chunk_fixed, or without it one blob
+ * per MAX_LEN of a file, within what SQLite allows a row.
+ */
+static size_t blob_max = 0;
 
 struct node {
-    Fnv64_t hash;
-    int ordinal;
+    struct hash_key hash;
+    sqlite3_int64 ordinal;
     struct node * prev;
 };
 
-struct node * new_node(Fnv64_t hash, int ordinal, struct node * prev)
+struct node * new_node(const struct hash_key * hash, sqlite3_int64 ordinal, struct node * prev)
 {
     struct node * n = malloc(sizeof(struct node));
-    n->hash = hash;
+    n->hash = *hash;
     n->ordinal = ordinal;
     n->prev = prev;
     return n;
@@ -90,56 +196,400 @@ db_result_handler(void * notUsed, int argc, char ** argv, char ** azColName)
     return 0;
 }
 
-void
-insert_blob(Fnv64_t hash, int size, const char * const buf)
+/*
+ * The statements run for every file are prepared once and kept, reset
+ * and unbound between uses, since parsing them again for each row costs
+ * more than running them on a tree of small files.  They are let go of
+ * when a scan ends, so that none are left when the database is closed.
+ */
+static struct {
+    const char * sql;
+    sqlite3_stmt * stmt;
+} statements[8];
+
+/* the statement for sql, one of the constants above, or 0 if it can't be prepared */
+static sqlite3_stmt *
+get_statement(const char * const sql)
+{
+    const size_t n = sizeof(statements) / sizeof(statements[0]);
+    sqlite3_stmt * stmt;
+    size_t i = 0;
+
+    while(i < n && 0 != statements[i].sql && sql != statements[i].sql) {
+        i++;
+    }
+
+    if(i < n && sql == statements[i].sql) {
+        return statements[i].stmt;
+    }
+
+    if(SQLITE_OK != sqlite3_prepare_v3(DB, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL)) {
+        return 0;
+    }
+
+    // past the last slot a statement is simply finalized after use
+    if(i < n) {
+        statements[i].sql = sql;
+        statements[i].stmt = stmt;
+    }
+
+    return stmt;
+}
+
+/* done with stmt from get_statement() for now; 0 is ignored */
+static void
+put_statement(sqlite3_stmt * stmt)
+{
+    for(size_t i = 0; i < sizeof(statements) / sizeof(statements[0]); i++) {
+        if(stmt == statements[i].stmt && 0 != stmt) {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+            return;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+static void
+drop_statements(void)
+{
+    for(size_t i = 0; i < sizeof(statements) / sizeof(statements[0]); i++) {
+        sqlite3_finalize(statements[i].stmt);
+        statements[i].sql = 0;
+        statements[i].stmt = 0;
+    }
+}
+
+/* a key binds as the integer it always was at eight bytes, as a blob when wider */
+static int
+bind_key(sqlite3_stmt * stmt, int i, const struct hash_key * const k)
+{
+    if(8 == hash_key_bytes) {
+        return sqlite3_bind_int64(stmt, i, hash_id(k->b));
+    }
+
+    return sqlite3_bind_blob(stmt, i, k->b, hash_key_bytes, SQLITE_TRANSIENT);
+}
+
+static struct hash_key
+column_key(sqlite3_stmt * stmt, int i)
+{
+    struct hash_key k;
+    uint64_t v;
+
+    memset(&k, 0, sizeof(k));
+
+    if(SQLITE_BLOB == sqlite3_column_type(stmt, i)) {
+        size_t n = sqlite3_column_bytes(stmt, i);
+
+        memcpy(k.b, sqlite3_column_blob(stmt, i), n < HASH_MAX ? n : HASH_MAX);
+        return k;
+    }
+
+    v = (uint64_t)sqlite3_column_int64(stmt, i);
+
+    for(int b = 0; b < 8; b++) {
+        k.b[b] = (unsigned char)(v >> (8 * b));
+    }
+
+    return k;
+}
+
+/* the engine's state after len zeros, and their blake2b digest if strong is given */
+static const union hash_state *
+zero_state(size_t len, unsigned char * strong)
+{
+    static struct {
+        size_t len;
+        int strong;
+        union hash_state state;
+        unsigned char digest[32];
+    } z;
+
+    if(len != z.len) {
+        hash_engine->init(&z.state);
+        hash_zeros(hash_engine, &z.state, len);
+        z.len = len;
+        z.strong = 0;
+    }
+
+    if(0 != strong && !z.strong) {
+        union hash_state b;
+
+        HASH_STRONG->init(&b);
+        hash_zeros(HASH_STRONG, &b, len);
+        HASH_STRONG->final(&b, z.digest);
+        z.strong = 1;
+    }
+
+    if(0 != strong) {
+        memcpy(strong, z.digest, sizeof(z.digest));
+    }
+
+    return &z.state;
+}
+
+/*
+ * The blake2b digest of the blob at row and, if digest is given, the
+ * engine's, read a window at a time so that a large one is never in
+ * memory whole.
+ */
+static int
+hash_stored(sqlite3_int64 row, unsigned char * strong, unsigned char * digest)
+{
+    union hash_state b;
+    union hash_state h;
+    sqlite3_blob * blob = 0;
+    char * buf = 0;
+    int rc = -1;
+
+    if(SQLITE_OK != sqlite3_blob_open(DB, "main", "blobs", "blob", row, 0, &blob) ||
+            0 == (buf = pool_get(STREAM_WINDOW, 0))) {
+        goto out;
+    }
+
+    HASH_STRONG->init(&b);
+    hash_engine->init(&h);
+
+    for(int at = 0, size = sqlite3_blob_bytes(blob), n; at < size; at += n) {
+        n = (size_t)(size - at) < STREAM_WINDOW ? size - at : (int)STREAM_WINDOW;
+
+        if(SQLITE_OK != sqlite3_blob_read(blob, buf, n, at)) {
+            goto out;
+        }
+
+        HASH_STRONG->update(&b, buf, n);
+
+        if(0 != digest) {
+            hash_engine->update(&h, buf, n);
+        }
+    }
+
+    HASH_STRONG->final(&b, strong);
+
+    if(0 != digest) {
+        hash_engine->final(&h, digest);
+    }
+
+    rc = 0;
+out:
+    pool_put(buf);
+    sqlite3_blob_close(blob);
+    return rc;
+}
+
+/*
+ * Whether the blob stored under key has the blake2b digest ours; the
+ * stored one is worked out from its bytes the first time it is asked
+ * about and kept in the strong column from then on, but for a blob
+ * longer than STREAM_WINDOW: setting a column rewrites the row whole, in
+ * memory, so that one is worked out again each time.
+ */
+int
+same_blob(const struct hash_key * const key, size_t size, const unsigned char * const ours)
+{
+    unsigned char theirs[32];
+    sqlite3_stmt * stmt;
+    sqlite3_int64 row = 0;
+    int known = 0;
+    int found = 0;
+
+    if(0 != (stmt = get_statement(GET_BLOB))) {
+        if(SQLITE_OK == bind_key(stmt, 1, key) &&
+                SQLITE_OK == sqlite3_bind_int64(stmt, 2, size) &&
+                SQLITE_ROW == sqlite3_step(stmt)) {
+            found = 1;
+            row = sqlite3_column_int64(stmt, 1);
+
+            if(sizeof(theirs) == sqlite3_column_bytes(stmt, 0)) {
+                memcpy(theirs, sqlite3_column_blob(stmt, 0), sizeof(theirs));
+                known = 1;
+            }
+        }
+    }
+
+    put_statement(stmt);
+
+    if(found && !known && 0 != hash_stored(row, theirs, 0)) {
+        return 0;
+    }
+
+    if(found && !known && size <= STREAM_WINDOW &&
+            SQLITE_OK == sqlite3_prepare_v2(DB, SET_BLOB_STRONG, -1, &stmt, NULL)) {
+        if(SQLITE_OK == sqlite3_bind_blob(stmt, 1, theirs, sizeof(theirs), SQLITE_STATIC) &&
+                SQLITE_OK == bind_key(stmt, 2, key) &&
+                SQLITE_OK == sqlite3_bind_int64(stmt, 3, size)) {
+            sqlite3_step(stmt);
+        }
+
+        sqlite3_finalize(stmt);
+    }
+
+    return found && 0 == memcmp(ours, theirs, sizeof(theirs));
+}
+
+/* stores buf, or size zeros if it is 0, under key, or 0 if it was there already */
+int
+add_blob(const struct hash_key * const key, size_t size, const char * const buf)
 {
     sqlite3_stmt * stmt;
+    int added = 0;
 
-    if(SQLITE_OK == sqlite3_prepare_v2(DB, ADD_BLOB, -1, &stmt, NULL)) {
-        if(SQLITE_OK == sqlite3_bind_int64(stmt, 1, hash)) {
-            if(SQLITE_OK == sqlite3_bind_int(stmt, 2, size)) {
-                if(SQLITE_OK == sqlite3_bind_blob(stmt, 3, buf, size, SQLITE_STATIC)) {
+    if(0 != (stmt = get_statement(ADD_BLOB))) {
+        if(SQLITE_OK == bind_key(stmt, 1, key)) {
+            if(SQLITE_OK == sqlite3_bind_int64(stmt, 2, size)) {
+                if(SQLITE_OK == (0 != buf ? sqlite3_bind_blob(stmt, 3, buf, size, SQLITE_STATIC) :
+                                 sqlite3_bind_zeroblob64(stmt, 3, size))) {
                     if(SQLITE_DONE == sqlite3_step(stmt)) {
-                        // SUCCESS
+                        added = sqlite3_changes(DB) > 0;
                     }
                 }
             }
         }
     }
 
+    put_statement(stmt);
+    return added;
+}
+
+/*
+ * A key that is already taken is normally the same content again.  With
+ * verify_blobs that is checked, and only then, so storing new content
+ * costs nothing extra; content that turns out to differ is stored under
+ * a key taken from its blake2b digest instead, *key says which, and 1 is
+ * returned so the file's own key, just as suspect, can be moved as well.
+ * A buf of 0 is size zeros.
+ */
+int
+insert_blob(struct hash_key * key, size_t size, const char * const buf)
+{
+    unsigned char strong[32];
+    char name[2 * HASH_MAX + 1];
+
+    if(add_blob(key, size, buf) || !verify_blobs) {
+        return 0;
+    }
+
+    if(0 != buf) {
+        hash_strong(buf, size, strong);
+    } else {
+        zero_state(size, strong);
+    }
+
+    if(same_blob(key, size, strong)) {
+        return 0;
+    }
+
+    hash_key_str(key, name, sizeof(name));
+    *key = hash_key(strong);
+
+    if(add_blob(key, size, buf)) {
+        fprintf(stderr, "Hash collision on blob %s (%zu bytes); stored it by blake2b\n",
+                name, size);
+    } else if(!same_blob(key, size, strong)) {
+        fprintf(stderr, "Can't store blob %s (%zu bytes); its blake2b key is taken too\n",
+                name, size);
+    }
+
+    return 1;
+}
+
+void
+drop_row(sqlite3_int64 row)
+{
+    sqlite3_stmt * stmt;
+
+    if(SQLITE_OK == sqlite3_prepare_v2(DB, DEL_BLOB, -1, &stmt, NULL)) {
+        if(SQLITE_OK == sqlite3_bind_int64(stmt, 1, row) && SQLITE_DONE == sqlite3_step(stmt)) {
+            // SUCCESS
+        }
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+/*
+ * Deletes whatever is stored under key without being the content the key
+ * was made from, by the engine or, for a moved blob, by blake2b; that is
+ * only ever a blob read from a file that shrank while it was mapped.
+ */
+static void
+drop_blob(const struct hash_key * const key)
+{
+    sqlite3_stmt * stmt;
+    unsigned char digest[HASH_MAX];
+    unsigned char strong[32];
+
+    if(SQLITE_OK != sqlite3_prepare_v2(DB, FIND_BLOBS, -1, &stmt, NULL)) {
+        return;
+    }
+
+    if(SQLITE_OK == bind_key(stmt, 1, key)) {
+        while(SQLITE_ROW == sqlite3_step(stmt)) {
+            const sqlite3_int64 row = sqlite3_column_int64(stmt, 0);
+            struct hash_key made;
+            struct hash_key moved;
+
+            if(0 != hash_stored(row, strong, digest)) {
+                continue;
+            }
+
+            made = hash_key(digest);
+            moved = hash_key(strong);
+
+            if(0 != memcmp(made.b, key->b, hash_key_bytes) &&
+                    0 != memcmp(moved.b, key->b, hash_key_bytes)) {
+                drop_row(row);
+            }
+        }
+    }
+
     sqlite3_finalize(stmt);
 }
 
+/* partial is how many bytes the hash covers if it is not the whole file, else -1 */
 void
-insert_file( const char * const path, Fnv64_t hash, int size)
+insert_file( const char * const path, const struct hash_key * const hash, sqlite3_int64 size,
+             const struct walk_entry * const e, sqlite3_int64 partial)
 {
     sqlite3_stmt * stmt;
 
-    if(SQLITE_OK == sqlite3_prepare_v2(DB, ADD_FILE, -1, &stmt, NULL)) {
+    if(0 != (stmt = get_statement(ADD_FILE))) {
         if(SQLITE_OK == sqlite3_bind_text(stmt, 1, path, strnlen(path, MAX_PATH),
                                           SQLITE_STATIC)) {
-            if(SQLITE_OK == sqlite3_bind_int64(stmt, 2, hash)) {
-                if(SQLITE_OK == sqlite3_bind_int(stmt, 3, size)) {
-                    if(SQLITE_DONE == sqlite3_step(stmt)) {
-                        // SUCCESS
+            if(SQLITE_OK == bind_key(stmt, 2, hash)) {
+                if(SQLITE_OK == sqlite3_bind_int64(stmt, 3, size)) {
+                    if(SQLITE_OK == sqlite3_bind_int64(stmt, 4, e->dev) &&
+                            SQLITE_OK == sqlite3_bind_int64(stmt, 5, e->ino) &&
+                            SQLITE_OK == sqlite3_bind_int64(stmt, 6, e->mtime_ns) &&
+                            SQLITE_OK == sqlite3_bind_int64(stmt, 7, e->ctime_ns) &&
+                            SQLITE_OK == (partial < 0 ? sqlite3_bind_null(stmt, 8) :
+                                          sqlite3_bind_int64(stmt, 8, partial))) {
+                        if(SQLITE_DONE == sqlite3_step(stmt)) {
+                            // SUCCESS
+                        }
                     }
                 }
             }
         }
     }
 
-    sqlite3_finalize(stmt);
+    put_statement(stmt);
 }
 
+/* a file_hash of 0 leaves the row unfiled, until the file's key is known */
 void
-insert_file_blob(Fnv64_t file_hash, Fnv64_t blob_hash, int ordinal)
+insert_file_blob(const struct hash_key * const file_hash,
+                 const struct hash_key * const blob_hash, sqlite3_int64 ordinal)
 {
     sqlite3_stmt * stmt;
 
-    if(SQLITE_OK == sqlite3_prepare_v2(DB, ADD_FILE_BLOB, -1, &stmt, NULL)) {
-        if(SQLITE_OK == sqlite3_bind_int64(stmt, 1, file_hash)) {
-            if(SQLITE_OK == sqlite3_bind_int64(stmt, 2, blob_hash)) {
-                if(SQLITE_OK == sqlite3_bind_int(stmt, 3, ordinal)) {
+    if(0 != (stmt = get_statement(ADD_FILE_BLOB))) {
+        if(SQLITE_OK == (0 != file_hash ? bind_key(stmt, 1, file_hash) :
+                         sqlite3_bind_null(stmt, 1))) {
+            if(SQLITE_OK == bind_key(stmt, 2, blob_hash)) {
+                if(SQLITE_OK == sqlite3_bind_int64(stmt, 3, ordinal)) {
                     if(SQLITE_DONE == sqlite3_step(stmt)) {
                         // SUCCESS
                     }
@@ -148,17 +598,69 @@ insert_file_blob(Fnv64_t file_hash, Fnv64_t blob_hash, int ordinal)
         }
     }
 
-    sqlite3_finalize(stmt);
+    put_statement(stmt);
+}
+
+/*
+ * Databases created before the stat columns existed get them added; the
+ * old rows keep NULLs there and are simply never considered unchanged.
+ * Later columns are added the same way.
+ */
+int
+migrate_db(void)
+{
+    static const char * const columns[][3] = {
+        {"files", "device", "INTEGER"},
+        {"files", "inode", "INTEGER"},
+        {"files", "mtime_ns", "INTEGER"},
+        {"files", "ctime_ns", "INTEGER"},
+        {"files", "partial", "INTEGER"},
+        {"blobs", "strong", "BLOB"},
+        {0, 0, 0}
+    };
+    sqlite3_stmt * stmt;
+    int rc = SQLITE_OK;
+
+    for(int i = 0; SQLITE_OK == rc && 0 != columns[i][0]; i++) {
+        char sql[128];
+        int have = 0;
+
+        snprintf(sql, sizeof(sql), "PRAGMA table_info(%s)", columns[i][0]);
+
+        if(SQLITE_OK != (rc = sqlite3_prepare_v2(DB, sql, -1, &stmt, NULL))) {
+            return rc;
+        }
+
+        while(SQLITE_ROW == sqlite3_step(stmt)) {
+            const char * name = (const char *)sqlite3_column_text(stmt, 1);
+
+            if(0 != name && 0 == strcmp(name, columns[i][1])) {
+                have = 1;
+            }
+        }
+
+        sqlite3_finalize(stmt);
+
+        if(have) {
+            continue;
+        }
+
+        snprintf(sql, sizeof(sql), "ALTER TABLE %s ADD COLUMN %s %s",
+                 columns[i][0], columns[i][1], columns[i][2]);
+        rc = sqlite3_exec(DB, sql, NULL, NULL, NULL);
+    }
+
+    return rc;
 }
 
 void
-insert_file_tag(Fnv64_t file_hash, const char * const key,
+insert_file_tag(const struct hash_key * const file_hash, const char * const key,
                 const char * const val)
 {
     sqlite3_stmt * stmt;
 
-    if(SQLITE_OK == sqlite3_prepare_v2(DB, ADD_FILE_TAG, -1, &stmt, NULL)) {
-        if(SQLITE_OK == sqlite3_bind_int64(stmt, 1, file_hash)) {
+    if(0 != (stmt = get_statement(ADD_FILE_TAG))) {
+        if(SQLITE_OK == bind_key(stmt, 1, file_hash)) {
             if(SQLITE_OK == sqlite3_bind_text(stmt, 2, key, strnlen(key, MAX_PATH),
                                               SQLITE_STATIC)) {
                 if(SQLITE_OK == sqlite3_bind_text(stmt, 3, val, strnlen(val, MAX_PATH),
@@ -171,166 +673,2125 @@ insert_file_tag(Fnv64_t file_hash, const char * const key,
         }
     }
 
-    sqlite3_finalize(stmt);
+    put_statement(stmt);
 }
 
-unsigned long long int
-store_file(const char * const fp, const double len)
+/* the value stored under key, to be freed by the caller, or 0 if there is none */
+char *
+get_meta(const char * const key)
 {
-    FILE * fd = 0;
-    const size_t max = len < MAX_LEN ? len : MAX_LEN;
-    size_t read = 0;
-    size_t total = 0;
-    short ordinal = 0;
-    Fnv64_t hash = FNV1A_64_INIT;
-    struct node * root = 0;
-    //fprintf(stderr, "\t\t\t\(%s) %lu/%f\n", fp, max, len);
-
-    if ((fd = fopen(fp, "rb")) == NULL) {
-        fprintf(stderr, "Can't open file %s; %s\n", fp, strerror(errno));
-        return 0;
-    };
-
-    char * buf = malloc(max);
+    sqlite3_stmt * stmt;
+    char * val = 0;
 
-    while (0 != (read = fread(buf,  1, max, fd))) {
-        if(total >= len) {
-            fprintf(
-                stderr,
-                "\t\tfile %s was changed while being read; breaking...\n",
-                fp);
-            break;
+    if(SQLITE_OK == sqlite3_prepare_v2(DB, GET_META, -1, &stmt, NULL)) {
+        if(SQLITE_OK == sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC)) {
+            if(SQLITE_ROW == sqlite3_step(stmt) && 0 != sqlite3_column_text(stmt, 0)) {
+                val = strdup((const char *)sqlite3_column_text(stmt, 0));
+            }
         }
-
-        Fnv64_t blob_hash = FNV1A_64_INIT;
-        blob_hash = fnv_64a_buf(buf, read, blob_hash);
-        insert_blob(blob_hash, read, buf);
-        root = new_node(blob_hash, ordinal++, root);
-        hash = fnv_64a_buf(buf, read, hash);
-        total += read;
     }
 
-    fclose(fd);
-    char * bp = buf;
+    sqlite3_finalize(stmt);
+    return val;
+}
 
-    if (0 == (buf = realloc(buf, MAX_PATH))) {
-        free(bp);
-        fprintf(stderr, "Can't realloc space... bailing\n");
-        return 0;
+/* stores val under key, or drops the key when val is 0 */
+int
+set_meta(const char * const key, const char * const val)
+{
+    sqlite3_stmt * stmt;
+    int rc;
+
+    if(SQLITE_OK != (rc = sqlite3_prepare_v2(DB, 0 != val ? SET_META : DEL_META, -1,
+                          &stmt, NULL))) {
+        return rc;
     }
 
-    bp = buf;
-    size_t cwd_len = 0;
+    if(SQLITE_OK == (rc = sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC)) &&
+            (0 == val || SQLITE_OK == (rc = sqlite3_bind_text(stmt, 2, val, -1,
+                                            SQLITE_STATIC)))) {
+        rc = SQLITE_DONE == sqlite3_step(stmt) ? SQLITE_OK : sqlite3_errcode(DB);
+    }
 
-    if('/' != fp[0]) {
-        if(getcwd(buf, MAX_PATH)) {
-            cwd_len = strnlen(buf, MAX_PATH);
+    sqlite3_finalize(stmt);
+    return rc;
+}
 
-            if (cwd_len < MAX_PATH) {
-                bp = buf + cwd_len + 1;
-                buf[cwd_len] = '/';
-            }
+/* the value stored under key, or dflt for a database that already has files */
+static char *
+get_setting(const char * const key, const char * const dflt)
+{
+    sqlite3_stmt * stmt;
+    char * have = get_meta(key);
+
+    if(0 == have &&
+            SQLITE_OK == sqlite3_prepare_v2(DB, "SELECT 1 FROM files LIMIT 1", -1, &stmt, NULL)) {
+        if(SQLITE_ROW == sqlite3_step(stmt)) {
+            have = strdup(dflt);
         }
+
+        sqlite3_finalize(stmt);
     }
 
-    strncpy(bp, fp, MAX_PATH - cwd_len - 1);
-    char * fpcopy = realpath(buf, NULL);
-    int fplen = strnlen(fpcopy, MAX_PATH);
-    insert_file(fpcopy, hash, len);
-    insert_file_tag(hash, "path", fpcopy);
-    char * tag = "file";
-    int has_ext = 0;
+    return have;
+}
 
-    for (; fplen >= 0; fplen--) {
-        if(0 == has_ext && '.' == fpcopy[fplen]) {
-            insert_file_tag(hash, "ext", fpcopy + fplen + 1);
-            has_ext++;
-        }
+/*
+ * Each database keeps the engine its hashes were made with under "hash".
+ * One from before engines existed that already has files is fnv64; a new
+ * one takes want, or fnv64 when nothing was asked for.
+ */
+int
+select_hash(const char * const want)
+{
+    const struct hash_engine * e = 0;
+    char * have = get_setting("hash", "fnv64");
+    int rc = SQLITE_OK;
 
-        if('/' == fpcopy[fplen]) {
-            fpcopy[fplen] = '\0';
-            insert_file_tag(hash, tag, fpcopy + fplen + 1);
-            has_ext = -1;
-            tag = "dir";
-        }
+    if(0 == have) {
+        e = hash_find(0 != want ? want : "fnv64");
+    } else if(0 == (e = hash_find(have))) {
+        fprintf(stderr, "Can't use db %s; unknown hash engine %s\n", db_name, have);
+        rc = SQLITE_ERROR;
+    } else if(0 != want && 0 != strcmp(want, have)) {
+        fprintf(stderr, "Can't use %s with db %s; it is hashed with %s\n", want, db_name, have);
+        rc = SQLITE_ERROR;
     }
 
-    if('\0' != fpcopy[0]) {
-        insert_file_tag(hash, "dir", fpcopy);
+    if(SQLITE_OK == rc && 0 != e) {
+        hash_engine = e;
+        rc = set_meta("hash", e->name);
     }
 
-    free(fpcopy);
-    fpcopy = 0;
+    free(have);
+    return rc;
+}
+
+/*
+ * The key width in bits is recorded under "keys".  Everything before it
+ * was 64, and a database only ever has the one width, since a key made
+ * at one is not found at another.  Wider keys need an engine whose
+ * digest is at least that long.
+ */
+int
+select_keys(const char * const want)
+{
+    char * have = get_setting("keys", "64");
+    long n = strtol(0 != have ? have : 0 != want ? want : "64", 0, 10);
+    int rc = SQLITE_OK;
+    char bits[16];
 
-    while(0 != root) {
-        insert_file_blob(hash, root->hash, root->ordinal);
-        struct node * prev = root->prev;
-        free(root);
-        root = prev;
+    if(64 != n && 128 != n && 256 != n) {
+        fprintf(stderr, "Can't use db %s; bad key width %s\n", db_name, have);
+        rc = SQLITE_ERROR;
+    } else if(0 != have && 0 != want && n != strtol(want, 0, 10)) {
+        fprintf(stderr, "Can't use %s bit keys with db %s; it has %s\n", want, db_name, have);
+        rc = SQLITE_ERROR;
+    } else if((size_t)n / 8 > hash_engine->size) {
+        fprintf(stderr, "Can't make %ld bit keys with %s; its digest is %zu bits\n",
+                n, hash_engine->name, 8 * hash_engine->size);
+        rc = SQLITE_ERROR;
+    } else {
+        hash_key_bytes = n / 8;
+        snprintf(bits, sizeof(bits), "%ld", n);
+        rc = set_meta("keys", bits);
     }
 
-    free(buf);
-    buf = 0;
-    return hash;
+    free(have);
+    return rc;
 }
 
-static int
-process_entry(const char * const fp, const struct stat * const info,
-              const int typeflag, struct FTW * pathinfo)
+/*
+ * Chunking is recorded under "chunking" the same way.  A database without
+ * the record keeps one blob per MAX_LEN of a file until chunking is asked
+ * for, and from then on always chunks with those settings.  Either way a
+ * blob must fit in a row, which SQLite limits to about a gigabyte unless
+ * built otherwise.
+ */
+int
+select_chunking(const char * const want)
 {
-    double bytes = 0;
-    unsigned long long int hash = 0;
+    const int limit = sqlite3_limit(DB, SQLITE_LIMIT_LENGTH, -1);
+    const size_t room = limit > 8192 ? ((size_t)limit - 4096) / 4096 * 4096 : 4096;
+    char * have = get_meta("chunking");
+    char asked[64] = "";
+    char spec[64];
+    int rc = SQLITE_OK;
 
-    switch (typeflag) {
-    case FTW_SL:
-    case FTW_SLN:
-        fprintf(stdout, " ??? (link) %s\n", fp);
-        break;
+    // want has been through chunk_tune() already, so the settings are its
+    if(0 != want) {
+        chunk_spec(asked, sizeof(asked));
+    }
 
-    case FTW_F:
-        bytes = (double)info->st_size;
-        fprintf(stdout, " ... %s (%0.0f) ", fp, bytes);
+    if(0 == have) {
+        rc = 0 != want && chunk_fixed <= room ? set_meta("chunking", asked) : SQLITE_OK;
+    } else if(0 != chunk_tune(have)) {
+        fprintf(stderr, "Can't use db %s; bad chunking %s\n", db_name, have);
+        rc = SQLITE_ERROR;
+    } else if(chunk_spec(spec, sizeof(spec)) > 0 && 0 != want && 0 != strcmp(spec, asked)) {
+        fprintf(stderr, "Can't chunk with %s in db %s; it is chunked with %s\n",
+                want, db_name, have);
+        rc = SQLITE_ERROR;
+    }
 
-        if((hash = store_file(fp, bytes)) == 0) {
-            hash = 0;
-        };
+    if(SQLITE_OK == rc && chunk_fixed > room) {
+        fprintf(stderr, "Can't store %zu byte chunks in db %s; it takes up to %zu\n",
+                chunk_fixed, db_name, room);
+        rc = SQLITE_ERROR;
+    }
 
-        fprintf(stdout, "%llx\n", hash);
+    blob_max = 0 != chunk_fixed ? chunk_fixed : MAX_LEN < room ? MAX_LEN : room;
+    free(have);
+    return rc;
+}
 
-        break;
+/*
+ * The tree leaf size is recorded under "tree" just like chunking, and for
+ * the same reason: a file's hash depends on it.  A database without the
+ * record that already has files hashed them linearly, "0", and keeps
+ * doing so.
+ */
+int
+select_tree(const char * const want)
+{
+    char * have = get_setting("tree", "0");
+    char asked[32] = "";
+    char spec[32];
+    int rc = SQLITE_OK;
 
-    case FTW_D:
-    case FTW_DP:
-        fprintf(stdout, " ... (dir) %s\n", fp);
-        break;
+    if(0 != want) {
+        tree_spec(asked, sizeof(asked));
+    }
 
-    case FTW_DNR:
+    if(0 == have) {
+        rc = 0 != want ? set_meta("tree", asked) : SQLITE_OK;
+    } else if(0 == strcmp(have, "0")) {
+        if(0 != want) {
+            fprintf(stderr, "Can't hash with %s leaves in db %s; it is hashed linearly\n",
+                    want, db_name);
+            rc = SQLITE_ERROR;
+        }
+    } else if(0 != tree_tune(have)) {
+        fprintf(stderr, "Can't use db %s; bad tree leaf %s\n", db_name, have);
+        rc = SQLITE_ERROR;
+    } else if(tree_spec(spec, sizeof(spec)) > 0 && 0 != want && 0 != strcmp(spec, asked)) {
+        fprintf(stderr, "Can't hash with %s leaves in db %s; it uses %s\n",
+                want, db_name, have);
+        rc = SQLITE_ERROR;
+    }
+
+    free(have);
+    return rc;
+}
+
+/*
+ * Whether blob content is kept is recorded under "content": "blobs", as
+ * every database before it did, or "none" for one that only keeps the
+ * hashes of files.  A database is one or the other for good, and one
+ * without content has nothing to chunk.
+ */
+int
+select_content(void)
+{
+    char * have = get_setting("content", "blobs");
+    int rc = SQLITE_OK;
+
+    if(0 == have) {
+        rc = set_meta("content", hash_only ? "none" : "blobs");
+    } else if(0 == strcmp(have, "none")) {
+        hash_only = 1;
+    } else if(0 != strcmp(have, "blobs")) {
+        fprintf(stderr, "Can't use db %s; unknown content %s\n", db_name, have);
+        rc = SQLITE_ERROR;
+    } else if(hash_only) {
+        fprintf(stderr, "Can't keep only hashes in db %s; it keeps content\n", db_name);
+        rc = SQLITE_ERROR;
+    }
+
+    if(SQLITE_OK == rc && hash_only && (0 != chunk_avg || 0 != chunk_fixed)) {
+        fprintf(stderr, "Can't chunk db %s; it keeps no content\n", db_name);
+        rc = SQLITE_ERROR;
+    }
+
+    free(have);
+    return rc;
+}
+
+/*
+ * Opens fp for reading only if it is (still) a regular file; a fifo or
+ * device node swapped in after the walk must not block or be consumed.
+ */
+FILE *
+open_regular(const char * const fp)
+{
+    struct stat st;
+    int fd = open(fp, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+
+    if(fd < 0) {
+        return NULL;
+    }
+
+    if(0 != fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return fdopen(fd, "rb");
+}
+
+/*
+ * A file being stored front to back, total of its len bytes so far.  A
+ * blob longer than what is at hand is streamed, and once STORE_NODES
+ * blobs are waiting for the file's key they are written out unfiled.
+ * Either way, storing a file takes as much memory whatever its size.
+ */
+struct store {
+    const struct walk_entry * e;
+    const char * path;
+    off_t len;
+    off_t total;
+    sqlite3_int64 ordinal;
+    int moved;
+    int failed;
+    union hash_state hash;
+    struct node * root;
+    size_t nodes;
+    int unfiled;
+    struct map * map;
+    struct stream stream;
+};
+
+/*
+ * How long the files of a hash-only scan took to hash, in the kernel and
+ * in process, from opening each to its digest; [1] is the kernel's.
+ */
+static struct {
+    int kernel;
+    double bytes[2];
+    double secs[2];
+    size_t files[2];
+} hashing;
+
+static void
+count_hashing(int kernel, const struct timespec * start, off_t size)
+{
+    struct timespec end;
+
+    if(!hash_only) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    hashing.secs[kernel] += (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    hashing.bytes[kernel] += (double)size;
+    hashing.files[kernel]++;
+}
+
+static void
+store_begin(struct store * s, const struct walk_entry * const e)
+{
+    memset(s, 0, sizeof(*s));
+    s->e = e;
+    s->path = e->path;
+    s->len = e->size;
+    s->stream.path = e->path;
+    s->stream.fd = -1;
+    s->stream.size = e->size;
+    hash_engine->init(&s->hash);
+}
+
+/* files the rows waiting under hash, or with 0 forgets them */
+static void
+file_unfiled(const struct hash_key * const hash)
+{
+    sqlite3_stmt * stmt;
+
+    if(0 != hash && SQLITE_OK == sqlite3_prepare_v2(DB, SET_UNFILED_BLOBS, -1, &stmt, NULL)) {
+        if(SQLITE_OK == bind_key(stmt, 1, hash) && SQLITE_DONE == sqlite3_step(stmt)) {
+            // SUCCESS
+        }
+
+        sqlite3_finalize(stmt);
+    }
+
+    // those left clash with rows the file already had
+    if(SQLITE_OK == sqlite3_prepare_v2(DB, DEL_UNFILED_BLOBS, -1, &stmt, NULL)) {
+        if(SQLITE_DONE == sqlite3_step(stmt)) {
+            // SUCCESS
+        }
+
+        sqlite3_finalize(stmt);
+    }
+}
+
+/* key is the next blob of s; past STORE_NODES of them, those waiting are written out */
+static void
+store_node(struct store * s, const struct hash_key * const key)
+{
+    s->root = new_node(key, s->ordinal++, s->root);
+
+    if(++s->nodes < STORE_NODES) {
+        return;
+    }
+
+    while(0 != s->root) {
+        struct node * prev = s->root->prev;
+
+        insert_file_blob(0, &s->root->hash, s->root->ordinal);
+        free(s->root);
+        s->root = prev;
+    }
+
+    s->nodes = 0;
+    s->unfiled = 1;
+}
+
+/* one blob of the file, of zeros if buf is 0; hashed is its finished-but-unfinalised state, if known */
+static void
+store_blob(struct store * s, const char * buf, size_t len, const union hash_state * hashed)
+{
+    union hash_state blob;
+    unsigned char digest[HASH_MAX];
+
+    if(0 != hashed) {
+        blob = *hashed;
+    } else if(0 == buf) {
+        blob = *zero_state(len, 0);
+    } else {
+        hash_engine->init(&blob);
+        hash_engine->update(&blob, buf, len);
+    }
+
+    hash_engine->final(&blob, digest);
+    struct hash_key blob_hash = hash_key(digest);
+    s->moved |= insert_blob(&blob_hash, len, buf);
+    store_node(s, &blob_hash);
+
+    if(0 != s->map && 0 != buf) {
+        map_advance(s->map, buf + len);
+    }
+}
+
+/* a whole blob of a file not chunked by content; the first blob's digest is where the file's starts */
+static void
+store_piece(struct store * s, const char * buf, size_t len)
+{
+    union hash_state blob;
+
+    if(0 == buf) {
+        blob = *zero_state(len, 0);
+
+        if(0 != s->ordinal) {
+            hash_zeros(hash_engine, &s->hash, len);
+        }
+    } else {
+        hash_engine->init(&blob);
+
+        if(0 == s->ordinal) {
+            hash_engine->update(&blob, buf, len);
+        } else {
+            hash_update2(&s->hash, &blob, buf, len);
+        }
+    }
+
+    if(0 == s->ordinal) {
+        s->hash = blob;
+    }
+
+    store_blob(s, buf, len, &blob);
+    s->total += len;
+}
+
+static off_t
+store_page(void)
+{
+    static off_t page = 0;
+
+    if(0 == page) {
+        long n = sysconf(_SC_PAGESIZE);
+        page = n > 0 ? (off_t)n : 4096;
+    }
+
+    return page;
+}
+
+/* n more bytes of the blob being streamed, or n zeros if p is 0, and stored once it is whole */
+static void
+store_streamed(struct store * s, const char * p, size_t n)
+{
+    struct hash_key key;
+    int whole = stream_write(&s->stream, 0 != s->ordinal ? &s->hash : 0, p, n);
+
+    if(0 != s->map && 0 != p) {
+        map_advance(s->map, p + n);
+    }
+
+    s->total += n;
+
+    if(!whole) {
+        return;
+    }
+
+    // the first blob's digest is where the file's starts
+    if(0 == s->ordinal) {
+        s->hash = s->stream.state;
+    }
+
+    s->moved |= stream_close(&s->stream, &key, &s->failed);
+    store_node(s, &key);
+}
+
+/*
+ * Takes the next len bytes of the file from buf, or len zeros if buf is
+ * 0, and says how many it took.  That is all of them but for two cases:
+ * nothing past the size the walk saw is taken, and with content-defined
+ * chunking a chunk cut short by the end of buf rather than its content is
+ * left, to be offered again with what follows, unless last says nothing
+ * does.  buf must then hold at least chunk_max bytes, and zeros are only
+ * for a file that is not chunked by content.
+ */
+static size_t
+store_stream(struct store * s, const char * buf, size_t len, int last)
+{
+    const off_t left = s->len - s->total;
+    size_t took = 0;
+
+    if((off_t)len >= left) {
+        len = (size_t)left;
+        last = 1;
+    }
+
+    if(hash_only) {
+        if(0 != buf) {
+            hash_engine->update(&s->hash, buf, len);
+        } else {
+            hash_zeros(hash_engine, &s->hash, len);
+        }
+
+        s->total += len;
+        return len;
+    }
+
+    if(0 != chunk_avg) {
+        for(size_t n; took < len; took += n) {
+            union hash_state blob;
+
+            n = chunk_cut((const unsigned char *)buf + took, len - took);
+
+            if(!last && took + n == len && n < chunk_max) {
+                break;
+            }
+
+            hash_engine->init(&blob);
+            hash_update2(&s->hash, &blob, buf + took, n);
+            store_blob(s, buf + took, n, &blob);
+        }
+
+        s->total += took;
+        return took;
+    }
+
+    while(took < len) {
+        const char * p = 0 != buf ? buf + took : 0;
+        size_t n;
+
+        if(0 == s->stream.len) {
+            const off_t rest = s->len - s->total;
+
+            n = rest < (off_t)blob_max ? (size_t)rest : blob_max;
+
+            if(n <= len - took) {
+                store_piece(s, p, n);
+                took += n;
+                continue;
+            }
+
+            stream_open(&s->stream, s->total, n);
+        }
+
+        n = s->stream.len - s->stream.at < len - took ? s->stream.len - s->stream.at : len - took;
+        store_streamed(s, p, n);
+        took += n;
+    }
+
+    return took;
+}
+
+/*
+ * A whole file read into one buffer is one blob, or with chunking as many
+ * as chunk_cut() finds in it, or as it takes with a file longer than a
+ * blob.  done, if given, is the state after hashing all of it, worked
+ * out ahead.
+ */
+static void
+store_chunk(struct store * s, char * buf, size_t read, const union hash_state * done)
+{
+    union hash_state blob;
+
+    if(hash_only) {
+        if(0 != done) {
+            s->hash = *done;
+        } else {
+            hash_engine->update(&s->hash, buf, read);
+        }
+
+        s->total += read;
+        return;
+    }
+
+    if(0 != chunk_avg && read > chunk_min) {
+        if(0 != done) {
+            s->hash = *done;
+        }
+
+        for(size_t off = 0, n; off < read; off += n) {
+            n = chunk_cut((const unsigned char *)buf + off, read - off);
+
+            if(0 != done) {
+                store_blob(s, buf + off, n, 0);
+                continue;
+            }
+
+            hash_engine->init(&blob);
+            hash_update2(&s->hash, &blob, buf + off, n);
+            store_blob(s, buf + off, n, &blob);
+        }
+
+        s->total += read;
+        return;
+    }
+
+    if(read > blob_max) {
+        store_stream(s, buf, read, 1);
+        return;
+    }
+
+    // the blob's digest is where the file's starts, so it is only hashed once
+    if(0 != done) {
+        blob = *done;
+    } else {
+        hash_engine->init(&blob);
+        hash_engine->update(&blob, buf, read);
+    }
+
+    s->hash = blob;
+    store_blob(s, buf, read, &blob);
+    s->total += read;
+}
+
+/*
+ * The real path of the directory the last file was recorded from, as
+ * the walk spelled it, so that the files after it in the same directory
+ * only need their name appended instead of a getcwd() and a realpath()
+ * of every component each.  A file's own name is never a link, as the
+ * walk does not follow them, so the two come to the same.
+ */
+static struct {
+    char * dir;
+    size_t len;
+    char * real;
+} resolved;
+
+static void
+forget_resolved(void)
+{
+    free(resolved.dir);
+    free(resolved.real);
+    memset(&resolved, 0, sizeof(resolved));
+}
+
+/* the absolute real path of file fp, to be freed by the caller, or 0 if out of memory */
+static char *
+resolve_file(const char * const fp)
+{
+    const char * name = strrchr(fp, '/');
+    const size_t len = 0 != name ? (size_t)(name - fp) : 0;
+    char * path;
+
+    name = 0 != name ? name + 1 : fp;
+
+    if(0 == resolved.dir || len != resolved.len || 0 != strncmp(fp, resolved.dir, len)) {
+        char * dir = 0 == len ? strdup(fp == name ? "." : "/") : strndup(fp, len);
+        char * real = 0 != dir ? realpath(dir, NULL) : 0;
+
+        if(0 == real) {
+            free(dir);
+            return 0;
+        }
+
+        forget_resolved();
+        resolved.dir = dir;
+        resolved.len = len;
+        resolved.real = real;
+    }
+
+    if(0 != (path = malloc(strlen(resolved.real) + strlen(name) + 2))) {
+        sprintf(path, "%s%s%s", resolved.real,
+                '/' == resolved.real[strlen(resolved.real) - 1] ? "" : "/", name);
+    }
+
+    return path;
+}
+
+/*
+ * The files row and tags for e, filed under its absolute path.  A hash
+ * that does not cover the whole file says nothing about its content, so
+ * such a row gets no tags to share with whatever else ends up with it.
+ * fpcopy is that path, and is freed.
+ */
+static int
+record_path(const struct walk_entry * const e, const struct hash_key * const hash,
+            off_t len, sqlite3_int64 partial, char * fpcopy)
+{
+    int fplen = strnlen(fpcopy, MAX_PATH);
+    insert_file(fpcopy, hash, len, e, partial);
+
+    if(partial >= 0) {
+        free(fpcopy);
+        return 0;
+    }
+
+    insert_file_tag(hash, "path", fpcopy);
+    char * tag = "file";
+    int has_ext = 0;
+
+    for (; fplen >= 0; fplen--) {
+        if(0 == has_ext && '.' == fpcopy[fplen]) {
+            insert_file_tag(hash, "ext", fpcopy + fplen + 1);
+            has_ext++;
+        }
+
+        if('/' == fpcopy[fplen]) {
+            fpcopy[fplen] = '\0';
+            insert_file_tag(hash, tag, fpcopy + fplen + 1);
+            has_ext = -1;
+            tag = "dir";
+        }
+    }
+
+    if('\0' != fpcopy[0]) {
+        insert_file_tag(hash, "dir", fpcopy);
+    }
+
+    free(fpcopy);
+    return 0;
+}
+
+/* record_path() for e, resolved the long way if its directory can't be */
+int
+record_file(const struct walk_entry * const e, const struct hash_key * const hash,
+            off_t len, sqlite3_int64 partial)
+{
+    const char * const fp = e->path;
+    char * fpcopy = resolve_file(fp);
+
+    if(0 != fpcopy) {
+        return record_path(e, hash, len, partial, fpcopy);
+    }
+
+    char * buf = malloc(MAX_PATH);
+
+    if (0 == buf) {
+        fprintf(stderr, "Can't alloc space... bailing\n");
+        return -1;
+    }
+
+    char * bp = buf;
+    size_t cwd_len = 0;
+
+    if('/' != fp[0]) {
+        if(getcwd(buf, MAX_PATH)) {
+            cwd_len = strnlen(buf, MAX_PATH);
+
+            if (cwd_len < MAX_PATH) {
+                bp = buf + cwd_len + 1;
+                buf[cwd_len] = '/';
+            }
+        }
+    }
+
+    strncpy(bp, fp, MAX_PATH - cwd_len - 1);
+    fpcopy = realpath(buf, NULL);
+
+    if (0 == fpcopy) {
+        fprintf(stderr, "Can't resolve path %s; %s\n", fp, strerror(errno));
+        fpcopy = strdup(buf);
+    }
+
+    free(buf);
+    return record_path(e, hash, len, partial, fpcopy);
+}
+
+/* forgets the blobs of s so far; with verify, also those stored wrong */
+static void
+store_drop(struct store * s, int verify)
+{
+    sqlite3_stmt * stmt;
+
+    s->stream.len = 0;
+    s->stream.at = 0;
+
+    while(0 != s->root) {
+        struct node * prev = s->root->prev;
+
+        if(verify) {
+            drop_blob(&s->root->hash);
+        }
+
+        free(s->root);
+        s->root = prev;
+    }
+
+    if(s->unfiled && verify &&
+            SQLITE_OK == sqlite3_prepare_v2(DB, GET_UNFILED_BLOBS, -1, &stmt, NULL)) {
+        while(SQLITE_ROW == sqlite3_step(stmt)) {
+            struct hash_key k = column_key(stmt, 0);
+
+            drop_blob(&k);
+        }
+
+        sqlite3_finalize(stmt);
+    }
+
+    if(s->unfiled) {
+        file_unfiled(0);
+    }
+
+    s->nodes = 0;
+    s->unfiled = 0;
+}
+
+/*
+ * The file's key, or a zero one if it could not be recorded.  A file with
+ * a blob that had to move is keyed by the blake2b digest of its key and
+ * those of its blobs, newest first, instead, or it would share its rows
+ * with whatever holds the key already.
+ */
+static struct hash_key
+store_done(struct store * s, struct hash_key hash)
+{
+    sqlite3_stmt * stmt;
+
+    if(s->failed) {
+        store_drop(s, 0);
+        return (struct hash_key) {{0}};
+    }
+
+    if(s->moved) {
+        union hash_state b;
+        unsigned char strong[32];
+
+        HASH_STRONG->init(&b);
+        HASH_STRONG->update(&b, hash.b, hash_key_bytes);
+
+        for(struct node * i = s->root; 0 != i; i = i->prev) {
+            HASH_STRONG->update(&b, i->hash.b, hash_key_bytes);
+        }
+
+        if(s->unfiled && SQLITE_OK == sqlite3_prepare_v2(DB, GET_UNFILED_BLOBS, -1, &stmt, NULL)) {
+            while(SQLITE_ROW == sqlite3_step(stmt)) {
+                struct hash_key k = column_key(stmt, 0);
+
+                HASH_STRONG->update(&b, k.b, hash_key_bytes);
+            }
+
+            sqlite3_finalize(stmt);
+        }
+
+        HASH_STRONG->final(&b, strong);
+        hash = hash_key(strong);
+    }
+
+    if(0 != record_file(s->e, &hash, s->len, -1)) {
+        store_drop(s, 0);
+        return (struct hash_key) {{0}};
+    }
+
+    while(0 != s->root) {
+        struct node * prev = s->root->prev;
+
+        insert_file_blob(&hash, &s->root->hash, s->root->ordinal);
+        free(s->root);
+        s->root = prev;
+    }
+
+    if(s->unfiled) {
+        file_unfiled(&hash);
+    }
+
+    s->nodes = 0;
+    s->unfiled = 0;
+    return hash;
+}
+
+/*
+ * Each piece of e that would otherwise be read into a buffer is hashed
+ * and stored straight from a mapping of it instead, so no copy is made,
+ * and pages are unmapped once stored.  It is taken a window at a time,
+ * and a piece starts at the page holding the first byte not yet taken.
+ * 1 if the file shrank while mapped, -1 if it could not be mapped; either
+ * way it is read instead.
+ */
+static int
+store_mapped(struct store * s, int fd, const struct walk_entry * const e)
+{
+    const off_t page = store_page();
+    const size_t window = MAP_AHEAD > chunk_max ? MAP_AHEAD : chunk_max;
+    struct map m;
+
+    store_begin(s, e);
+    stream_sparse(&s->stream, fd);
+
+    while(s->total < s->len) {
+        const off_t hole = stream_hole(&s->stream, s->total);
+        const off_t at = s->total / page * page;
+        off_t end;
+        size_t n;
+
+        if(hole > 0) {
+            store_stream(s, 0, (size_t)hole, 0);
+            continue;
+        }
+
+        end = stream_data(&s->stream, s->total);
+        n = (size_t)(end - at) < MAX_LEN ? (size_t)(end - at) : MAX_LEN;
+
+        if(0 != map_open(&m, fd, at, n)) {
+            store_drop(s, 0);
+            return -1;
+        }
+
+        if(at + (off_t)n < s->len) {
+            map_ahead(fd, at + n);
+        }
+
+        s->map = &m;
+
+        for(size_t from = (size_t)(s->total - at), w, took; from < n; from += took) {
+            w = n - from < window ? n - from : window;
+
+            if(0 == (took = store_stream(s, m.base + from, w, 0))) {
+                break;
+            }
+
+            map_advance(&m, m.base + from + took);
+        }
+
+        s->map = 0;
+
+        if(0 != map_close(&m)) {
+            store_drop(s, 1);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Otherwise e is read a window at a time into a buffer of the same size
+ * whatever the file's, a window starting at the aligned offset before the
+ * first byte not yet taken.  For a cache-neutral scan, that is around the
+ * page cache where fd takes O_DIRECT, else through it with the next
+ * window read ahead, and then let go of again.  -1 if there is no buffer.
+ */
+static int
+store_read(struct store * s, int fd, const struct walk_entry * const e)
+{
+    const size_t window = STREAM_WINDOW > chunk_max + CACHE_ALIGN ?
+                          STREAM_WINDOW : chunk_max + CACHE_ALIGN;
+    const size_t want = (size_t)e->size < window ? (size_t)e->size : window;
+    const size_t cap = want > 0 ? (want + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN : CACHE_ALIGN;
+    const size_t span = cap < CACHE_SPAN ? cap : CACHE_SPAN;
+    int direct = cache_neutral && 0 == cache_direct(fd);
+    struct cache_cursor c = {0};
+    char * buf = 0;
+
+    store_begin(s, e);
+    stream_sparse(&s->stream, fd);
+
+    if(0 == (buf = pool_get(cap, 0))) {
+        fprintf(stderr, "Can't alloc %zu bytes for file %s\n", cap, e->path);
+        return -1;
+    }
+
+    if(cache_neutral) {
+        cache_open(&c, fd, 0, span);
+    }
+
+    while(s->total < s->len) {
+        const off_t hole = stream_hole(&s->stream, s->total);
+        const off_t at = s->total / (off_t)CACHE_ALIGN * (off_t)CACHE_ALIGN;
+        const size_t skip = (size_t)(s->total - at);
+        size_t have = 0;
+        int end = 0;
+
+        if(hole > 0) {
+            store_stream(s, 0, (size_t)hole, 0);
+
+            // the cursor starts again past the hole rather than walk through it
+            if(cache_neutral) {
+                cache_close(&c);
+                cache_open(&c, fd, s->total, span);
+            }
+
+            continue;
+        }
+
+        while(have < cap) {
+            const size_t n = cap - have < CACHE_WINDOW ? cap - have : CACHE_WINDOW;
+            const off_t from = at + (off_t)have;
+            ssize_t got;
+
+            if(cache_neutral && !direct) {
+                cache_ahead(fd, from + (off_t)n, CACHE_WINDOW);
+            }
+
+            got = pread(fd, buf + have, n, from);
+
+            // a filesystem can take the flag and still refuse the reads
+            if(got < 0 && direct && EINVAL == errno) {
+                cache_buffered(fd);
+                direct = 0;
+                continue;
+            }
+
+            if(got < 0 && EINTR == errno) {
+                continue;
+            }
+
+            if(got <= 0) {
+                end = 1;
+                break;
+            }
+
+            have += got;
+
+            if(cache_neutral) {
+                cache_advance(&c, from + got);
+            }
+
+            if((size_t)got < n) {
+                end = 1;
+                break;
+            }
+        }
+
+        if(have <= skip || 0 == store_stream(s, buf + skip, have - skip, end)) {
+            break;
+        }
+    }
+
+    cache_close(&c);
+    pool_put(buf);
+    return 0;
+}
+
+/* a file that shrank while it was read ends its last blob early; the rest of it is zeros */
+static struct hash_key
+store_end(struct store * s)
+{
+    unsigned char digest[HASH_MAX];
+
+    if(0 != s->stream.len) {
+        fprintf(stderr, "\t\tfile %s was changed while being read; its end is stored as zeros\n",
+                s->path);
+        store_streamed(s, 0, s->stream.len - s->stream.at);
+    }
+
+    hash_engine->final(&s->hash, digest);
+    return store_done(s, hash_key(digest));
+}
+
+struct hash_key
+store_file(const struct walk_entry * const e)
+{
+    const char * const fp = e->path;
+    FILE * fd = 0;
+    struct store s;
+    struct timespec start;
+    struct hash_key hash;
+    unsigned char digest[HASH_MAX];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if ((fd = open_regular(fp)) == NULL) {
+        fprintf(stderr, "Can't open file %s; %s\n", fp, strerror(errno));
+        return (struct hash_key) {{0}};
+    };
+
+    // splice() leaves the offset alone, so a failed try is simply read again
+    if(hashing.kernel && e->size > 0 &&
+            0 == afalg_file(fileno(fd), e->size, digest, hash_engine->size)) {
+        fclose(fd);
+        count_hashing(1, &start, e->size);
+        store_begin(&s, e);
+        return store_done(&s, hash_key(digest));
+    }
+
+    // a cache-neutral scan reads every file, as it can't map one without caching it
+    if(!cache_neutral && (size_t)e->size >= MAP_MIN) {
+        int torn = store_mapped(&s, fileno(fd), e);
+
+        if(0 == torn) {
+            hash = store_end(&s);
+            fclose(fd);
+            count_hashing(0, &start, e->size);
+            return hash;
+        }
+
+        if(torn > 0) {
+            fprintf(stderr, "\t\tfile %s was changed while being read; reading it again...\n", fp);
+        }
+    }
+
+    if(0 != store_read(&s, fileno(fd), e)) {
+        fclose(fd);
+        return (struct hash_key) {{0}};
+    }
+
+    hash = store_end(&s);
+    fclose(fd);
+    count_hashing(0, &start, e->size);
+    return hash;
+}
+
+/*
+ * What the database already knows about each path, for incremental runs:
+ * the newest row per path, keyed by the FNV-1a hash of the path.
+ */
+struct known {
+    char * path;
+    struct hash_key hash;
+    sqlite3_int64 size;
+    sqlite3_int64 dev;
+    sqlite3_int64 ino;
+    sqlite3_int64 mtime_ns;
+    sqlite3_int64 ctime_ns;
+    sqlite3_int64 partial;
+    int seen;
+};
+
+static struct {
+    struct table map;
+    char * root;
+    size_t root_len;
+    const char * walk_root;
+    size_t walk_len;
+} known;
+
+static int
+known_match(const void * val, const void * arg)
+{
+    return 0 == strcmp(((const struct known *)val)->path, (const char *)arg);
+}
+
+static void
+known_release(void * val)
+{
+    free(((struct known *)val)->path);
+    free(val);
+}
+
+/*
+ * Binds path as ?1 and everything below it as the range [?2, ?3), i.e.
+ * "path/" up to "path0", so the lookup stays on the path index.
+ */
+static int
+bind_subtree(sqlite3_stmt * stmt, const char * const path)
+{
+    size_t len = strlen(path);
+    char * lo = malloc(len + 2);
+    char * hi = malloc(len + 2);
+    int rc = SQLITE_NOMEM;
+
+    if(0 != lo && 0 != hi) {
+        memcpy(lo, path, len + 1);
+
+        if(0 == len || '/' != path[len - 1]) {
+            lo[len++] = '/';
+            lo[len] = '\0';
+        }
+
+        memcpy(hi, lo, len + 1);
+        hi[len - 1] = '/' + 1;
+
+        if(SQLITE_OK == (rc = sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT)) &&
+                SQLITE_OK == (rc = sqlite3_bind_text(stmt, 2, lo, -1, SQLITE_TRANSIENT))) {
+            rc = sqlite3_bind_text(stmt, 3, hi, -1, SQLITE_TRANSIENT);
+        }
+    }
+
+    free(lo);
+    free(hi);
+    return rc;
+}
+
+/* drops every row for path and anything below it */
+int
+remove_path(const char * const path)
+{
+    sqlite3_stmt * stmt;
+    int rc;
+
+    if(SQLITE_OK != (rc = sqlite3_prepare_v2(DB, DEL_FILES, -1, &stmt, NULL))) {
+        return rc;
+    }
+
+    if(SQLITE_OK == (rc = bind_subtree(stmt, path))) {
+        rc = SQLITE_DONE == sqlite3_step(stmt) ? SQLITE_OK : sqlite3_errcode(DB);
+    }
+
+    if(SQLITE_OK == rc && sqlite3_changes(DB) > 0) {
+        fprintf(stdout, " ... (removed) %s\n", path);
+    }
+
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+static int
+load_known(const char * const dir)
+{
+    sqlite3_stmt * stmt;
+    struct known * last = 0;
+
+    if(0 == (known.root = realpath(dir, NULL))) {
+        return -1;
+    }
+
+    known.root_len = strlen(known.root);
+    known.walk_root = dir;
+    known.walk_len = strlen(dir);
+
+    if(SQLITE_OK != sqlite3_prepare_v2(DB, GET_FILES, -1, &stmt, NULL)) {
+        return -1;
+    }
+
+    if(SQLITE_OK != bind_subtree(stmt, known.root)) {
+        sqlite3_finalize(stmt);
+        return -1;
+    }
+
+    while(SQLITE_ROW == sqlite3_step(stmt)) {
+        const char * path = (const char *)sqlite3_column_text(stmt, 0);
+
+        if(0 == path) {
+            continue;
+        }
+
+        if(0 == last || 0 != strcmp(last->path, path)) {
+            if(0 == (last = calloc(1, sizeof(struct known))) ||
+                    0 == (last->path = strdup(path))) {
+                free(last);
+                last = 0;
+                break;
+            }
+
+            table_put(&known.map, fnv_64a_str(last->path, FNV1A_64_INIT), last);
+        }
+
+        last->hash = column_key(stmt, 1);
+        last->size = sqlite3_column_int64(stmt, 2);
+        last->dev = sqlite3_column_int64(stmt, 3);
+        last->ino = sqlite3_column_int64(stmt, 4);
+        last->mtime_ns = sqlite3_column_int64(stmt, 5);
+        last->ctime_ns = sqlite3_column_int64(stmt, 6);
+        last->partial = SQLITE_NULL == sqlite3_column_type(stmt, 7) ? -1 :
+                        sqlite3_column_int64(stmt, 7);
+    }
+
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+/*
+ * A file is unchanged when its whole stat tuple matches the last scan and
+ * it was fully hashed then; every path that is looked up is marked as
+ * still present either way, and *was is its last row even if it has
+ * changed since.
+ */
+static const struct known *
+find_known(const struct walk_entry * const e, const struct known ** was)
+{
+    const char * rest = e->path + known.walk_len;
+    char * path;
+    size_t len;
+
+    if(0 == known.map.count || 0 != strncmp(e->path, known.walk_root, known.walk_len)) {
+        return 0;
+    }
+
+    while('/' == *rest) {
+        rest++;
+    }
+
+    len = known.root_len + 1 + strlen(rest) + 1;
+
+    if(0 == (path = malloc(len))) {
+        return 0;
+    }
+
+    snprintf(path, len, "%s%s%s", known.root,
+             '\0' == *rest || '/' == known.root[known.root_len - 1] ? "" : "/", rest);
+    struct known * k = table_get(&known.map, fnv_64a_str(path, FNV1A_64_INIT),
+                                 known_match, path);
+    free(path);
+
+    if(0 != k) {
+        k->seen = 1;
+    }
+
+    *was = k;
+
+    if(0 == k || k->partial >= 0 || k->size != e->size ||
+            k->dev != (sqlite3_int64)e->dev || k->ino != (sqlite3_int64)e->ino || k->mtime_ns != e->mtime_ns ||
+            k->ctime_ns != e->ctime_ns) {
+        return 0;
+    }
+
+    return k;
+}
+
+/*
+ * A file larger than one leaf is tree hashed, tree_jobs leaves at a time,
+ * and every leaf gets a file_leaves row with its digest, the blobs it was
+ * cut into and its extent fingerprint.  Where tree_trusted() holds, a leaf
+ * whose fingerprint is the one the previous version of the file had is
+ * not read again; its digest and blobs are taken over from that row, so a
+ * file changed in a few places only costs the leaves that were written.
+ */
+struct old_leaf {
+    unsigned char digest[HASH_MAX];
+    sqlite3_int64 first;
+    sqlite3_int64 blobs;
+    uint64_t extents;
+};
+
+static struct old_leaf *
+load_leaves(const struct hash_key * const hash, size_t count)
+{
+    sqlite3_stmt * stmt;
+    struct old_leaf * old = calloc(count, sizeof(struct old_leaf));
+
+    if(0 == old) {
+        return 0;
+    }
+
+    if(SQLITE_OK == sqlite3_prepare_v2(DB, GET_FILE_LEAVES, -1, &stmt, NULL)) {
+        if(SQLITE_OK == bind_key(stmt, 1, hash)) {
+            while(SQLITE_ROW == sqlite3_step(stmt)) {
+                sqlite3_int64 i = sqlite3_column_int64(stmt, 0);
+
+                if(i < 0 || (size_t)i >= count ||
+                        (size_t)sqlite3_column_bytes(stmt, 1) != hash_engine->size) {
+                    continue;
+                }
+
+                memcpy(old[i].digest, sqlite3_column_blob(stmt, 1), hash_engine->size);
+                old[i].first = sqlite3_column_int64(stmt, 2);
+                old[i].blobs = sqlite3_column_int64(stmt, 3);
+                old[i].extents = sqlite3_column_int64(stmt, 4);
+            }
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    return old;
+}
+
+/* takes over the blobs of leaf o of file hash into l, unless some are missing */
+static int
+reuse_leaf(const struct hash_key * const hash, const struct old_leaf * o, struct leaf * l)
+{
+    sqlite3_stmt * stmt;
+
+    // a leaf of a hash-only database has its digest and nothing else
+    if(o->blobs > 0 && 0 == (l->ids = malloc(o->blobs * sizeof(struct hash_key)))) {
+        return -1;
+    }
+
+    if(SQLITE_OK == sqlite3_prepare_v2(DB, GET_LEAF_BLOBS, -1, &stmt, NULL)) {
+        if(SQLITE_OK == bind_key(stmt, 1, hash) &&
+                SQLITE_OK == sqlite3_bind_int64(stmt, 2, o->first) &&
+                SQLITE_OK == sqlite3_bind_int64(stmt, 3, o->first + o->blobs)) {
+            while(l->nchunks < (size_t)o->blobs && SQLITE_ROW == sqlite3_step(stmt)) {
+                l->ids[l->nchunks++] = column_key(stmt, 0);
+            }
+        }
+    }
+
+    sqlite3_finalize(stmt);
+
+    if(l->nchunks != (size_t)o->blobs) {
+        tree_release(l);
+        return -1;
+    }
+
+    memcpy(l->digest, o->digest, hash_engine->size);
+    l->reuse = 1;
+    return 0;
+}
+
+static void
+insert_file_leaf(const struct hash_key * const file_hash, sqlite3_int64 leaf,
+                 const struct old_leaf * row)
+{
+    sqlite3_stmt * stmt;
+
+    if(0 != (stmt = get_statement(ADD_FILE_LEAF))) {
+        if(SQLITE_OK == bind_key(stmt, 1, file_hash) &&
+                SQLITE_OK == sqlite3_bind_int64(stmt, 2, leaf) &&
+                SQLITE_OK == sqlite3_bind_blob(stmt, 3, row->digest, hash_engine->size,
+                        SQLITE_STATIC) &&
+                SQLITE_OK == sqlite3_bind_int64(stmt, 4, row->first) &&
+                SQLITE_OK == sqlite3_bind_int64(stmt, 5, row->blobs) &&
+                SQLITE_OK == sqlite3_bind_int64(stmt, 6, row->extents)) {
+            if(SQLITE_DONE == sqlite3_step(stmt)) {
+                // SUCCESS
+            }
+        }
+    }
+
+    put_statement(stmt);
+}
+
+/* the blobs of a leaf that was read, or the hashes of one that was not */
+static void
+store_leaf(struct store * s, struct leaf * l)
+{
+    size_t start = 0;
+
+    if(hash_only) {
+        // nothing but the digest is kept
+    } else if(l->reuse) {
+        for(size_t i = 0; i < l->nchunks; i++) {
+            store_node(s, &l->ids[i]);
+        }
+    } else if(0 == l->nchunks) {
+        struct hash_key key = hash_key(l->digest);
+
+        s->moved |= insert_blob(&key, l->len, l->buf);
+        store_node(s, &key);
+    } else {
+        for(size_t i = 0; i < l->nchunks; i++) {
+            s->moved |= insert_blob(&l->ids[i], l->ends[i] - start, l->buf + start);
+            store_node(s, &l->ids[i]);
+            start = l->ends[i];
+        }
+    }
+
+    s->total += l->len;
+}
+
+static struct hash_key
+store_tree(const struct walk_entry * const e, const struct known * const stale)
+{
+    const size_t count = ((size_t)e->size + tree_leaf - 1) / tree_leaf;
+    unsigned char * digests = malloc(count * hash_engine->size);
+    struct old_leaf * rows = calloc(count, sizeof(struct old_leaf));
+    struct leaf * group = calloc(tree_jobs, sizeof(struct leaf));
+    struct old_leaf * old = 0;
+    unsigned char root[HASH_MAX];
+    struct hash_key hash = {{0}};
+    size_t reused = 0;
+    struct store s = {0};
+    struct cache_cursor cursor = {0};
+    FILE * fp = 0;
+    int trusted;
+    int fd;
+
+    if(0 == digests || 0 == rows || 0 == group) {
+        fprintf(stderr, "Can't alloc space... bailing\n");
+        goto out;
+    }
+
+    if(0 == (fp = open_regular(e->path))) {
+        fprintf(stderr, "Can't open file %s; %s\n", e->path, strerror(errno));
+        goto out;
+    }
+
+    fd = fileno(fp);
+    trusted = tree_trusted(fd);
+
+    // leaves are read whole, so nothing needs reading ahead of them
+    if(cache_neutral) {
+        cache_buffered(fd);
+        cache_open(&cursor, fd, 0, CACHE_SPAN > tree_jobs * tree_leaf ?
+                   CACHE_SPAN : tree_jobs * tree_leaf);
+    }
+
+    if(trusted && 0 != stale) {
+        old = load_leaves(&stale->hash, count);
+    }
+
+    store_begin(&s, e);
+
+    for(size_t at = 0, n; at < count; at += n) {
+        n = count - at < (size_t)tree_jobs ? count - at : (size_t)tree_jobs;
+
+        for(size_t j = 0; j < n; j++) {
+            struct leaf * l = &group[j];
+            size_t i = at + j;
+
+            memset(l, 0, sizeof(struct leaf));
+            l->off = (off_t)i * tree_leaf;
+            l->len = (size_t)(e->size - l->off) < tree_leaf ? (size_t)(e->size - l->off) : tree_leaf;
+            l->extents = trusted ? tree_extents(fd, l->off, l->len) : 0;
+
+            // the old leaf must also have been just as long
+            if(0 != old && 0 != l->extents && l->extents == old[i].extents &&
+                    (old[i].blobs > 0 || hash_only) && stale->size >= l->off + (off_t)l->len &&
+                    (l->len == tree_leaf || stale->size == e->size) &&
+                    0 == reuse_leaf(&stale->hash, &old[i], l)) {
+                reused++;
+            }
+        }
+
+        tree_read(fd, group, n);
+
+        if(cache_neutral) {
+            cache_advance(&cursor, group[n - 1].off + (off_t)group[n - 1].len);
+        }
+
+        for(size_t j = 0; j < n; j++) {
+            struct leaf * l = &group[j];
+            struct old_leaf * row = &rows[at + j];
+
+            if(0 != l->error) {
+                fprintf(stderr, "Can't read file %s; %s\n", e->path, strerror(l->error));
+
+                for(; j < n; j++) {
+                    tree_release(&group[j]);
+                }
+
+                goto out;
+            }
+
+            row->first = s.ordinal;
+            store_leaf(&s, l);
+            row->blobs = s.ordinal - row->first;
+            memcpy(row->digest, l->digest, hash_engine->size);
+
+            // written to while it was read; not to be vouched for next time
+            row->extents = l->reuse || (0 != l->extents &&
+                           l->extents == tree_extents(fd, l->off, l->len)) ? l->extents : 0;
+            memcpy(digests + (at + j) * hash_engine->size, l->digest, hash_engine->size);
+            tree_release(l);
+        }
+    }
+
+    tree_root(digests, count, e->size, root);
+
+    hash = store_done(&s, hash_key(root));
+
+    for(size_t i = 0; !hash_key_zero(&hash) && i < count; i++) {
+        insert_file_leaf(&hash, (sqlite3_int64)i, &rows[i]);
+    }
+
+    if(reused > 0) {
+        fprintf(stdout, "(%zu/%zu leaves unchanged) ", reused, count);
+    }
+
+out:
+    cache_close(&cursor);
+
+    if(0 != fp) {
+        fclose(fp);
+    }
+
+    store_drop(&s, 0);
+    free(digests);
+    free(rows);
+    free(group);
+    free(old);
+    return hash;
+}
+
+/*
+ * Every inode with more than one link is remembered for the rest of the
+ * scan; later links take the hash of the first instead of reading the
+ * same data again, and the shared device and inode in their rows is what
+ * tells a hard link from a true duplicate.
+ */
+enum {
+    LINK_PENDING,
+    LINK_HASHED,
+    LINK_FAILED,
+};
+
+struct link {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    int64_t mtime_ns;
+    struct hash_key hash;
+    int state;
+};
+
+static struct table links;
+
+static uint64_t
+link_key(dev_t dev, ino_t ino)
+{
+    return ((uint64_t)ino * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)dev;
+}
+
+static int
+link_match(const void * val, const void * arg)
+{
+    const struct link * a = val;
+    const struct walk_entry * e = arg;
+
+    return a->dev == e->dev && a->ino == e->ino;
+}
+
+/* the inode's entry, or 0 with *first set when e is its first link seen */
+static struct link *
+find_link(const struct walk_entry * const e, int * first)
+{
+    struct link * l = table_get(&links, link_key(e->dev, e->ino), link_match, e);
+
+    *first = 0;
+
+    if(0 != l) {
+        // changed between links; hash this one on its own
+        return l->size == e->size && l->mtime_ns == e->mtime_ns ? l : 0;
+    }
+
+    if(0 == (l = calloc(1, sizeof(struct link)))) {
+        return 0;
+    }
+
+    l->dev = e->dev;
+    l->ino = e->ino;
+    l->size = e->size;
+    l->mtime_ns = e->mtime_ns;
+    l->state = LINK_PENDING;
+
+    if(0 != table_put(&links, link_key(e->dev, e->ino), l)) {
+        free(l);
+        return 0;
+    }
+
+    *first = 1;
+    return l;
+}
+
+/*
+ * Entries are retired strictly in walk order, but up to `window` of them
+ * may be queued while the reader fetches their contents in the background.
+ * With a layout window the reads are held back until that many files are
+ * pending and then submitted in ascending physical order instead.
+ */
+struct pending {
+    struct walk_entry e;
+    struct read_job job;
+    const struct known * known;
+    const struct known * stale;
+    struct link * link;
+    int first;
+    int queued;
+    int deferred;
+    int exact;
+    int hashed;
+    uint64_t where;
+    union hash_state state;
+};
+
+static struct {
+    struct reader * reader;
+    struct pending * ring;
+    size_t window;
+    size_t head;
+    size_t count;
+    size_t bytes;
+    struct pending ** batch;
+    size_t nbatch;
+} pipeline;
+
+static struct {
+    double bytes;
+    size_t files;
+    size_t mapped;
+    uint64_t walk_seek;
+    uint64_t walk_at;
+    uint64_t sched_seek;
+    uint64_t sched_at;
+} layout;
+
+static int
+by_location(const void * a, const void * b)
+{
+    const struct pending * x = *(struct pending * const *)a;
+    const struct pending * y = *(struct pending * const *)b;
+
+    if(x->exact != y->exact) {
+        return y->exact - x->exact;
+    }
+
+    return x->where < y->where ? -1 : x->where > y->where;
+}
+
+/* how far the head travels to reach p, assuming it stopped at *at */
+static uint64_t
+seek_to(const struct pending * p, uint64_t * at)
+{
+    uint64_t from = *at;
+
+    *at = p->where + p->e.size;
+
+    if(0 == from) {
+        return 0;
+    }
+
+    return p->where > from ? p->where - from : from - p->where;
+}
+
+static void
+schedule_batch(void)
+{
+    for(size_t i = 0; i < pipeline.nbatch; i++) {
+        if(pipeline.batch[i]->exact) {
+            layout.walk_seek += seek_to(pipeline.batch[i], &layout.walk_at);
+        }
+    }
+
+    qsort(pipeline.batch, pipeline.nbatch, sizeof(struct pending *), by_location);
+
+    for(size_t i = 0; i < pipeline.nbatch; i++) {
+        struct pending * p = pipeline.batch[i];
+
+        if(p->exact) {
+            layout.sched_seek += seek_to(p, &layout.sched_at);
+            layout.mapped++;
+        }
+
+        p->deferred = 0;
+        reader_submit(pipeline.reader, &p->job);
+    }
+
+    pipeline.nbatch = 0;
+}
+
+/*
+ * With an engine that hashes several buffers side by side, the reads
+ * already submitted behind the head are waited for too and hashed
+ * together with it; each keeps its state until it is retired.
+ */
+static void
+hash_ahead(void)
+{
+    union hash_state states[2 * FNV_64A_LANES];
+    struct pending * batch[2 * FNV_64A_LANES];
+    void * bufs[2 * FNV_64A_LANES];
+    size_t lens[2 * FNV_64A_LANES];
+    int n = 0;
+
+    for(size_t i = 0; i < pipeline.count && n < HASH_LANES; i++) {
+        struct pending * p = &pipeline.ring[(pipeline.head + i) % pipeline.window];
+
+        if(!p->queued || p->deferred || p->hashed) {
+            continue;
+        }
+
+        reader_wait(pipeline.reader, &p->job);
+
+        if(0 != p->job.error || 0 == p->job.len) {
+            continue;
+        }
+
+        hash_engine->init(&states[n]);
+        bufs[n] = p->job.buf;
+        lens[n] = p->job.len;
+        batch[n++] = p;
+    }
+
+    hash_lanes(states, bufs, lens, n);
+
+    for(int i = 0; i < n; i++) {
+        batch[i]->state = states[i];
+        batch[i]->hashed = 1;
+    }
+}
+
+static struct hash_key
+store_job(struct pending * p)
+{
+    struct store s;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(p->deferred) {
+        schedule_batch();
+    }
+
+    if(!p->hashed && hash_engine->lanes > 1) {
+        hash_ahead();
+    }
+
+    reader_wait(pipeline.reader, &p->job);
+    pipeline.bytes -= p->e.size;
+    layout.bytes += p->job.len;
+    layout.files++;
+
+    if(0 != p->job.error) {
+        fprintf(stderr, "Can't open file %s; %s\n", p->e.path,
+                strerror(p->job.error));
+        reader_done(pipeline.reader, &p->job);
+        return (struct hash_key) {{0}};
+    }
+
+    store_begin(&s, &p->e);
+
+    if(p->job.len > 0) {
+        store_chunk(&s, p->job.buf, p->job.len, p->hashed ? &p->state : 0);
+    }
+
+    reader_done(pipeline.reader, &p->job);
+    count_hashing(0, &start, p->e.size);
+    return store_end(&s);
+}
+
+static void
+retire_entry(struct pending * p)
+{
+    const struct walk_entry * const e = &p->e;
+    const char * const fp = e->path;
+    double bytes = 0;
+    struct hash_key hash = {{0}};
+    char name[2 * HASH_MAX + 1];
+
+    switch (e->type) {
+    case WALK_SL:
+        fprintf(stdout, " ??? (link) %s\n", fp);
+        break;
+
+    case WALK_F:
+        bytes = (double)e->size;
+        fprintf(stdout, " ... %s (%0.0f) ", fp, bytes);
+
+        if(0 != p->known) {
+            hash = p->known->hash;
+        } else if(0 != p->link && !p->first && LINK_HASHED == p->link->state) {
+            hash = p->link->hash;
+            record_file(e, &hash, e->size, -1);
+        } else if(tree_leaf > 0 && (size_t)e->size > tree_leaf) {
+            hash = store_tree(e, p->stale);
+        } else {
+            hash = p->queued ? store_job(p) : store_file(e);
+        }
+
+        if(0 != p->link && p->first) {
+            p->link->hash = hash;
+            p->link->state = !hash_key_zero(&hash) ? LINK_HASHED : LINK_FAILED;
+        }
+
+        hash_key_str(&hash, name, sizeof(name));
+        fprintf(stdout, "%s\n", name);
+
+        break;
+
+    case WALK_D:
+        fprintf(stdout, " ... (dir) %s\n", fp);
+        break;
+
+    case WALK_DNR:
         fprintf(stdout, " ... (unknown dir) %s\n",  fp);
         break;
 
-    case FTW_NS:
+    case WALK_OTHER:
+        fprintf(stdout, " ... (special) %s\n", fp);
+        break;
+
+    case WALK_NS:
     default:
-        fprintf(stdout, " ... (unknown file type: %d) %s\n", typeflag, fp);
+        fprintf(stdout, " ... (unknown file type: %d) %s\n", e->type, fp);
         break;
     }
 
+    note_progress(fp);
+}
+
+/* e indexed at once and on its own, as a dedup scan does with what it can't tell apart */
+void
+index_entry(const struct walk_entry * const e)
+{
+    struct pending one = {0};
+    int first = 0;
+
+    one.e = *e;
+    one.link = WALK_F == e->type && e->nlink > 1 ? find_link(e, &first) : 0;
+    one.first = first;
+    retire_entry(&one);
+}
+
+static void
+retire_head(void)
+{
+    struct pending * p = &pipeline.ring[pipeline.head];
+
+    retire_entry(p);
+    free((char *)p->e.path);
+    pipeline.head = (pipeline.head + 1) % pipeline.window;
+    pipeline.count--;
+}
+
+static int
+process_entry(const struct walk_entry * const e, void * arg)
+{
+    struct pending one = {0};
+    const struct known * k = 0;
+    const struct known * stale = 0;
+    struct link * l = 0;
+    int first = 0;
+
+    // entries already retired are all before this one, so stopping here loses nothing
+    if(past_deadline()) {
+        return ETIMEDOUT;
+    }
+
+    if(incremental && WALK_F == e->type) {
+        k = find_known(e, &stale);
+    }
+
+    if(0 == k && WALK_F == e->type && e->nlink > 1) {
+        l = find_link(e, &first);
+    }
+
+    if(0 == pipeline.reader) {
+        one.e = *e;
+        one.known = k;
+        one.stale = stale;
+        one.link = l;
+        one.first = first;
+        retire_entry(&one);
+        return 0;
+    }
+
+    // a later link is only read if its first one turns out unreadable; with
+    // the kernel hashing, nothing needs reading ahead, and a cache-neutral
+    // scan reads every file itself
+    int async = !hashing.kernel && !cache_neutral && 0 == k && (0 == l || first) && WALK_F == e->type &&
+                (size_t)e->size <= READ_MAX_FILE &&
+                (0 == tree_leaf || (size_t)e->size <= tree_leaf);
+
+    while(pipeline.count == pipeline.window ||
+            (async && pipeline.count > 0 &&
+             pipeline.bytes + e->size > READ_BUDGET)) {
+        retire_head();
+    }
+
+    struct pending * p =
+        &pipeline.ring[(pipeline.head + pipeline.count) % pipeline.window];
+
+    memset(p, 0, sizeof(struct pending));
+    p->e = *e;
+
+    p->known = k;
+    p->stale = stale;
+    p->link = l;
+    p->first = first;
+
+    if(0 == (p->e.path = strdup(e->path))) {
+        one.e = *e;
+        one.known = k;
+        one.stale = stale;
+        one.link = l;
+        one.first = first;
+        retire_entry(&one);
+        return 0;
+    }
+
+    pipeline.count++;
+
+    if(async) {
+        p->queued = 1;
+        p->job.path = p->e.path;
+        p->job.size = e->size;
+        p->job.dev = e->dev;
+        pipeline.bytes += e->size;
+
+        if(0 == pipeline.batch) {
+            reader_submit(pipeline.reader, &p->job);
+            return 0;
+        }
+
+        p->where = layout_locate(p->e.path, e->dev, e->ino, &p->exact);
+        p->deferred = 1;
+        pipeline.batch[pipeline.nbatch++] = p;
+
+        if(pipeline.nbatch == (size_t)layout_window) {
+            schedule_batch();
+        }
+    }
+
     return 0;
 }
 
+/* throughput of the whole scan, hashing and storing included, for -p runs to be set side by side */
+static void
+report_layout(const struct timespec * start)
+{
+    struct timespec end;
+    double secs;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+
+    fprintf(stderr, "Read %0.1f MB from %zu files in %0.2f s, %0.1f MB/s over the scan in %s order",
+            layout.bytes / 1e6, layout.files, secs,
+            secs > 0 ? layout.bytes / 1e6 / secs : 0.0,
+            0 != pipeline.batch ? "physical" : "walk");
+
+    // estimated from where FIEMAP puts each file, not measured
+    if(0 != pipeline.batch) {
+        fprintf(stderr, "; FIEMAP seek span over %zu mapped files %0.1f MB in walk order, "
+                "%0.1f MB scheduled", layout.mapped, layout.walk_seek / 1e6,
+                layout.sched_seek / 1e6);
+    }
+
+    fprintf(stderr, "\n");
+}
+
+/*
+ * The kernel hashes files for a hash-only database with -K, if it has
+ * the engine; anything it can't do is hashed in process as usual.
+ */
+static void
+start_kernel(void)
+{
+    memset(&hashing, 0, sizeof(hashing));
+
+    if(!kernel_hash) {
+        return;
+    }
+
+    if(!hash_only) {
+        fprintf(stderr, "Can't hash in the kernel with db %s; it keeps content\n", db_name);
+    } else if(cache_neutral) {
+        fprintf(stderr, "Can't hash in the kernel cache-neutrally; hashing in process\n");
+    } else if(0 == hash_engine->crypto) {
+        fprintf(stderr, "Can't hash %s in the kernel; hashing in process\n", hash_engine->name);
+    } else if(0 != afalg_open(hash_engine->crypto)) {
+        fprintf(stderr, "Can't hash %s in the kernel; %s; hashing in process\n",
+                hash_engine->crypto, strerror(errno));
+    } else {
+        hashing.kernel = 1;
+    }
+}
+
+/* closes the kernel backend and reports how the hashing went */
+static void
+stop_kernel(void)
+{
+    static const char * const where[2] = {"in process", "in the kernel"};
+
+    afalg_close();
+    hashing.kernel = 0;
+
+    for(int i = 0; hash_only && i < 2; i++) {
+        if(hashing.files[i] > 0) {
+            fprintf(stderr, "Hashed %0.1f MB from %zu files %s in %0.2f s (%0.1f MB/s)\n",
+                    hashing.bytes[i] / 1e6, hashing.files[i], where[i], hashing.secs[i],
+                    hashing.secs[i] > 0 ? hashing.bytes[i] / 1e6 / hashing.secs[i] : 0.0);
+        }
+    }
+}
+
 int
 process_directory(const char * const dir)
 {
+    struct timespec start;
     int result;
 
     if (NULL == dir || '\0' == *dir) {
         return errno  = EINVAL;
     }
 
-    result = nftw(dir, process_entry, 15, FTW_PHYS) ;
+    if(dedup_scan) {
+        start_kernel();
+        result = dedup_directory(dir);
+        table_free(&links, free);
+        stop_kernel();
+        cache_report();
+        forget_resolved();
+        drop_statements();
+        return errno = result;
+    }
+
+    if(incremental && 0 != load_known(dir)) {
+        fprintf(stderr, "Can't load previous scan of %s; indexing everything\n", dir);
+    }
+
+    memset(&layout, 0, sizeof(layout));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(read_depth > 0 && !dedup_scan) {
+        // deep enough that other devices keep reading while the head waits on a slow one
+        pipeline.window = 4 * read_depth > 256 ? 4 * read_depth : 256;
+
+        // the ring must outlast a full batch or every batch would be cut short
+        if(layout_window > 0 && pipeline.window < 2 * (size_t)layout_window) {
+            pipeline.window = 2 * (size_t)layout_window;
+        }
+
+        pipeline.ring = calloc(pipeline.window, sizeof(struct pending));
+
+        if(0 != pipeline.ring) {
+            pipeline.reader = reader_new(read_depth);
+        }
+
+        if(0 != pipeline.reader && layout_window > 0) {
+            pipeline.batch = calloc(layout_window, sizeof(struct pending *));
+        }
+    }
+
+    start_kernel();
+    start_progress(dir);
+    result = walk_tree(dir, process_entry, 0) ;
+
+    if (result < 0) {
+        result = errno;
+    }
+
+    while(pipeline.count > 0) {
+        retire_head();
+    }
+
+    if(0 != pipeline.reader && layout_window >= 0) {
+        report_layout(&start);
+    }
+
+    stop_kernel();
+    cache_report();
+
+    reader_free(pipeline.reader);
+    free(pipeline.ring);
+    free(pipeline.batch);
+    pipeline.reader = 0;
+    pipeline.ring = 0;
+    pipeline.batch = 0;
+    pipeline.nbatch = 0;
 
-    if (result >= 0) {
-        errno = result;
+    // a resumed walk never saw what it skipped
+    for(size_t i = 0; prune_missing && 0 == walk_after && 0 == result &&
+            i < known.map.cap; i++) {
+        struct known * k = known.map.slots[i].val;
+
+        if(0 != k && !k->seen) {
+            remove_path(k->path);
+        }
     }
 
-    return errno;
+    end_progress(result);
+    table_free(&known.map, known_release);
+    table_free(&links, free);
+    free(known.root);
+    known.root = 0;
+    forget_resolved();
+    drop_statements();
+    return errno = result;
 }
@@ -1,25 +1,68 @@
 #ifndef _SRC_INDEX_H_
 #define _SRC_INDEX_H_
 
+#include <stdio.h>
 #include <unistd.h>
 
 #include "sqlite/sqlite3.h"
 
+struct hash_key;
+struct walk_entry;
+
 extern sqlite3 * DB;
 
 extern char * db_name;
 extern char * sql_file;
 extern char * root_dir;
+extern int incremental;
+extern int prune_missing;
+extern int resume_scan;
+extern int dedup_scan;
+extern int verify_blobs;
+extern int hash_only;
+extern int kernel_hash;
 
 extern const size_t MAX_PATH;
 extern const size_t MAX_LEN;
+extern const size_t STORE_NODES;
 
 extern const char * const INIT_DB;
 extern const char * const ADD_FILE;
+extern const char * const GET_FILES;
+extern const char * const DEL_FILES;
 extern const char * const ADD_BLOB;
+extern const char * const GET_BLOB;
+extern const char * const SET_BLOB_STRONG;
+extern const char * const FIND_BLOBS;
+extern const char * const DEL_BLOB;
 extern const char * const ADD_FILE_BLOB;
+extern const char * const GET_UNFILED_BLOBS;
+extern const char * const SET_UNFILED_BLOBS;
+extern const char * const DEL_UNFILED_BLOBS;
 extern const char * const ADD_FILE_TAG;
+extern const char * const ADD_FILE_LEAF;
+extern const char * const GET_FILE_LEAVES;
+extern const char * const GET_LEAF_BLOBS;
+extern const char * const GET_META;
+extern const char * const SET_META;
+extern const char * const DEL_META;
 
+int migrate_db(void);
+int add_blob(const struct hash_key * const, size_t, const char * const);
+int same_blob(const struct hash_key * const, size_t, const unsigned char * const);
+void drop_row(sqlite3_int64);
+FILE * open_regular(const char * const);
+int record_file(const struct walk_entry * const, const struct hash_key * const, off_t,
+                sqlite3_int64);
+void index_entry(const struct walk_entry * const);
+int remove_path(const char * const);
+char * get_meta(const char * const);
+int set_meta(const char * const, const char * const);
+int select_hash(const char * const);
+int select_keys(const char * const);
+int select_chunking(const char * const);
+int select_tree(const char * const);
+int select_content(void);
 int process_directory(const char * const);
 int db_result_handler(void *, int, char **, char **);
 
@@ -0,0 +1,76 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#define LAYOUT_FIEMAP
+#endif
+
+#include "layout.h"
+
+/* files held back per sorted batch; 0 reads in walk order but still reports, -1 neither */
+int layout_window = -1;
+
+/*
+ * Where a file's data starts on disk, for reading a window of files in
+ * ascending physical order.  FIEMAP gives the first extent's physical
+ * byte offset and sets *exact; files it cannot map (unsupported by the
+ * filesystem, still delayed allocation, empty) fall back to the inode
+ * number, which most filesystems allocate near the data anyway.
+ */
+uint64_t
+layout_locate(const char * const path, dev_t dev, ino_t ino, int * exact)
+{
+    *exact = 0;
+#if defined(LAYOUT_FIEMAP)
+    static const uint32_t unmapped =
+        FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE;
+    static dev_t unsupported = 0;
+    static int tried = 0;
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } q;
+    int fd;
+
+    if(tried && unsupported == dev) {
+        return ino;
+    }
+
+    if(0 > (fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC))) {
+        return ino;
+    }
+
+    memset(&q, 0, sizeof(q));
+    q.map.fm_length = FIEMAP_MAX_OFFSET;
+    q.map.fm_extent_count = 1;
+
+    if(0 != ioctl(fd, FS_IOC_FIEMAP, &q.map)) {
+        // a filesystem without FIEMAP will not grow it mid-walk
+        if(ENOTTY == errno || EOPNOTSUPP == errno) {
+            unsupported = dev;
+            tried = 1;
+        }
+
+        close(fd);
+        return ino;
+    }
+
+    close(fd);
+
+    if(1 == q.map.fm_mapped_extents && !(q.extent.fe_flags & unmapped)) {
+        *exact = 1;
+        return q.extent.fe_physical;
+    }
+
+#endif
+    return ino;
+}
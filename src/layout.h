@@ -0,0 +1,11 @@
+#ifndef _SRC_LAYOUT_H_
+#define _SRC_LAYOUT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+extern int layout_window;
+
+uint64_t layout_locate(const char * const, dev_t, ino_t, int *);
+
+#endif /*_SRC_LAYOUT_H_*/
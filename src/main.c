@@ -2,6 +2,7 @@
 
 #include <errno.h>
 #include <ftw.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -9,22 +10,158 @@
 #include <unistd.h>
 
 #include "main.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "chunk.h"
+#include "filter.h"
+#include "hash.h"
 #include "index.h"
+#include "layout.h"
+#include "pool.h"
+#include "reader.h"
+#include "tree.h"
+#include "walk.h"
+#include "watch.h"
 #include "fnv/fnv.h"
 #include "sqlite/sqlite3.h"
 
 
+enum {
+    OPT_RESUME = 0x100,
+    OPT_DEADLINE,
+    OPT_CACHE_NEUTRAL,
+};
+
+static const struct option LONG_OPTS[] = {
+    {"resume", no_argument, 0, OPT_RESUME},
+    {"deadline", required_argument, 0, OPT_DEADLINE},
+    {"cache-neutral", no_argument, 0, OPT_CACHE_NEUTRAL},
+    {0, 0, 0, 0},
+};
+
 int
 main(int argc, char ** argv)
 {
     int ch;
+    int watch = 0;
+    int timed = 0;
+    const char * engine = 0;
+    const char * chunking = 0;
+    const char * leaves = 0;
+    const char * keys = 0;
+    struct filter * filter = 0;
+    struct walk_filter hooks;
 
-    while((ch = getopt(argc, argv, "d:q:r:")) != -1) {
+    while((ch = getopt_long(argc, argv, "B:C:D:d:e:f:H:I:ij:Knp:Q:q:r:T:uVw", LONG_OPTS, 0)) != -1) {
         switch(ch) {
+        case 'B':
+            if(0 != pool_tune(optarg)) {
+                fprintf(stderr, "Invalid buffer budget %s\n", optarg);
+                return(1);
+            }
+
+            break;
+
+        case 'C':
+            if(0 != chunk_tune(optarg)) {
+                fprintf(stderr, "Invalid chunking %s\n", optarg);
+                return(1);
+            }
+
+            chunking = optarg;
+            break;
+
+        case 'D':
+            if(0 != reader_tune(optarg)) {
+                fprintf(stderr, "Invalid device depth %s\n", optarg);
+                return(1);
+            }
+
+            break;
+
         case 'd':
             db_name = optarg;
             break;
 
+        case 'e':
+        case 'f':
+            if(0 == filter && 0 == (filter = filter_new())) {
+                fprintf(stderr, "Can't allocate filter; %s\n", strerror(errno));
+                return(1);
+            }
+
+            if('f' == ch && 0 != filter_file(filter, optarg)) {
+                return(1);
+            }
+
+            if('e' == ch && 0 != filter_rule(filter, optarg)) {
+                fprintf(stderr, "Invalid filter rule %s\n", optarg);
+                return(1);
+            }
+
+            break;
+
+        case 'H':
+            if(0 == hash_find(optarg)) {
+                fprintf(stderr, "Invalid hash engine %s\n", optarg);
+                return(1);
+            }
+
+            engine = optarg;
+            break;
+
+        case 'I':
+            if(0 != strcmp(optarg, "64") && 0 != strcmp(optarg, "128") &&
+                    0 != strcmp(optarg, "256")) {
+                fprintf(stderr, "Invalid key width %s\n", optarg);
+                return(1);
+            }
+
+            keys = optarg;
+            break;
+
+        case 'i':
+            incremental = 1;
+            break;
+
+        case 'j':
+            walk_jobs = atoi(optarg);
+
+            if(walk_jobs < 0) {
+                fprintf(stderr, "Invalid job count %s\n", optarg);
+                return(1);
+            }
+
+            break;
+
+        case 'K':
+            kernel_hash = 1;
+            break;
+
+        case 'n':
+            hash_only = 1;
+            break;
+
+        case 'p':
+            layout_window = atoi(optarg);
+
+            if(layout_window < 0) {
+                fprintf(stderr, "Invalid layout window %s\n", optarg);
+                return(1);
+            }
+
+            break;
+
+        case 'Q':
+            read_depth = atoi(optarg);
+
+            if(read_depth < 0) {
+                fprintf(stderr, "Invalid queue depth %s\n", optarg);
+                return(1);
+            }
+
+            break;
+
         case 'q':
             sql_file = optarg;
             break;
@@ -33,6 +170,44 @@ main(int argc, char ** argv)
             root_dir = optarg;
             break;
 
+        case 'T':
+            if(0 != tree_tune(optarg)) {
+                fprintf(stderr, "Invalid tree leaf size %s\n", optarg);
+                return(1);
+            }
+
+            leaves = optarg;
+            break;
+
+        case 'u':
+            dedup_scan = 1;
+            break;
+
+        case 'V':
+            verify_blobs = 1;
+            break;
+
+        case 'w':
+            watch = 1;
+            break;
+
+        case OPT_RESUME:
+            resume_scan = 1;
+            break;
+
+        case OPT_DEADLINE:
+            if(0 != set_deadline(optarg)) {
+                fprintf(stderr, "Invalid deadline %s\n", optarg);
+                return(1);
+            }
+
+            timed = 1;
+            break;
+
+        case OPT_CACHE_NEUTRAL:
+            cache_neutral = 1;
+            break;
+
         case '?':
             return(1);
 
@@ -45,14 +220,27 @@ main(int argc, char ** argv)
     char * zErrMsg = 0;
     int rc = 0;
 
+    if(0 != filter) {
+        filter_hooks(filter, &hooks);
+        walk_filter = &hooks;
+    }
+
     if (
         0 == db_name ||
         (0 == sql_file && 0 == root_dir) ||
-        (0 != sql_file && 0 != root_dir)) {
+        (0 != sql_file && 0 != root_dir) ||
+        (watch && timed) ||
+        (dedup_scan && (watch || timed || resume_scan)) ||
+        (hash_only && 0 != chunking)) {
         fprintf(
             stderr,
-            "Usage: %s -d <db> -r <root_dir>\n"
-            "    or %s -d <db> -q <query_file>\n",
+            "Usage: %s -d <db> [-i] [-w|-u] [-j <jobs>] [-Q <depth>] [-D <maj:min|hdd>=<depth>]\n"
+            "           [-p <window>] [-B <budget>[:huge]] [-e <rule>] [-f <filter_file>]\n"
+            "           [-H fnv64|ixh128|blake2b] [-I 64|128|256] [-C <avg>|<min>:<avg>:<max>|fixed:<size>]\n"
+            "           [-V] [-T <leaf>] [-n [-K]] [--resume] [--deadline <secs|Nm|Nh>] [--cache-neutral]\n"
+            "           -r <root_dir>\n"
+            "    or %s -d <db> -q <query_file>\n"
+            "  -p <window> reports MB/s over the scan; a -p 0 run, read in walk order, is its baseline\n",
             argv[0],
             argv[0]);
         return(1);
@@ -68,6 +256,18 @@ main(int argc, char ** argv)
 
     rc = sqlite3_exec(DB, INIT_DB, db_result_handler, 0, &zErrMsg);
 
+    if(!rc) {
+        rc = migrate_db();
+        zErrMsg = rc ? (char *)sqlite3_errmsg(DB) : 0;
+    }
+
+    if(!rc && (SQLITE_OK != select_hash(engine) || SQLITE_OK != select_keys(keys) ||
+                SQLITE_OK != select_content() || SQLITE_OK != select_chunking(chunking) ||
+                SQLITE_OK != select_tree(leaves))) {
+        sqlite3_close(DB);
+        return(1);
+    }
+
     if(rc) {
         fprintf(stderr, "Can't initialize db %s; %s\n", db_name, zErrMsg);
         sqlite3_close(DB);
@@ -75,7 +275,13 @@ main(int argc, char ** argv)
     }
 
     if(0 != root_dir) {
-        rc = process_directory(root_dir);
+        rc = watch ? watch_directory(root_dir) : process_directory(root_dir);
+
+        if(ETIMEDOUT == rc) {
+            fprintf(stderr, "Deadline reached; continue %s with --resume\n", root_dir);
+            sqlite3_close(DB);
+            return(rc);
+        }
 
         if(rc) {
             fprintf(stderr, "Can't walk dir %s; %s\n", root_dir, strerror(errno));
@@ -123,6 +329,7 @@ main(int argc, char ** argv)
         }
     }
 
+    filter_free(filter);
     sqlite3_close(DB);
     return(0);
 }
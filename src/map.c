@@ -0,0 +1,144 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "map.h"
+
+const size_t MAP_MIN = 1 << 20;
+const size_t MAP_AHEAD = 8 << 20;
+
+/*
+ * Large files are hashed and stored straight from the page cache instead
+ * of being copied into a buffer first.  The catch is a file that shrinks
+ * while it is mapped: touching a page past its new end raises SIGBUS,
+ * possibly deep inside SQLite, where nothing can be unwound.  So a fault
+ * in the calling thread's live mapping is not unwound at all: the page is
+ * replaced with one of zeros and the access goes ahead, and map_close()
+ * then tells the caller that what it read cannot be trusted.  A SIGBUS
+ * anywhere else is as fatal as it always was.
+ *
+ * Pages are let go of as soon as the caller is past them, so what is
+ * mapped at any time is what has not been used yet.
+ */
+static __thread struct map * map_live;
+static __thread volatile sig_atomic_t map_torn;
+
+static pthread_once_t map_once = PTHREAD_ONCE_INIT;
+static uintptr_t map_page;
+static int map_ready;
+
+static void
+map_fault(int sig, siginfo_t * info, void * ctx)
+{
+    const struct map * m = map_live;
+    uintptr_t at = (uintptr_t)info->si_addr;
+    int err = errno;
+
+    (void)ctx;
+
+    if(0 != m && at >= (uintptr_t)m->base + m->done && at < (uintptr_t)m->base + m->len &&
+            MAP_FAILED != mmap((void *)(at & ~(map_page - 1)), map_page, PROT_READ,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)) {
+        map_torn = 1;
+        errno = err;
+        return;
+    }
+
+    // not ours; the access faults again, this time for good
+    signal(sig, SIG_DFL);
+    errno = err;
+}
+
+static void
+map_install(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = map_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    map_page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    map_ready = 0 == sigaction(SIGBUS, &sa, 0);
+}
+
+/*
+ * Maps len bytes of fd from off, which is a multiple of the page size, to
+ * be read once from start to end; the first MAP_AHEAD of them are asked
+ * for right away.  Only one mapping per thread is open at a time.
+ */
+int
+map_open(struct map * m, int fd, off_t off, size_t len)
+{
+    void * p;
+
+    pthread_once(&map_once, map_install);
+
+    if(!map_ready || 0 == len || 0 != map_live) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(MAP_FAILED == (p = mmap(0, len, PROT_READ, MAP_SHARED, fd, off))) {
+        return -1;
+    }
+
+    m->base = p;
+    m->len = len;
+    m->done = 0;
+    posix_madvise(p, len, POSIX_MADV_SEQUENTIAL);
+    posix_madvise(p, len < MAP_AHEAD ? len : MAP_AHEAD, POSIX_MADV_WILLNEED);
+    map_torn = 0;
+    map_live = m;
+    return 0;
+}
+
+/* starts reading what the next mapping of fd, at off, will begin with */
+void
+map_ahead(int fd, off_t off)
+{
+    posix_fadvise(fd, off, MAP_AHEAD, POSIX_FADV_WILLNEED);
+}
+
+/* unmaps the whole pages before upto and asks for the MAP_AHEAD after them */
+void
+map_advance(struct map * m, const char * upto)
+{
+    size_t at = (size_t)(upto - m->base) & ~(size_t)(map_page - 1);
+
+    if(at > m->done) {
+        munmap(m->base + m->done, at - m->done);
+        m->done = at;
+    }
+
+    if(m->done < m->len) {
+        posix_madvise(m->base + m->done,
+                      m->len - m->done < MAP_AHEAD ? m->len - m->done : MAP_AHEAD,
+                      POSIX_MADV_WILLNEED);
+    }
+}
+
+/* 1 if the file shrank under the mapping and zeros were read in its place */
+int
+map_close(struct map * m)
+{
+    int torn = map_torn;
+
+    if(m->done < m->len) {
+        munmap(m->base + m->done, m->len - m->done);
+    }
+
+    m->base = 0;
+    m->len = 0;
+    map_live = 0;
+    map_torn = 0;
+    return torn;
+}
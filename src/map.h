@@ -0,0 +1,21 @@
+#ifndef _SRC_MAP_H_
+#define _SRC_MAP_H_
+
+#include <sys/types.h>
+
+extern const size_t MAP_MIN;
+extern const size_t MAP_AHEAD;
+
+/* a read-only mapping of part of a file, of which the first done bytes are let go */
+struct map {
+    char * base;
+    size_t len;
+    size_t done;
+};
+
+int map_open(struct map *, int, off_t, size_t);
+void map_ahead(int, off_t);
+void map_advance(struct map *, const char *);
+int map_close(struct map *);
+
+#endif /*_SRC_MAP_H_*/
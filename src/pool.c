@@ -0,0 +1,285 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/mempolicy.h>)
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#define POOL_NUMA
+#endif
+#endif
+
+#include "chunk.h"
+#include "pool.h"
+
+#define POOL_CLASSES 15
+#define POOL_NODES 8
+
+size_t pool_budget = 256 << 20;
+int pool_huge = 0;
+
+static const size_t POOL_MIN = 64 << 10;
+static const size_t POOL_HUGE = 2 << 20;
+
+/*
+ * The read buffers of a scan, from a whole file's worth for the reader
+ * to a leaf or a 1 GiB piece of a large one, are borrowed from here and
+ * given back once hashed and stored, so that a scan that has warmed up
+ * maps no more memory.  Buffers come in powers of two from POOL_MIN up
+ * and are kept per size and per NUMA node, each its own page aligned
+ * mapping, fit for O_DIRECT, with its bookkeeping on the page in front.
+ *
+ * No more than pool_budget bytes are kept mapped: past it, idle buffers
+ * are let go of to make room, and one borrowed anyway is unmapped when
+ * given back.  A new buffer is placed on the borrowing thread's node, and
+ * with pool_huge backed by transparent huge pages where it is big enough.
+ */
+struct pool_buf {
+    struct pool_buf * next;
+    char * buf;
+    size_t cap;
+    int cls;
+    int node;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct pool_buf * idle[POOL_NODES][POOL_CLASSES];
+    size_t held;
+} pool = {PTHREAD_MUTEX_INITIALIZER, {{0}}, 0};
+
+static size_t
+pool_page(void)
+{
+    static size_t page = 0;
+
+    if(0 == page) {
+        long n = sysconf(_SC_PAGESIZE);
+        page = n > 0 ? (size_t)n : 4096;
+    }
+
+    return page;
+}
+
+/*
+ * "<budget>" or "<budget>:huge", with k, m or g suffixes, huge for
+ * buffers backed by transparent huge pages.
+ */
+int
+pool_tune(const char * const spec)
+{
+    char * end;
+    size_t budget;
+
+    if(0 != parse_bytes(spec, &end, &budget)) {
+        return -1;
+    }
+
+    if(':' == *end && 0 == strcmp(end + 1, "huge")) {
+        pool_huge = 1;
+    } else if('\0' != *end) {
+        return -1;
+    }
+
+    pool_budget = budget;
+    return 0;
+}
+
+static int
+pool_node(void)
+{
+#if defined(POOL_NUMA) && defined(SYS_getcpu)
+    unsigned cpu;
+    unsigned node;
+
+    if(0 == syscall(SYS_getcpu, &cpu, &node, 0)) {
+        return (int)node;
+    }
+#endif
+
+    return 0;
+}
+
+/* the pages are preferably node's, whichever thread touches them first */
+static void
+pool_bind(void * p, size_t len, int node)
+{
+#if defined(POOL_NUMA) && defined(SYS_mbind)
+    unsigned long mask[16] = {0};
+    const int bits = 8 * sizeof(unsigned long);
+
+    if(node < 16 * bits) {
+        mask[node / bits] = 1UL << (node % bits);
+        syscall(SYS_mbind, p, len, MPOL_PREFERRED, mask, 16 * bits, 0);
+    }
+#else
+    (void)p;
+    (void)len;
+    (void)node;
+#endif
+}
+
+static struct pool_buf *
+pool_map(int cls, int node)
+{
+    const size_t page = pool_page();
+    const size_t cap = POOL_MIN << cls;
+    const size_t align = pool_huge && cap >= POOL_HUGE ? POOL_HUGE : page;
+    const size_t len = page + cap + (align - page);
+    struct pool_buf * b;
+    char * map;
+    char * buf;
+
+    if(MAP_FAILED == (map = mmap(0, len, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))) {
+        return 0;
+    }
+
+    // what it took to align the buffer goes back on either side
+    buf = (char *)(((uintptr_t)map + page + align - 1) & ~(uintptr_t)(align - 1));
+
+    if(buf - page > map) {
+        munmap(map, (size_t)(buf - page - map));
+    }
+
+    if(map + len > buf + cap) {
+        munmap(buf + cap, (size_t)(map + len - (buf + cap)));
+    }
+
+#if defined(MADV_HUGEPAGE)
+
+    if(align > page) {
+        madvise(buf, cap, MADV_HUGEPAGE);
+    }
+
+#endif
+    pool_bind(buf - page, page + cap, node);
+
+    b = (struct pool_buf *)(buf - page);
+    b->next = 0;
+    b->buf = buf;
+    b->cap = cap;
+    b->cls = cls;
+    b->node = node;
+    return b;
+}
+
+static void
+pool_unmap(struct pool_buf * b)
+{
+    munmap(b->buf - pool_page(), pool_page() + b->cap);
+}
+
+static struct pool_buf *
+pool_take(int node, int cls)
+{
+    struct pool_buf * b = pool.idle[node][cls];
+
+    if(0 != b) {
+        pool.idle[node][cls] = b->next;
+    }
+
+    return b;
+}
+
+/* lets go of idle buffers, largest first, until need more bytes fit the budget */
+static void
+pool_shed(size_t need)
+{
+    for(int cls = POOL_CLASSES - 1; cls >= 0; cls--) {
+        for(int node = 0; node < POOL_NODES; node++) {
+            struct pool_buf * b;
+
+            while(pool.held + need > pool_budget && 0 != (b = pool_take(node, cls))) {
+                pool.held -= b->cap;
+                pool_unmap(b);
+            }
+        }
+    }
+}
+
+/*
+ * A buffer of at least len bytes, aligned to a page or, with pool_huge,
+ * a huge page; its size goes in cap if wanted.  0 with errno if none.
+ */
+void *
+pool_get(size_t len, size_t * cap)
+{
+    const int node = pool_node();
+    struct pool_buf * b;
+    int cls = 0;
+
+    while(cls < POOL_CLASSES && (POOL_MIN << cls) < len) {
+        cls++;
+    }
+
+    if(POOL_CLASSES == cls) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+
+    // rather another node's buffer than one past the budget
+    if(0 == (b = pool_take(node % POOL_NODES, cls)) &&
+            pool.held + (POOL_MIN << cls) > pool_budget) {
+        for(int n = 0; 0 == b && n < POOL_NODES; n++) {
+            b = pool_take(n, cls);
+        }
+
+        if(0 == b) {
+            pool_shed(POOL_MIN << cls);
+        }
+    }
+
+    if(0 == b) {
+        pool.held += POOL_MIN << cls;
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+
+    if(0 == b && 0 == (b = pool_map(cls, node))) {
+        pthread_mutex_lock(&pool.lock);
+        pool.held -= POOL_MIN << cls;
+        pthread_mutex_unlock(&pool.lock);
+        return 0;
+    }
+
+    if(0 != cap) {
+        *cap = b->cap;
+    }
+
+    return b->buf;
+}
+
+/* gives back a buffer from pool_get(); 0 is ignored */
+void
+pool_put(void * buf)
+{
+    struct pool_buf * b;
+
+    if(0 == buf) {
+        return;
+    }
+
+    b = (struct pool_buf *)((char *)buf - pool_page());
+    pthread_mutex_lock(&pool.lock);
+
+    if(pool.held > pool_budget) {
+        pool.held -= b->cap;
+        pthread_mutex_unlock(&pool.lock);
+        pool_unmap(b);
+        return;
+    }
+
+    b->next = pool.idle[b->node % POOL_NODES][b->cls];
+    pool.idle[b->node % POOL_NODES][b->cls] = b;
+    pthread_mutex_unlock(&pool.lock);
+}
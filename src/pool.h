@@ -0,0 +1,13 @@
+#ifndef _SRC_POOL_H_
+#define _SRC_POOL_H_
+
+#include <sys/types.h>
+
+extern size_t pool_budget;
+extern int pool_huge;
+
+int pool_tune(const char * const);
+void * pool_get(size_t, size_t *);
+void pool_put(void *);
+
+#endif /*_SRC_POOL_H_*/
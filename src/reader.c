@@ -0,0 +1,891 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define READ_URING
+#endif
+#endif
+
+#include "pool.h"
+#include "reader.h"
+
+int read_depth = 16;
+int read_depth_hdd = 2;
+
+const size_t READ_MAX_FILE = 16 << 20;
+const size_t READ_BUDGET = 256 << 20;
+
+static const int READ_THREADS = 64;
+static const int READ_RING = 256;
+
+/*
+ * Reads whole files into buffers borrowed from the pool.  Jobs are queued per device
+ * and each device has its own limit on files in flight, so a slow disk
+ * only ever holds up its own queue: rotational disks default to a short
+ * read_depth_hdd, everything else to read_depth, and -D overrides either
+ * for a given device.  On Linux the opens and reads are queued on an
+ * io_uring driven by the caller's thread; elsewhere, or when the kernel
+ * refuses the ring or it fails later, a pool of threads does plain
+ * blocking reads instead.
+ * Either way the caller submits jobs and then waits for them in any order.
+ */
+
+enum {
+    RJ_QUEUED,
+    RJ_OPEN,
+    RJ_READ,
+    RJ_DONE,
+};
+
+struct read_queue {
+    dev_t dev;
+    int depth;
+    int inflight;
+    struct read_job * backlog;
+    struct read_job ** tail;
+};
+
+struct read_tune {
+    dev_t dev;
+    int depth;
+};
+
+static struct read_tune * tunes = 0;
+static int ntunes = 0;
+
+#if defined(READ_URING)
+struct uring {
+    int fd;
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+    void * sq_ptr;
+    void * cq_ptr;
+    size_t sq_sz;
+    size_t cq_sz;
+    size_t sqe_sz;
+    unsigned pending;
+    int can_open;
+};
+#endif
+
+struct reader {
+    int depth;
+    int cap;
+    int inflight;
+    int stop;
+    int uring;
+    struct read_queue ** queues;
+    int nqueues;
+    int next;
+    int wanted;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t * threads;
+    int nthreads;
+#if defined(READ_URING)
+    struct uring ring;
+    struct read_job * active;
+#endif
+};
+
+/*
+ * Files are opened without blocking so that a fifo or device swapped in
+ * behind the walk cannot hang the open; once fstat has shown a regular
+ * file the flag is dropped again, or its reads could come back EAGAIN.
+ */
+static int
+check_regular(int fd)
+{
+    struct stat st;
+    int flags;
+
+    if(0 != fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((flags = fcntl(fd, F_GETFL)) < 0 ||
+            0 != fcntl(fd, F_SETFL, flags & ~O_NONBLOCK)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+open_regular(const char * const path)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+
+    if(fd < 0) {
+        return -1;
+    }
+
+    if(0 != check_regular(fd)) {
+        int err = errno;
+
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+get_buffer(struct read_job * j)
+{
+    if(0 == (j->buf = pool_get(j->size > 0 ? (size_t)j->size : 1, &j->cap))) {
+        j->cap = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+read_blocking(struct read_job * j)
+{
+    ssize_t n = 0;
+
+    if((j->fd = open_regular(j->path)) < 0) {
+        j->error = errno;
+        return;
+    }
+
+    while(j->len < (size_t)j->size) {
+        n = read(j->fd, j->buf + j->len, j->size - j->len);
+
+        if(n < 0 && EINTR == errno) {
+            continue;
+        }
+
+        if(n <= 0) {
+            break;
+        }
+
+        j->len += n;
+    }
+
+    if(n < 0) {
+        j->error = errno;
+    }
+
+    close(j->fd);
+    j->fd = -1;
+}
+
+/* takes the oldest job of the next device below its depth, round robin */
+static struct read_job *
+next_job(struct reader * r)
+{
+    if(r->inflight >= r->cap) {
+        return 0;
+    }
+
+    for(int i = 0; i < r->nqueues; i++) {
+        struct read_queue * q = r->queues[(r->next + i) % r->nqueues];
+        struct read_job * j = q->backlog;
+
+        if(0 == j || q->inflight >= q->depth) {
+            continue;
+        }
+
+        if(0 == (q->backlog = j->next)) {
+            q->tail = &q->backlog;
+        }
+
+        q->inflight++;
+        r->inflight++;
+        r->next = (r->next + i + 1) % r->nqueues;
+        return j;
+    }
+
+    return 0;
+}
+
+/* called and returns with the lock held */
+static void
+run_job(struct reader * r, struct read_job * j)
+{
+    pthread_mutex_unlock(&r->lock);
+    read_blocking(j);
+    pthread_mutex_lock(&r->lock);
+    j->queue->inflight--;
+    r->inflight--;
+    j->state = RJ_DONE;
+    pthread_cond_broadcast(&r->done);
+    pthread_cond_broadcast(&r->work);
+}
+
+static void *
+read_worker(void * arg)
+{
+    struct reader * r = arg;
+
+    pthread_mutex_lock(&r->lock);
+
+    for(;;) {
+        struct read_job * j = 0;
+
+        while(!r->stop && 0 == (j = next_job(r))) {
+            pthread_cond_wait(&r->work, &r->lock);
+        }
+
+        if(0 == j) {
+            break;
+        }
+
+        run_job(r, j);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+#if defined(READ_URING)
+
+static int
+uring_setup(struct uring * u, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+
+    if(u->fd < 0) {
+        return -1;
+    }
+
+    u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqe_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->sq_sz = u->cq_sz = u->sq_sz > u->cq_sz ? u->sq_sz : u->cq_sz;
+    }
+
+    u->sq_ptr = mmap(0, u->sq_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ptr = u->sq_ptr;
+
+    if(MAP_FAILED != u->sq_ptr && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        u->cq_ptr = mmap(0, u->cq_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    }
+
+    u->sqes = mmap(0, u->sqe_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+    if(MAP_FAILED == u->sq_ptr || MAP_FAILED == u->cq_ptr || MAP_FAILED == u->sqes) {
+        close(u->fd);
+        return -1;
+    }
+
+    char * sq = u->sq_ptr;
+    char * cq = u->cq_ptr;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->pending = 0;
+
+    /* READ and OPENAT both arrived in 5.6; without READ the ring is useless */
+    struct io_uring_probe * probe = calloc(1, sizeof(struct io_uring_probe) +
+                                           256 * sizeof(struct io_uring_probe_op));
+
+    if(0 != probe && 0 == syscall(__NR_io_uring_register, u->fd,
+                                  IORING_REGISTER_PROBE, probe, 256)) {
+        int read_ok = probe->last_op >= IORING_OP_READ &&
+                      (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+        u->can_open = probe->last_op >= IORING_OP_OPENAT &&
+                      (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED);
+        free(probe);
+
+        if(read_ok) {
+            return 0;
+        }
+    } else {
+        free(probe);
+    }
+
+    munmap(u->sqes, u->sqe_sz);
+
+    if(u->cq_ptr != u->sq_ptr) {
+        munmap(u->cq_ptr, u->cq_sz);
+    }
+
+    munmap(u->sq_ptr, u->sq_sz);
+    close(u->fd);
+    return -1;
+}
+
+static void
+uring_free(struct uring * u)
+{
+    munmap(u->sqes, u->sqe_sz);
+
+    if(u->cq_ptr != u->sq_ptr) {
+        munmap(u->cq_ptr, u->cq_sz);
+    }
+
+    munmap(u->sq_ptr, u->sq_sz);
+    close(u->fd);
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring * u, struct read_job * j)
+{
+    unsigned tail = *u->sq_tail;
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe * sqe = &u->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (unsigned long long)(uintptr_t)j;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->pending++;
+    return sqe;
+}
+
+static void
+uring_read(struct uring * u, struct read_job * j)
+{
+    struct io_uring_sqe * sqe = uring_sqe(u, j);
+
+    j->state = RJ_READ;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = j->fd;
+    sqe->addr = (unsigned long long)(uintptr_t)(j->buf + j->len);
+    sqe->len = j->size - j->len;
+    sqe->off = j->len;
+}
+
+static void finish_job(struct reader *, struct read_job *);
+
+static void
+start_job(struct reader * r, struct read_job * j)
+{
+    struct uring * u = &r->ring;
+
+    j->next = r->active;
+    r->active = j;
+
+    if(u->can_open) {
+        struct io_uring_sqe * sqe = uring_sqe(u, j);
+
+        j->state = RJ_OPEN;
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long long)(uintptr_t)j->path;
+        sqe->open_flags = O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC;
+        return;
+    }
+
+    if((j->fd = open_regular(j->path)) < 0) {
+        j->error = errno;
+        finish_job(r, j);
+        return;
+    }
+
+    if(0 == j->size) {
+        finish_job(r, j);
+        return;
+    }
+
+    uring_read(u, j);
+}
+
+static void
+finish_job(struct reader * r, struct read_job * j)
+{
+    struct read_job ** at = &r->active;
+
+    while(*at != j) {
+        at = &(*at)->next;
+    }
+
+    *at = j->next;
+
+    if(j->fd >= 0) {
+        close(j->fd);
+        j->fd = -1;
+    }
+
+    j->state = RJ_DONE;
+    j->queue->inflight--;
+    r->inflight--;
+
+    while(0 != (j = next_job(r))) {
+        start_job(r, j);
+    }
+}
+
+static void
+complete(struct reader * r, struct read_job * j, int res)
+{
+    switch(j->state) {
+    case RJ_OPEN:
+        if(res < 0) {
+            j->error = -res;
+            finish_job(r, j);
+            return;
+        }
+
+        j->fd = res;
+
+        /* the open did not follow links or block; refuse what slipped in */
+        if(0 != check_regular(j->fd)) {
+            j->error = errno;
+            finish_job(r, j);
+            return;
+        }
+
+        if(0 == j->size) {
+            finish_job(r, j);
+            return;
+        }
+
+        uring_read(&r->ring, j);
+        return;
+
+    case RJ_READ:
+        if(-EINTR == res || -EAGAIN == res) {
+            uring_read(&r->ring, j);
+            return;
+        }
+
+        if(res < 0) {
+            j->error = -res;
+        } else {
+            j->len += res;
+        }
+
+        if(res > 0 && j->len < (size_t)j->size) {
+            uring_read(&r->ring, j);
+            return;
+        }
+
+        finish_job(r, j);
+        return;
+    }
+}
+
+/* -1 with errno if the ring itself fails; the jobs on it are then left as they are */
+static int
+uring_wait(struct reader * r, struct read_job * j)
+{
+    struct uring * u = &r->ring;
+
+    while(RJ_DONE != j->state) {
+        int rc = syscall(__NR_io_uring_enter, u->fd, u->pending, 1,
+                         IORING_ENTER_GETEVENTS, 0, 0);
+
+        if(rc < 0 && EINTR != errno && EAGAIN != errno && EBUSY != errno) {
+            return -1;
+        }
+
+        if(rc > 0) {
+            u->pending -= rc;
+        }
+
+        unsigned head = *u->cq_head;
+
+        while(head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe * cqe = &u->cqes[head & *u->cq_mask];
+            struct read_job * done = (struct read_job *)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+
+            __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+            complete(r, done, res);
+            head = *u->cq_head;
+        }
+    }
+
+    return 0;
+}
+
+#endif /* READ_URING */
+
+/* parses maj:min=depth for one device, or hdd=depth for all rotational ones */
+int
+reader_tune(const char * const spec)
+{
+    unsigned int maj = 0;
+    unsigned int min = 0;
+    int depth = 0;
+    int used = 0;
+    struct read_tune * t;
+
+    if(1 == sscanf(spec, "hdd=%d%n", &depth, &used) && '\0' == spec[used] && depth > 0) {
+        read_depth_hdd = depth;
+        return 0;
+    }
+
+    if(3 != sscanf(spec, "%u:%u=%d%n", &maj, &min, &depth, &used) || '\0' != spec[used] ||
+            depth <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(0 == (t = realloc(tunes, (ntunes + 1) * sizeof(struct read_tune)))) {
+        return -1;
+    }
+
+    tunes = t;
+    tunes[ntunes].dev = makedev(maj, min);
+    tunes[ntunes].depth = depth;
+    ntunes++;
+    return 0;
+}
+
+/* a partition has no queue of its own, so its disk's is looked up instead */
+static int
+rotational(dev_t dev)
+{
+#if defined(__linux__)
+    static const char * const paths[] = {
+        "/sys/dev/block/%u:%u/queue/rotational",
+        "/sys/dev/block/%u:%u/../queue/rotational",
+    };
+    char path[64];
+
+    for(size_t i = 0; 0 != major(dev) && i < sizeof(paths) / sizeof(paths[0]); i++) {
+        FILE * fd;
+        int rot = 0;
+
+        snprintf(path, sizeof(path), paths[i], major(dev), minor(dev));
+
+        if(0 == (fd = fopen(path, "r"))) {
+            continue;
+        }
+
+        if(1 != fscanf(fd, "%d", &rot)) {
+            rot = 0;
+        }
+
+        fclose(fd);
+        return rot;
+    }
+
+#endif
+    return 0;
+}
+
+static int
+device_depth(dev_t dev)
+{
+    for(int i = ntunes - 1; i >= 0; i--) {
+        if(tunes[i].dev == dev) {
+            return tunes[i].depth;
+        }
+    }
+
+    return rotational(dev) ? read_depth_hdd : read_depth > 0 ? read_depth : 1;
+}
+
+/* grows the pool to one thread per job the devices may have in flight */
+static void
+add_threads(struct reader * r)
+{
+    while(r->nthreads < r->wanted && r->nthreads < READ_THREADS) {
+        if(0 != pthread_create(&r->threads[r->nthreads], 0, read_worker, r)) {
+            break;
+        }
+
+        r->nthreads++;
+    }
+}
+
+static int start_threads(struct reader *);
+
+#if defined(READ_URING)
+
+/*
+ * The ring failed under us, so it is dropped and the reader carries on
+ * with threads.  Whatever was on the ring goes back to the front of its
+ * queue to be opened and read again from the start.
+ */
+static int
+uring_fallback(struct reader * r)
+{
+    struct read_job * j = r->active;
+
+    uring_free(&r->ring);
+    r->uring = 0;
+    r->active = 0;
+
+    while(0 != j) {
+        struct read_job * next = j->next;
+
+        if(j->fd >= 0) {
+            close(j->fd);
+            j->fd = -1;
+        }
+
+        j->len = 0;
+        j->error = 0;
+        j->state = RJ_QUEUED;
+        j->queue->inflight--;
+        r->inflight--;
+
+        if(0 == (j->next = j->queue->backlog)) {
+            j->queue->tail = &j->next;
+        }
+
+        j->queue->backlog = j;
+        j = next;
+    }
+
+    return start_threads(r);
+}
+
+#endif
+
+/* the queue for dev, made on first use with that device's depth */
+static struct read_queue *
+get_queue(struct reader * r, dev_t dev)
+{
+    struct read_queue ** queues;
+    struct read_queue * q;
+
+    for(int i = 0; i < r->nqueues; i++) {
+        if(r->queues[i]->dev == dev) {
+            return r->queues[i];
+        }
+    }
+
+    if(0 == (q = calloc(1, sizeof(struct read_queue)))) {
+        return 0;
+    }
+
+    if(0 == (queues = realloc(r->queues, (r->nqueues + 1) * sizeof(struct read_queue *)))) {
+        free(q);
+        return 0;
+    }
+
+    q->dev = dev;
+    q->depth = device_depth(dev);
+    q->tail = &q->backlog;
+    r->queues = queues;
+    r->queues[r->nqueues++] = q;
+    r->wanted += q->depth;
+
+    if(!r->uring) {
+        add_threads(r);
+    }
+
+    return q;
+}
+
+static int
+start_threads(struct reader * r)
+{
+    r->cap = READ_THREADS;
+    r->wanted = r->wanted > r->depth ? r->wanted : r->depth;
+    pthread_mutex_init(&r->lock, 0);
+    pthread_cond_init(&r->work, 0);
+    pthread_cond_init(&r->done, 0);
+    r->threads = calloc(READ_THREADS, sizeof(pthread_t));
+
+    if(0 != r->threads) {
+        add_threads(r);
+    }
+
+    return 0 == r->nthreads ? -1 : 0;
+}
+
+struct reader *
+reader_new(int depth)
+{
+    struct reader * r = calloc(1, sizeof(struct reader));
+
+    if(0 == r) {
+        return 0;
+    }
+
+    r->depth = depth > 0 ? depth : 1;
+    r->cap = r->depth > READ_RING ? r->depth : READ_RING;
+#if defined(READ_URING)
+
+    if(0 == uring_setup(&r->ring, r->cap)) {
+        r->uring = 1;
+        return r;
+    }
+
+#endif
+
+    if(0 != start_threads(r)) {
+        reader_free(r);
+        return 0;
+    }
+
+    return r;
+}
+
+const char *
+reader_engine(const struct reader * r)
+{
+    return r->uring ? "io_uring" : "threads";
+}
+
+void
+reader_submit(struct reader * r, struct read_job * j)
+{
+    j->next = 0;
+    j->len = 0;
+    j->error = 0;
+    j->fd = -1;
+    j->state = RJ_QUEUED;
+
+    if(0 != get_buffer(j)) {
+        j->error = ENOMEM;
+        j->state = RJ_DONE;
+        return;
+    }
+
+#if defined(READ_URING)
+
+    if(r->uring) {
+        if(0 == (j->queue = get_queue(r, j->dev))) {
+            j->error = ENOMEM;
+            j->state = RJ_DONE;
+            return;
+        }
+
+        *j->queue->tail = j;
+        j->queue->tail = &j->next;
+
+        while(0 != (j = next_job(r))) {
+            start_job(r, j);
+        }
+
+        return;
+    }
+
+#endif
+    pthread_mutex_lock(&r->lock);
+
+    if(0 == (j->queue = get_queue(r, j->dev))) {
+        j->error = ENOMEM;
+        j->state = RJ_DONE;
+        pthread_mutex_unlock(&r->lock);
+        return;
+    }
+
+    *j->queue->tail = j;
+    j->queue->tail = &j->next;
+    pthread_cond_signal(&r->work);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void
+reader_wait(struct reader * r, struct read_job * j)
+{
+#if defined(READ_URING)
+
+    if(r->uring) {
+        if(0 == uring_wait(r, j)) {
+            return;
+        }
+
+        fprintf(stderr, "Can't wait on io_uring; %s; reading with threads\n", strerror(errno));
+
+        if(0 != uring_fallback(r)) {
+            fprintf(stderr, "Can't start reader threads; reading in line\n");
+        }
+    }
+
+#endif
+    pthread_mutex_lock(&r->lock);
+
+    // with no thread left to read, the caller's own does it
+    while(RJ_DONE != j->state) {
+        struct read_job * k = 0 == r->nthreads ? next_job(r) : 0;
+
+        if(0 != k) {
+            run_job(r, k);
+        } else {
+            pthread_cond_wait(&r->done, &r->lock);
+        }
+    }
+
+    pthread_mutex_unlock(&r->lock);
+}
+
+void
+reader_done(struct reader * r, struct read_job * j)
+{
+    (void)r;
+    pool_put(j->buf);
+    j->buf = 0;
+    j->cap = 0;
+}
+
+void
+reader_free(struct reader * r)
+{
+    if(0 == r) {
+        return;
+    }
+
+#if defined(READ_URING)
+
+    if(r->uring) {
+        uring_free(&r->ring);
+    } else
+#endif
+    {
+        pthread_mutex_lock(&r->lock);
+        r->stop = 1;
+        pthread_cond_broadcast(&r->work);
+        pthread_mutex_unlock(&r->lock);
+
+        for(int i = 0; i < r->nthreads; i++) {
+            pthread_join(r->threads[i], 0);
+        }
+
+        pthread_cond_destroy(&r->done);
+        pthread_cond_destroy(&r->work);
+        pthread_mutex_destroy(&r->lock);
+        free(r->threads);
+    }
+
+    for(int i = 0; i < r->nqueues; i++) {
+        free(r->queues[i]);
+    }
+
+    free(r->queues);
+    free(r);
+}
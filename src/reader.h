@@ -0,0 +1,38 @@
+#ifndef _SRC_READER_H_
+#define _SRC_READER_H_
+
+#include <sys/types.h>
+
+struct read_queue;
+
+struct read_job {
+    struct read_job * next;
+    struct read_queue * queue;
+    const char * path;
+    dev_t dev;
+    off_t size;
+    char * buf;
+    size_t cap;
+    size_t len;
+    int fd;
+    int error;
+    int state;
+};
+
+struct reader;
+
+extern int read_depth;
+extern int read_depth_hdd;
+
+extern const size_t READ_MAX_FILE;
+extern const size_t READ_BUDGET;
+
+int reader_tune(const char * const);
+struct reader * reader_new(int);
+void reader_submit(struct reader *, struct read_job *);
+void reader_wait(struct reader *, struct read_job *);
+void reader_done(struct reader *, struct read_job *);
+void reader_free(struct reader *);
+const char * reader_engine(const struct reader *);
+
+#endif /*_SRC_READER_H_*/
@@ -0,0 +1,285 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "hash.h"
+#include "index.h"
+#include "pool.h"
+#include "stream.h"
+#include "sqlite/sqlite3.h"
+
+const size_t STREAM_WINDOW = 8 << 20;
+
+/*
+ * Holes in fd are worth skipping if it has fewer blocks than bytes, and
+ * the file is not chunked by content, which has to see the zeros.  A
+ * multi-terabyte sparse file then costs what its data does.
+ */
+void
+stream_sparse(struct stream * s, int fd)
+{
+    s->fd = fd;
+    s->sparse = 0;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    struct stat st;
+
+    s->sparse = 0 == chunk_avg && 0 == fstat(fd, &st) &&
+                (off_t)st.st_blocks * 512 < st.st_size;
+#endif
+}
+
+/* how many bytes from at are a hole, 0 if at is in data */
+off_t
+stream_hole(const struct stream * s, off_t at)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    off_t data;
+
+    if(s->sparse) {
+        // nothing but hole to the end, as far as a file that shrank goes too
+        if((data = lseek(s->fd, at, SEEK_DATA)) < 0) {
+            data = ENXIO == errno ? s->size : at;
+        }
+
+        return (data < s->size ? data : s->size) - at;
+    }
+#else
+    (void)s;
+    (void)at;
+#endif
+
+    return 0;
+}
+
+/* where the data at at ends, at the next hole or the end of the file */
+off_t
+stream_data(const struct stream * s, off_t at)
+{
+    off_t end = s->size;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+
+    if(s->sparse && (end = lseek(s->fd, at, SEEK_HOLE)) < 0) {
+        end = s->size;
+    }
+
+#else
+    (void)at;
+#endif
+
+    return end < s->size ? end : s->size;
+}
+
+/* starts a blob of len bytes at off, longer than what is at hand */
+void
+stream_open(struct stream * s, off_t off, size_t len)
+{
+    s->off = off;
+    s->len = len;
+    s->at = 0;
+    hash_engine->init(&s->state);
+}
+
+/*
+ * Reads the blob just streamed from the file again, a window at a time
+ * and its holes skipped, into blob if one is given, and into digest as e
+ * hashes it.  Reads start on a CACHE_ALIGN boundary, for a file left
+ * reading around the cache; what a file that shrank no longer has is
+ * taken as zeros, as it was when hashed.  -1 if the blob can't be written.
+ */
+static int
+stream_reread(struct stream * s, const struct hash_engine * e, unsigned char * digest,
+              sqlite3_blob * blob)
+{
+    union hash_state state;
+    char * buf = 0;
+    size_t at = 0;
+
+    if(0 == (buf = pool_get(STREAM_WINDOW, 0))) {
+        fprintf(stderr, "Can't read %zu byte blob of file %s; %s\n", s->len, s->path,
+                strerror(errno));
+        return -1;
+    }
+
+    e->init(&state);
+
+    while(at < s->len) {
+        const off_t from = s->off + (off_t)at;
+        const off_t hole = stream_hole(s, from);
+        const size_t skip = (size_t)(from % (off_t)CACHE_ALIGN);
+        const off_t end = stream_data(s, from);
+        size_t n = s->len - at < STREAM_WINDOW - skip ? s->len - at : STREAM_WINDOW - skip;
+        ssize_t got;
+
+        if(hole > 0) {
+            n = (size_t)hole < s->len - at ? (size_t)hole : s->len - at;
+            hash_zeros(e, &state, n);
+            at += n;
+            continue;
+        }
+
+        n = end - from < (off_t)n ? (size_t)(end - from) : n;
+        got = pread(s->fd, buf, (skip + n + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN,
+                    from - (off_t)skip);
+
+        if(got < 0 && EINVAL == errno) {
+            cache_buffered(s->fd);
+            continue;
+        }
+
+        if(got < 0 && EINTR == errno) {
+            continue;
+        }
+
+        if(got <= (ssize_t)skip) {
+            break;
+        }
+
+        n = (size_t)got - skip < n ? (size_t)got - skip : n;
+
+        if(0 != blob && SQLITE_OK != sqlite3_blob_write(blob, buf + skip, (int)n, (int)at)) {
+            fprintf(stderr, "Can't store %zu byte blob of file %s; %s\n", s->len, s->path,
+                    sqlite3_errmsg(DB));
+            pool_put(buf);
+            return -1;
+        }
+
+        e->update(&state, buf + skip, n);
+        at += n;
+    }
+
+    hash_zeros(e, &state, s->len - at);
+    e->final(&state, digest);
+    pool_put(buf);
+    return 0;
+}
+
+/*
+ * Fills the row of zeros just added for the blob streamed from the file,
+ * so that the row is never in memory whole.  If what is read no longer
+ * comes to digest, the file changed in between; -1 and the row is gone.
+ */
+static int
+stream_fill(struct stream * s, const unsigned char * const digest)
+{
+    const sqlite3_int64 row = sqlite3_last_insert_rowid(DB);
+    unsigned char again[HASH_MAX];
+    sqlite3_blob * blob = 0;
+
+    if(SQLITE_OK != sqlite3_blob_open(DB, "main", "blobs", "blob", row, 1, &blob)) {
+        fprintf(stderr, "Can't store %zu byte blob of file %s; %s\n", s->len, s->path,
+                sqlite3_errmsg(DB));
+    } else if(0 == stream_reread(s, hash_engine, again, blob)) {
+        if(0 == memcmp(again, digest, hash_engine->size)) {
+            sqlite3_blob_close(blob);
+            return 0;
+        }
+
+        fprintf(stderr, "\t\tfile %s was changed while being stored\n", s->path);
+    }
+
+    sqlite3_blob_close(blob);
+    drop_row(row);
+    return -1;
+}
+
+/*
+ * insert_blob() for the blob just streamed.  Its row is only added once
+ * its key is known and then filled, since SQLite rewrites a row whole,
+ * in memory, to set any of its columns after the fact.  With verify_blobs
+ * the blob is only read a third time, for its blake2b digest, when its
+ * key turns out to be taken.
+ */
+static int
+stream_store(struct stream * s, struct hash_key * key, const unsigned char * const digest,
+             int * failed)
+{
+    unsigned char strong[32];
+    char name[2 * HASH_MAX + 1];
+
+    if(add_blob(key, s->len, 0)) {
+        *failed |= 0 != stream_fill(s, digest);
+        return 0;
+    }
+
+    if(!verify_blobs) {
+        return 0;
+    }
+
+    if(0 != stream_reread(s, HASH_STRONG, strong, 0)) {
+        *failed = 1;
+        return 0;
+    }
+
+    if(same_blob(key, s->len, strong)) {
+        return 0;
+    }
+
+    hash_key_str(key, name, sizeof(name));
+    *key = hash_key(strong);
+
+    if(add_blob(key, s->len, 0)) {
+        fprintf(stderr, "Hash collision on blob %s (%zu bytes); stored it by blake2b\n",
+                name, s->len);
+        *failed |= 0 != stream_fill(s, digest);
+    } else if(!same_blob(key, s->len, strong)) {
+        fprintf(stderr, "Can't store blob %s (%zu bytes); its blake2b key is taken too\n",
+                name, s->len);
+    }
+
+    return 1;
+}
+
+/*
+ * The blob streamed so far is done: *key is what it is stored under,
+ * unless *failed says the file failed already or sets it now.  1 if it
+ * had to move to its blake2b key, as insert_blob() says.
+ */
+int
+stream_close(struct stream * s, struct hash_key * key, int * failed)
+{
+    unsigned char digest[HASH_MAX];
+    int moved = 0;
+
+    hash_engine->final(&s->state, digest);
+    *key = hash_key(digest);
+
+    if(!*failed) {
+        moved = stream_store(s, key, digest, failed);
+    }
+
+    s->len = 0;
+    s->at = 0;
+    return moved;
+}
+
+/*
+ * n more bytes of the blob being streamed, or n zeros if p is 0, and into
+ * file as well unless it is 0; they are only hashed for now.  1 once the
+ * blob has all of them, for stream_close().
+ */
+int
+stream_write(struct stream * s, union hash_state * file, const char * p, size_t n)
+{
+    if(0 == p) {
+        hash_zeros(hash_engine, &s->state, n);
+
+        if(0 != file) {
+            hash_zeros(hash_engine, file, n);
+        }
+    } else if(0 == file) {
+        hash_engine->update(&s->state, p, n);
+    } else {
+        hash_update2(file, &s->state, p, n);
+    }
+
+    s->at += n;
+    return s->at == s->len;
+}
@@ -0,0 +1,34 @@
+#ifndef _SRC_STREAM_H_
+#define _SRC_STREAM_H_
+
+#include <sys/types.h>
+
+#include "hash.h"
+
+extern const size_t STREAM_WINDOW;
+
+/*
+ * A blob longer than what is at hand, streamed from the file at fd of
+ * size bytes: hashed as it comes, at of its len bytes from off so far,
+ * and only stored once its key is known.  sparse says the file's holes
+ * are skipped rather than read.
+ */
+struct stream {
+    const char * path;
+    int fd;
+    off_t size;
+    int sparse;
+    off_t off;
+    size_t len;
+    size_t at;
+    union hash_state state;
+};
+
+void stream_sparse(struct stream *, int);
+off_t stream_hole(const struct stream *, off_t);
+off_t stream_data(const struct stream *, off_t);
+void stream_open(struct stream *, off_t, size_t);
+int stream_write(struct stream *, union hash_state *, const char *, size_t);
+int stream_close(struct stream *, struct hash_key *, int *);
+
+#endif /*_SRC_STREAM_H_*/
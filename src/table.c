@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "table.h"
+
+/*
+ * Open addressing on a caller-supplied 64 bit key.  Different values may
+ * share a key; table_get walks the probe sequence asking `match` about
+ * each value filed under it.
+ */
+
+static int
+table_grow(struct table * t)
+{
+    size_t cap = t->cap ? t->cap * 2 : 1024;
+    struct tslot * slots = calloc(cap, sizeof(struct tslot));
+
+    if(0 == slots) {
+        return -1;
+    }
+
+    for(size_t i = 0; i < t->cap; i++) {
+        if(0 == t->slots[i].val) {
+            continue;
+        }
+
+        size_t j = t->slots[i].key & (cap - 1);
+
+        while(0 != slots[j].val) {
+            j = (j + 1) & (cap - 1);
+        }
+
+        slots[j] = t->slots[i];
+    }
+
+    free(t->slots);
+    t->slots = slots;
+    t->cap = cap;
+    return 0;
+}
+
+int
+table_put(struct table * t, uint64_t key, void * val)
+{
+    if(2 * (t->count + 1) > t->cap && 0 != table_grow(t)) {
+        return -1;
+    }
+
+    size_t i = key & (t->cap - 1);
+
+    while(0 != t->slots[i].val) {
+        i = (i + 1) & (t->cap - 1);
+    }
+
+    t->slots[i].key = key;
+    t->slots[i].val = val;
+    t->count++;
+    return 0;
+}
+
+void *
+table_get(const struct table * t, uint64_t key, table_match match,
+          const void * arg)
+{
+    if(0 == t->cap) {
+        return 0;
+    }
+
+    for(size_t i = key & (t->cap - 1); 0 != t->slots[i].val;
+            i = (i + 1) & (t->cap - 1)) {
+        if(key == t->slots[i].key && (0 == match || match(t->slots[i].val, arg))) {
+            return t->slots[i].val;
+        }
+    }
+
+    return 0;
+}
+
+void
+table_free(struct table * t, void (*release)(void *))
+{
+    for(size_t i = 0; 0 != release && i < t->cap; i++) {
+        if(0 != t->slots[i].val) {
+            release(t->slots[i].val);
+        }
+    }
+
+    free(t->slots);
+    memset(t, 0, sizeof(struct table));
+}
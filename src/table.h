@@ -0,0 +1,24 @@
+#ifndef _SRC_TABLE_H_
+#define _SRC_TABLE_H_
+
+#include <stdint.h>
+#include <unistd.h>
+
+struct tslot {
+    uint64_t key;
+    void * val;
+};
+
+struct table {
+    struct tslot * slots;
+    size_t cap;
+    size_t count;
+};
+
+typedef int (*table_match)(const void *, const void *);
+
+int table_put(struct table *, uint64_t, void *);
+void * table_get(const struct table *, uint64_t, table_match, const void *);
+void table_free(struct table *, void (*)(void *));
+
+#endif /*_SRC_TABLE_H_*/
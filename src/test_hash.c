@@ -0,0 +1,218 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hash.h"
+
+/*
+ * test_hash: pins the digest every engine gives, since the digests are the
+ * keys of every database written with it.  Each vector is hashed whole and
+ * again in uneven pieces, and ixh128 once per kernel this CPU runs, so a
+ * change to the secret, the fold or any one SIMD kernel shows up here
+ * rather than as a database whose keys no longer match.
+ *
+ * Inputs are TEST_LENS bytes of test_fill(); the lengths sit on either side
+ * of ixh128's 64-byte stripe and 1024-byte block and of blake2b's 128-byte
+ * block.  `-g` prints the table from what this build computes, for when a
+ * digest is meant to change.
+ */
+
+struct vector {
+    const char * engine;
+    size_t len;
+    const char * digest;
+};
+
+static const size_t TEST_LENS[] = {
+    0, 1, 3, 8, 63, 64, 65, 127, 128, 129, 1023, 1024, 1025, 2047, 2048, 2049, 16385, 100000,
+};
+
+static const struct vector VECTORS[] = {
+    {"fnv64", 0, "25232284e49cf2cb"},
+    {"fnv64", 1, "2ac701864cc663af"},
+    {"fnv64", 3, "e3ca849818f99d27"},
+    {"fnv64", 8, "947b2f11a20f3b61"},
+    {"fnv64", 63, "9f64640b5d15a7e6"},
+    {"fnv64", 64, "37a5965b1aba4d52"},
+    {"fnv64", 65, "28befaa0c972b870"},
+    {"fnv64", 127, "a8805057b010a066"},
+    {"fnv64", 128, "2f7dca5da4f07cb2"},
+    {"fnv64", 129, "b50a145f4bdeca14"},
+    {"fnv64", 1023, "f6727d74c8b0d00b"},
+    {"fnv64", 1024, "f7db29f19d110f91"},
+    {"fnv64", 1025, "05d01fca605676a6"},
+    {"fnv64", 2047, "cf0eb3853866d405"},
+    {"fnv64", 2048, "3594412f0b29f89a"},
+    {"fnv64", 2049, "ac926f4c01624295"},
+    {"fnv64", 16385, "8e032cb53272e846"},
+    {"fnv64", 100000, "835171a3cc992112"},
+    {"ixh128", 0, "1ee0ada304869747b53a918f1f9b549d"},
+    {"ixh128", 1, "d7db8cdb9fa3236021b1f781c6acb609"},
+    {"ixh128", 3, "62b045c83e2dccc12020f73bf68ab71e"},
+    {"ixh128", 8, "18e9f920be9442a3decba09c68034602"},
+    {"ixh128", 63, "879f83443097bf45e9d718346582c89f"},
+    {"ixh128", 64, "26690c20ce5fa60ddcff75ea2162f989"},
+    {"ixh128", 65, "52f3324b3d03abcc8ae5856f8c024b4d"},
+    {"ixh128", 127, "730f22c8d7a823480ca6a4c4e8499b25"},
+    {"ixh128", 128, "fc942e1e47ee684cd91b00b042f82f5e"},
+    {"ixh128", 129, "bdf1d51492f8b5eb07119f68d2c464c0"},
+    {"ixh128", 1023, "e309780004d76306fe4f929944a8aa77"},
+    {"ixh128", 1024, "a3d159374a0911ff0a2088947c8a9e44"},
+    {"ixh128", 1025, "55ad77da9227df7c580e11c82720d009"},
+    {"ixh128", 2047, "9eb8c886bf1c8db8a1697c39696ab572"},
+    {"ixh128", 2048, "0920af9166fe46012ea5afd126b62f77"},
+    {"ixh128", 2049, "f4c4b7c6d7085f6b5e0807705b79e26b"},
+    {"ixh128", 16385, "57b4cd6432cc64906bef2fef0f606a04"},
+    {"ixh128", 100000, "23322faa47bd78fd990c33eb249fd8bf"},
+    {"blake2b", 0, "0e5751c026e543b2e8ab2eb06099daa1d1e5df47778f7787faab45cdf12fe3a8"},
+    {"blake2b", 1, "44e9e1dfd31e4c8c8e05d6db76912790ae9b2f989463f59f709cdd3df7393675"},
+    {"blake2b", 3, "e2d744a8fc175317f9791b363072b2db87ea2a628f2ae6dc67be3ff23e561f51"},
+    {"blake2b", 8, "eaf82843e2dcf5c86751b1cb24f32d5501aff8223e9b719fc50110cda4a2cd27"},
+    {"blake2b", 63, "267b4355ae466ad8d797ac526c91c1adc9f2bb2f685b99424066b22af0d09875"},
+    {"blake2b", 64, "da3644380c139efc4ced8aafa01850f6485324527a653f76cc22a91b9266400d"},
+    {"blake2b", 65, "09ec2c149ce00286183deddfa66e8b69bf9df0e6a521eb2a07ffa801dc4ff31e"},
+    {"blake2b", 127, "cd9f1bd7f754111754ed77e9f8413c8c48b9f679195b2b76e0fadd615d1541fa"},
+    {"blake2b", 128, "ddf3ed05c7265a8706e174c820efa4adcb6123f24e3650b26cc836c0cdd910a9"},
+    {"blake2b", 129, "ed20b6f060779941b621ff4f00f4534ce3a4bc234b09cac9187d66ae582cb1a0"},
+    {"blake2b", 1023, "e4ce90ca225a4c28324fc50abdb000836f2873726c22e5448179f040c63ac221"},
+    {"blake2b", 1024, "6c93edd41720e1ed15b8d98024ae1c487135d58c86accbb0122ada3bf5d0c7cf"},
+    {"blake2b", 1025, "f795e7b81716647bde6de60a12619190a0679103950f58699ca4d9d19c3829e7"},
+    {"blake2b", 2047, "1b2abfde6c4982740e41b90358f76ec125cfcfb886d4c2ec1d6795beaa2175c3"},
+    {"blake2b", 2048, "a62a39caf86a90aae9b943bdf946c99c1d516c50cd2eedc4d935a563eefac42e"},
+    {"blake2b", 2049, "95df52328e50325ef372a5dd75f4c05380095fdbfa77c462cd214ada422e1952"},
+    {"blake2b", 16385, "f85dc7863e730dfcf052082bff82fb2150189431442cf9679482c9ec058c8fa6"},
+    {"blake2b", 100000, "71a55db7afa108060144bcc076bc0251eba0ef1174f96ae6ddc45d9ec0227cb2"},
+};
+
+/* BLAKE2b-256 of "abc" as other implementations give it; the empty one above is too */
+static const struct vector BLAKE2B_ABC = {
+    "blake2b", 3, "bddd813c634239723171ef3fee98579b94964e3bb1cb3e427262c8c068d52319",
+};
+
+static const char * const KERNELS[] = {"scalar", "sse2", "avx2", "avx512"};
+
+static unsigned char test_buf[100000];
+
+static void
+test_fill(void)
+{
+    uint32_t x = 0x12345678;
+
+    for(size_t i = 0; i < sizeof(test_buf); i++) {
+        x = x * 1103515245 + 12345;
+        test_buf[i] = x >> 24;
+    }
+}
+
+/* buf hashed with e, fed in pieces of `piece` bytes or whole if 0, as hex */
+static void
+test_digest(const struct hash_engine * e, const unsigned char * buf, size_t len,
+            size_t piece, char * hex)
+{
+    union hash_state s;
+    unsigned char digest[HASH_MAX];
+
+    e->init(&s);
+
+    for(size_t at = 0; at < len; at += piece) {
+        if(0 == piece || piece > len - at) {
+            piece = len - at;
+        }
+
+        e->update(&s, buf + at, piece);
+    }
+
+    e->final(&s, digest);
+
+    for(size_t i = 0; i < e->size; i++) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+}
+
+static int
+test_vector(const struct vector * v, const unsigned char * buf, const char * kernel)
+{
+    static const size_t PIECES[] = {0, 1, 7, 64, 1000};
+    const struct hash_engine * e = hash_find(v->engine);
+    char hex[2 * HASH_MAX + 1];
+    int failed = 0;
+
+    for(size_t i = 0; i < sizeof(PIECES) / sizeof(PIECES[0]); i++) {
+        test_digest(e, buf, v->len, PIECES[i], hex);
+
+        if(0 != strcmp(hex, v->digest)) {
+            fprintf(stderr, "%s%s%s of %zu bytes in pieces of %zu is %s, not %s\n",
+                    v->engine, kernel ? "/" : "", kernel ? kernel : "",
+                    v->len, PIECES[i], hex, v->digest);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
+
+static int
+test_engine(const char * name, const char * kernel)
+{
+    int failed = 0;
+
+    for(size_t i = 0; i < sizeof(VECTORS) / sizeof(VECTORS[0]); i++) {
+        if(0 == strcmp(VECTORS[i].engine, name)) {
+            failed |= test_vector(&VECTORS[i], test_buf, kernel);
+        }
+    }
+
+    return failed;
+}
+
+static void
+test_print(void)
+{
+    char hex[2 * HASH_MAX + 1];
+
+    for(int e = 0; 0 != HASH_ENGINES[e]; e++) {
+        for(size_t i = 0; i < sizeof(TEST_LENS) / sizeof(TEST_LENS[0]); i++) {
+            test_digest(HASH_ENGINES[e], test_buf, TEST_LENS[i], 0, hex);
+            printf("{\"%s\", %zu, \"%s\"},\n", HASH_ENGINES[e]->name, TEST_LENS[i], hex);
+        }
+    }
+}
+
+int
+main(int argc, char ** argv)
+{
+    int failed = 0;
+    int kernels = 0;
+
+    test_fill();
+
+    if(argc > 1 && 0 == strcmp(argv[1], "-g")) {
+        test_print();
+        return 0;
+    }
+
+    failed |= test_vector(&BLAKE2B_ABC, (const unsigned char *)"abc", 0);
+
+    for(int e = 0; 0 != HASH_ENGINES[e]; e++) {
+        if(0 != strcmp(HASH_ENGINES[e]->name, "ixh128")) {
+            failed |= test_engine(HASH_ENGINES[e]->name, 0);
+        }
+    }
+
+    for(size_t k = 0; k < sizeof(KERNELS) / sizeof(KERNELS[0]); k++) {
+        if(0 != hash_use_kernel(KERNELS[k])) {
+            fprintf(stderr, "Skipping ixh128/%s; not supported here\n", KERNELS[k]);
+            continue;
+        }
+
+        failed |= test_engine("ixh128", KERNELS[k]);
+        kernels++;
+    }
+
+    printf("hash tests: %s (%zu vectors, %d ixh128 kernels)\n", failed ? "FAILED" : "passed",
+           sizeof(VECTORS) / sizeof(VECTORS[0]), kernels);
+    return failed;
+}
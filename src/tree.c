@@ -0,0 +1,365 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#if defined(__linux__)
+#include <sys/vfs.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#define TREE_FIEMAP
+#endif
+
+#include "chunk.h"
+#include "hash.h"
+#include "index.h"
+#include "pool.h"
+#include "tree.h"
+#include "fnv/fnv.h"
+
+size_t tree_leaf = 0;
+int tree_jobs = 1;
+
+const size_t TREE_BUDGET = 1 << 30;
+
+static const size_t TREE_MIN_LEAF = 64 << 10;
+
+/*
+ * A file larger than one leaf is cut into leaves of tree_leaf bytes at
+ * fixed offsets.  Each leaf is read with its own pread() and hashed on
+ * its own, so up to tree_jobs of them are in flight on as many threads,
+ * and the file's digest is the engine's hash of the leaf digests in
+ * order, followed by the file size and the leaf size.  A leaf is also
+ * where chunks end, the way a read buffer is for a linear hash.
+ *
+ * "<leaf>" with a k, m or g suffix; the workers are one per online CPU,
+ * as many as fit their leaves in TREE_BUDGET.
+ */
+int
+tree_tune(const char * const spec)
+{
+    char * end;
+    size_t leaf;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(0 != parse_bytes(spec, &end, &leaf) || '\0' != *end ||
+            leaf < TREE_MIN_LEAF || leaf > MAX_LEN) {
+        return -1;
+    }
+
+    tree_leaf = leaf;
+    tree_jobs = cpus > 0 ? (int)cpus : 1;
+
+    if((size_t)tree_jobs > TREE_BUDGET / leaf) {
+        tree_jobs = (int)(TREE_BUDGET / leaf);
+    }
+
+    if(tree_jobs < 1) {
+        tree_jobs = 1;
+    }
+
+    return 0;
+}
+
+/* the leaf size as tree_tune() takes it, for recording with the database */
+int
+tree_spec(char * buf, size_t len)
+{
+    return snprintf(buf, len, "%zu", tree_leaf);
+}
+
+/*
+ * Whether a leaf whose extents have not moved can be taken to hold the
+ * same data as last time.  Only on btrfs, where a write always goes to
+ * newly allocated extents, and only for files not marked nodatacow,
+ * which are overwritten in place like on any other filesystem.
+ */
+int
+tree_trusted(int fd)
+{
+#if defined(TREE_FIEMAP)
+    static const long btrfs_magic = 0x9123683E;
+    struct statfs fs;
+    int flags = 0;
+
+    if(0 != fstatfs(fd, &fs) || btrfs_magic != (long)fs.f_type) {
+        return 0;
+    }
+
+    if(0 != ioctl(fd, FS_IOC_GETFLAGS, &flags) || (flags & FS_NOCOW_FL)) {
+        return 0;
+    }
+
+    return 1;
+#else
+    (void)fd;
+    return 0;
+#endif
+}
+
+/*
+ * A fingerprint of where the leaf at off lives on disk: its extents
+ * clipped to the leaf, plus its first and last few kilobytes, so that a
+ * freed extent handed back to a rewrite of the same range is still caught
+ * in all but the unluckiest case.  0 means the leaf cannot be vouched
+ * for: unmapped, still in delayed allocation, inline, or no FIEMAP.  Nor
+ * can a preallocated extent, which btrfs fills in place without moving.
+ */
+uint64_t
+tree_extents(int fd, off_t off, size_t len)
+{
+#if defined(TREE_FIEMAP)
+    static const uint32_t unmapped =
+        FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE |
+        FIEMAP_EXTENT_UNWRITTEN;
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent[32];
+    } q;
+    const uint64_t end = (uint64_t)off + len;
+    uint64_t at = (uint64_t)off;
+    Fnv64_t h = FNV1A_64_INIT;
+    char sample[4096];
+    size_t n = len < sizeof(sample) ? len : sizeof(sample);
+    int any = 0;
+
+    while(at < end) {
+        uint32_t i;
+
+        memset(&q, 0, sizeof(q));
+        q.map.fm_start = at;
+        q.map.fm_length = end - at;
+        q.map.fm_extent_count = sizeof(q.extent) / sizeof(q.extent[0]);
+
+        if(0 != ioctl(fd, FS_IOC_FIEMAP, &q.map)) {
+            return 0;
+        }
+
+        if(0 == q.map.fm_mapped_extents) {
+            break;
+        }
+
+        for(i = 0; i < q.map.fm_mapped_extents; i++) {
+            const struct fiemap_extent * x = &q.extent[i];
+            uint64_t lo = x->fe_logical > (uint64_t)off ? x->fe_logical : (uint64_t)off;
+            uint64_t hi = x->fe_logical + x->fe_length < end ?
+                          x->fe_logical + x->fe_length : end;
+            uint64_t rec[3];
+
+            if(x->fe_flags & unmapped) {
+                return 0;
+            }
+
+            rec[0] = lo;
+            rec[1] = x->fe_physical + (lo - x->fe_logical);
+            rec[2] = hi - lo;
+            h = fnv_64a_buf(rec, sizeof(rec), h);
+            at = x->fe_logical + x->fe_length;
+            any = 1;
+        }
+
+        if(q.extent[q.map.fm_mapped_extents - 1].fe_flags & FIEMAP_EXTENT_LAST) {
+            break;
+        }
+    }
+
+    if(!any || (ssize_t)n != pread(fd, sample, n, off)) {
+        return 0;
+    }
+
+    h = fnv_64a_buf(sample, n, h);
+
+    if((ssize_t)n != pread(fd, sample, n, off + len - n)) {
+        return 0;
+    }
+
+    h = fnv_64a_buf(sample, n, h);
+    return 0 != h ? h : 1;
+#else
+    (void)fd;
+    (void)off;
+    (void)len;
+    return 0;
+#endif
+}
+
+static int
+add_chunk(struct leaf * l, size_t end, const struct hash_key * id, size_t * cap)
+{
+    if(l->nchunks == *cap) {
+        size_t more = 0 != *cap ? 2 * *cap : 64;
+        size_t * ends = realloc(l->ends, more * sizeof(size_t));
+        struct hash_key * ids = 0 != ends ? realloc(l->ids, more * sizeof(struct hash_key)) : 0;
+
+        if(0 != ends) {
+            l->ends = ends;
+        }
+
+        if(0 == ids) {
+            return -1;
+        }
+
+        l->ids = ids;
+        *cap = more;
+    }
+
+    l->ends[l->nchunks] = end;
+    l->ids[l->nchunks++] = *id;
+    return 0;
+}
+
+/* reads and hashes one leaf, cutting it into chunks on the way if chunking */
+static void
+read_leaf(int fd, struct leaf * l)
+{
+    union hash_state tree;
+    union hash_state blob;
+    unsigned char digest[HASH_MAX];
+    struct hash_key id;
+    size_t cap = 0;
+    size_t done = 0;
+
+    if(l->reuse) {
+        return;
+    }
+
+    if(0 == (l->buf = pool_get(l->len, 0))) {
+        l->error = ENOMEM;
+        return;
+    }
+
+    while(done < l->len) {
+        ssize_t got = pread(fd, l->buf + done, l->len - done, l->off + done);
+
+        if(got < 0 && EINTR == errno) {
+            continue;
+        }
+
+        if(got <= 0) {
+            // a file that shrinks under us is not one we can vouch for
+            l->error = got < 0 ? errno : ESTALE;
+            return;
+        }
+
+        done += got;
+    }
+
+    hash_engine->init(&tree);
+
+    if(0 != chunk_fixed ? l->len <= chunk_fixed : 0 == chunk_avg || l->len <= chunk_min) {
+        hash_engine->update(&tree, l->buf, l->len);
+        hash_engine->final(&tree, l->digest);
+        return;
+    }
+
+    for(size_t off = 0, n; off < l->len; off += n) {
+        n = chunk_cut((const unsigned char *)l->buf + off, l->len - off);
+        hash_engine->init(&blob);
+        hash_update2(&tree, &blob, l->buf + off, n);
+        hash_engine->final(&blob, digest);
+        id = hash_key(digest);
+
+        if(0 != add_chunk(l, off + n, &id, &cap)) {
+            l->error = ENOMEM;
+            return;
+        }
+    }
+
+    hash_engine->final(&tree, l->digest);
+}
+
+struct crew {
+    int fd;
+    struct leaf * leaves;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+};
+
+static void *
+leaf_worker(void * arg)
+{
+    struct crew * c = arg;
+
+    for(;;) {
+        pthread_mutex_lock(&c->lock);
+        int i = c->next++;
+        pthread_mutex_unlock(&c->lock);
+
+        if(i >= c->count) {
+            return 0;
+        }
+
+        read_leaf(c->fd, &c->leaves[i]);
+    }
+}
+
+/*
+ * Reads and hashes count leaves of fd, up to tree_jobs at a time with the
+ * caller as one of the workers; a worker that cannot be started just
+ * leaves more for the others.
+ */
+void
+tree_read(int fd, struct leaf * leaves, int count)
+{
+    struct crew c;
+    pthread_t * threads = calloc(tree_jobs, sizeof(pthread_t));
+    int n = 0;
+
+    c.fd = fd;
+    c.leaves = leaves;
+    c.count = count;
+    c.next = 0;
+    pthread_mutex_init(&c.lock, 0);
+
+    while(0 != threads && n + 1 < tree_jobs && n + 1 < count &&
+            0 == pthread_create(&threads[n], 0, leaf_worker, &c)) {
+        n++;
+    }
+
+    leaf_worker(&c);
+
+    while(n > 0) {
+        pthread_join(threads[--n], 0);
+    }
+
+    pthread_mutex_destroy(&c.lock);
+    free(threads);
+}
+
+void
+tree_release(struct leaf * l)
+{
+    pool_put(l->buf);
+    free(l->ends);
+    free(l->ids);
+    l->buf = 0;
+    l->ends = 0;
+    l->ids = 0;
+    l->nchunks = 0;
+}
+
+/* the file's digest from the digests of its leaves, in order */
+void
+tree_root(const unsigned char * digests, size_t count, off_t size, unsigned char * digest)
+{
+    union hash_state root;
+    unsigned char tail[16];
+
+    for(int i = 0; i < 8; i++) {
+        tail[i] = (unsigned char)((uint64_t)size >> (8 * i));
+        tail[8 + i] = (unsigned char)((uint64_t)tree_leaf >> (8 * i));
+    }
+
+    hash_engine->init(&root);
+    hash_engine->update(&root, digests, count * hash_engine->size);
+    hash_engine->update(&root, tail, sizeof(tail));
+    hash_engine->final(&root, digest);
+}
@@ -0,0 +1,41 @@
+#ifndef _SRC_TREE_H_
+#define _SRC_TREE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+/* leaf size in bytes; files larger than one leaf are tree hashed, 0 turns it off */
+extern size_t tree_leaf;
+extern int tree_jobs;
+
+extern const size_t TREE_BUDGET;
+
+/*
+ * One leaf of a tree-hashed file.  tree_read() fills in buf, digest and,
+ * with content-defined chunking, the chunk ends and digests of the leaf;
+ * a leaf marked reuse is skipped and keeps the digest it came with.
+ */
+struct leaf {
+    off_t off;
+    size_t len;
+    int reuse;
+    int error;
+    char * buf;
+    size_t nchunks;
+    size_t * ends;
+    struct hash_key * ids;
+    uint64_t extents;
+    unsigned char digest[HASH_MAX];
+};
+
+int tree_tune(const char * const);
+int tree_spec(char *, size_t);
+int tree_trusted(int);
+uint64_t tree_extents(int, off_t, size_t);
+void tree_read(int, struct leaf *, int);
+void tree_release(struct leaf *);
+void tree_root(const unsigned char *, size_t, off_t, unsigned char *);
+
+#endif /*_SRC_TREE_H_*/
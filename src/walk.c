@@ -0,0 +1,1132 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "walk.h"
+
+#if defined(__linux__) && defined(SYS_getdents64) && defined(STATX_BASIC_STATS)
+#define WALK_GETDENTS
+#endif
+
+#if defined(__APPLE__)
+#define ST_MTIM st_mtimespec
+#define ST_CTIM st_ctimespec
+#else
+#define ST_MTIM st_mtim
+#define ST_CTIM st_ctim
+#endif
+
+int walk_jobs = 1;
+const struct walk_filter * walk_filter = 0;
+const char * walk_base = 0;
+const char * walk_after = 0;
+
+const size_t WALK_BATCH = 4096;
+const size_t WALK_AHEAD = 4096;
+const size_t WALK_DENTS = 64 * 1024;
+const size_t WALK_NAMES = 64 * 1024;
+
+/*
+ * The walk is split in two halves.  Worker threads read directories and
+ * stat their entries in any order, each from its own deque, stealing from
+ * the others when it runs dry.  Every subdirectory becomes a task, and a
+ * directory with more than WALK_BATCH entries is handed out as several
+ * stealable ranges so a single huge directory is stat'ed by every worker.
+ *
+ * The calling thread is the consumer: it visits the tree in preorder with
+ * the entries of each directory sorted by name, waiting for (or doing)
+ * the work it needs next.  The callback therefore sees the same sequence
+ * no matter how many workers there are or how they were scheduled.
+ */
+
+enum {
+    WD_QUEUED,
+    WD_CLAIMED,
+    WD_READY,
+};
+
+struct wdir;
+
+struct went {
+    struct walk_entry e;
+    char * name;
+    unsigned char dtype;
+    unsigned char hide;
+    struct wdir * child;
+};
+
+/* names are packed into shared blocks instead of one allocation each */
+struct wnames {
+    struct wnames * next;
+    size_t used;
+    size_t cap;
+    char buf[];
+};
+
+struct wtask {
+    struct wtask * next;
+    struct wdir * dir;
+    struct went * ents;
+    struct wnames * names;
+    size_t n;
+    int claimed;
+};
+
+/* one pass over a directory, handing back a name at a time */
+struct wscan {
+#if defined(WALK_GETDENTS)
+    char * buf;
+    long pos;
+    long len;
+#else
+    DIR * dp;
+#endif
+    int fd;
+};
+
+struct wdir {
+    char * path;
+    int depth;
+    dev_t dev;
+    dev_t updev;
+    int state;
+    int error;
+    int refs;
+    size_t busy;
+    int fd;
+#if !defined(WALK_GETDENTS)
+    DIR * dp;
+#endif
+    struct went * ents;
+    struct wnames * names;
+    size_t n;
+    size_t cap;
+    struct wtask task;
+    struct wtask * ranges;
+};
+
+struct wdeque {
+    pthread_mutex_t lock;
+    struct wtask ** buf;
+    size_t top;
+    size_t bottom;
+    size_t cap;
+};
+
+struct walker {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t room;
+    pthread_cond_t ready;
+    int stop;
+    int jobs;
+    size_t queued;
+    size_t ahead;
+    struct wdeque * q;
+    pthread_t * threads;
+    walk_fn fn;
+    void * arg;
+    const struct walk_filter * filter;
+    const char * after;
+    size_t root_len;
+};
+
+struct wslot {
+    struct walker * w;
+    int self;
+};
+
+static int
+mode_type(mode_t mode)
+{
+    if(S_ISREG(mode)) {
+        return WALK_F;
+    }
+
+    if(S_ISDIR(mode)) {
+        return WALK_D;
+    }
+
+    if(S_ISLNK(mode)) {
+        return WALK_SL;
+    }
+
+    return WALK_OTHER;
+}
+
+static void
+fill_entry(struct walk_entry * e, const struct stat * st)
+{
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mode = st->st_mode;
+    e->nlink = st->st_nlink;
+    e->size = st->st_size;
+    e->mtime_ns = (int64_t)st->ST_MTIM.tv_sec * 1000000000 + st->ST_MTIM.tv_nsec;
+    e->ctime_ns = (int64_t)st->ST_CTIM.tv_sec * 1000000000 + st->ST_CTIM.tv_nsec;
+    e->type = mode_type(st->st_mode);
+}
+
+static char *
+keep_name(struct wnames ** np, const char * const name)
+{
+    size_t len = strlen(name) + 1;
+    struct wnames * b = *np;
+
+    if(0 == b || b->cap - b->used < len) {
+        size_t cap = len > WALK_NAMES ? len : WALK_NAMES;
+
+        if(0 == (b = malloc(sizeof(struct wnames) + cap))) {
+            return 0;
+        }
+
+        b->next = *np;
+        b->used = 0;
+        b->cap = cap;
+        *np = b;
+    }
+
+    char * p = memcpy(b->buf + b->used, name, len);
+    b->used += len;
+    return p;
+}
+
+static void
+free_names(struct wnames * b)
+{
+    while(0 != b) {
+        struct wnames * next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+static struct wnames *
+splice_names(struct wnames * from, struct wnames * to)
+{
+    struct wnames * b = from;
+
+    if(0 == b) {
+        return to;
+    }
+
+    while(0 != b->next) {
+        b = b->next;
+    }
+
+    b->next = to;
+    return from;
+}
+
+static char *
+join_path(const char * const dir, const char * const name)
+{
+    size_t dlen = strlen(dir);
+    size_t nlen = strlen(name);
+    int slash = dlen > 0 && '/' != dir[dlen - 1];
+    char * p = malloc(dlen + slash + nlen + 1);
+
+    if(0 == p) {
+        return 0;
+    }
+
+    memcpy(p, dir, dlen);
+
+    if(slash) {
+        p[dlen] = '/';
+    }
+
+    memcpy(p + dlen + slash, name, nlen + 1);
+    return p;
+}
+
+/* the directory's path below the walk root, "" for the root itself */
+static const char *
+rel_path(const struct walker * w, const struct wdir * d)
+{
+    const char * rel = d->path + w->root_len;
+
+    while('/' == *rel) {
+        rel++;
+    }
+
+    return rel;
+}
+
+/*
+ * Entries come out in sorted preorder, so everything before walk_after is
+ * exactly the names that sort below its component in each directory on the
+ * way down to it.  Returns that component for d, or 0 when d is not one of
+ * those directories and has to be read in full.
+ */
+static const char *
+resume_at(const struct walker * w, const struct wdir * d, size_t * len)
+{
+    const char * rel = rel_path(w, d);
+    const char * after = w->after;
+    size_t rlen = strlen(rel);
+
+    if(0 == after || '\0' == *after) {
+        return 0;
+    }
+
+    if(rlen > 0) {
+        if(0 != strncmp(after, rel, rlen) || '/' != after[rlen]) {
+            return 0;
+        }
+
+        after += rlen + 1;
+    }
+
+    *len = strcspn(after, "/");
+    return after;
+}
+
+static struct wdir *
+new_dir(char * path, int depth)
+{
+    struct wdir * d = calloc(1, sizeof(struct wdir));
+
+    if(0 == d) {
+        return 0;
+    }
+
+    d->path = path;
+    d->depth = depth;
+    d->state = WD_QUEUED;
+    d->refs = 1;
+    d->fd = -1;
+    d->task.dir = d;
+    return d;
+}
+
+static void
+close_dir(struct wdir * d)
+{
+#if defined(WALK_GETDENTS)
+
+    if(d->fd >= 0) {
+        close(d->fd);
+    }
+
+#else
+
+    if(0 != d->dp) {
+        closedir(d->dp);
+        d->dp = 0;
+    }
+
+#endif
+    d->fd = -1;
+}
+
+#if defined(WALK_GETDENTS)
+
+struct wdent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int
+open_scan(struct wdir * d, struct wscan * s)
+{
+    d->fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if(d->fd < 0) {
+        return -1;
+    }
+
+    s->fd = d->fd;
+    s->pos = s->len = 0;
+
+    if(0 == (s->buf = malloc(WALK_DENTS))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static const char *
+next_name(struct wscan * s, unsigned char * dtype)
+{
+    for(;;) {
+        if(s->pos >= s->len) {
+            s->len = syscall(SYS_getdents64, s->fd, s->buf, WALK_DENTS);
+            s->pos = 0;
+
+            if(s->len <= 0) {
+                return 0;
+            }
+        }
+
+        struct wdent * de = (struct wdent *)(s->buf + s->pos);
+        s->pos += de->d_reclen;
+
+        if('.' == de->d_name[0] && ('\0' == de->d_name[1] ||
+                                    ('.' == de->d_name[1] && '\0' == de->d_name[2]))) {
+            continue;
+        }
+
+        *dtype = de->d_type;
+        return de->d_name;
+    }
+}
+
+static void
+close_scan(struct wscan * s)
+{
+    free(s->buf);
+}
+
+static const unsigned int WALK_STATX =
+    STATX_TYPE | STATX_MODE | STATX_INO | STATX_NLINK | STATX_SIZE |
+    STATX_MTIME | STATX_CTIME;
+
+/*
+ * d_type is enough for everything but regular files, which need their
+ * size; statx is only asked for the fields the indexer uses, and never
+ * has to sync with a network server to answer.
+ */
+static int
+stat_entry(int fd, struct went * t)
+{
+    struct statx sx;
+
+    switch(t->dtype) {
+    case DT_DIR:
+        t->e.type = WALK_D;
+        return 0;
+
+    case DT_LNK:
+        t->e.type = WALK_SL;
+        return 0;
+
+    case DT_FIFO:
+    case DT_CHR:
+    case DT_BLK:
+    case DT_SOCK:
+        t->e.type = WALK_OTHER;
+        return 0;
+    }
+
+    if(0 != statx(fd, t->name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                  WALK_STATX, &sx)) {
+        struct stat st;
+
+        if(ENOSYS != errno || 0 != fstatat(fd, t->name, &st, AT_SYMLINK_NOFOLLOW)) {
+            return -1;
+        }
+
+        fill_entry(&t->e, &st);
+        return 0;
+    }
+
+    t->e.dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+    t->e.ino = sx.stx_ino;
+    t->e.mode = sx.stx_mode;
+    t->e.nlink = sx.stx_nlink;
+    t->e.size = sx.stx_size;
+    t->e.mtime_ns = (int64_t)sx.stx_mtime.tv_sec * 1000000000 + sx.stx_mtime.tv_nsec;
+    t->e.ctime_ns = (int64_t)sx.stx_ctime.tv_sec * 1000000000 + sx.stx_ctime.tv_nsec;
+    t->e.type = mode_type(sx.stx_mode);
+    return 0;
+}
+
+#else /* WALK_GETDENTS */
+
+static int
+open_scan(struct wdir * d, struct wscan * s)
+{
+    if(0 == (d->dp = opendir(d->path))) {
+        return -1;
+    }
+
+    d->fd = dirfd(d->dp);
+    s->dp = d->dp;
+    s->fd = d->fd;
+    return 0;
+}
+
+static const char *
+next_name(struct wscan * s, unsigned char * dtype)
+{
+    struct dirent * de;
+
+    while(0 != (de = readdir(s->dp))) {
+        if(0 != strcmp(de->d_name, ".") && 0 != strcmp(de->d_name, "..")) {
+            *dtype = 0;
+            return de->d_name;
+        }
+    }
+
+    return 0;
+}
+
+static void
+close_scan(struct wscan * s)
+{
+}
+
+static int
+stat_entry(int fd, struct went * t)
+{
+    struct stat st;
+
+    if(0 != fstatat(fd, t->name, &st, AT_SYMLINK_NOFOLLOW)) {
+        return -1;
+    }
+
+    fill_entry(&t->e, &st);
+    return 0;
+}
+
+#endif /* WALK_GETDENTS */
+
+/* called with w->lock held */
+static void
+unref_dir(struct walker * w, struct wdir * d)
+{
+    if(0 != --d->refs) {
+        return;
+    }
+
+    while(0 != d->ranges) {
+        struct wtask * t = d->ranges;
+        d->ranges = t->next;
+        free_names(t->names);
+        free(t->ents);
+        free(t);
+    }
+
+    for(size_t i = 0; i < d->n; i++) {
+        if(0 != d->ents[i].child) {
+            unref_dir(w, d->ents[i].child);
+        }
+    }
+
+    close_dir(d);
+    free_names(d->names);
+    free(d->ents);
+    free(d->path);
+    free(d);
+}
+
+/* -1 if the deque cannot grow to take t, which is then left to the caller */
+static int
+deque_push(struct walker * w, int self, struct wtask * t)
+{
+    struct wdeque * q = &w->q[self];
+
+    pthread_mutex_lock(&q->lock);
+
+    if(q->bottom - q->top == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 64;
+        struct wtask ** buf = malloc(cap * sizeof(struct wtask *));
+
+        if(0 == buf) {
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+
+        for(size_t i = q->top; i < q->bottom; i++) {
+            buf[i - q->top] = q->buf[i % q->cap];
+        }
+
+        free(q->buf);
+        q->buf = buf;
+        q->bottom -= q->top;
+        q->top = 0;
+        q->cap = cap;
+    }
+
+    // counted before it can be taken, so a worker never unrefs it first
+    pthread_mutex_lock(&w->lock);
+    t->dir->refs++;
+    w->queued++;
+    pthread_mutex_unlock(&w->lock);
+
+    q->buf[q->bottom++ % q->cap] = t;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+static struct wtask *
+deque_take(struct walker * w, int victim, int steal)
+{
+    struct wdeque * q = &w->q[victim];
+    struct wtask * t = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    if(q->bottom != q->top) {
+        if(steal) {
+            t = q->buf[q->top++ % q->cap];
+        } else {
+            t = q->buf[--q->bottom % q->cap];
+        }
+    }
+
+    pthread_mutex_unlock(&q->lock);
+    return t;
+}
+
+static int claim_task(struct wtask *);
+static void run_task(struct walker *, struct wtask *, int);
+
+/* queues t for the workers, or runs it here when it cannot be queued */
+static void
+push_task(struct walker * w, int self, struct wtask * t)
+{
+    int mine;
+
+    if(0 == deque_push(w, self, t)) {
+        return;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    mine = claim_task(t);
+    pthread_mutex_unlock(&w->lock);
+
+    if(mine) {
+        run_task(w, t, self);
+    }
+}
+
+static int
+cmp_went(const void * a, const void * b)
+{
+    return strcmp(((const struct went *)a)->name, ((const struct went *)b)->name);
+}
+
+/* called with w->lock held; the last one out sorts without holding it */
+static void
+finish_dir(struct walker * w, struct wdir * d)
+{
+    if(0 != --d->busy) {
+        return;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    qsort(d->ents, d->n, sizeof(struct went), cmp_went);
+    close_dir(d);
+
+    pthread_mutex_lock(&w->lock);
+    d->state = WD_READY;
+    w->ahead++;
+    pthread_cond_broadcast(&w->ready);
+}
+
+static void
+stat_range(struct walker * w, struct wdir * d, struct went * ents, size_t n,
+           struct wnames * names, int self)
+{
+    const struct walk_filter * f = w->filter;
+
+    for(size_t i = 0; i < n; i++) {
+        struct went * t = &ents[i];
+        int verdict = WALK_KEEP;
+
+        t->e.depth = d->depth + 1;
+
+        if(0 != stat_entry(d->fd, t)) {
+            t->e.type = WALK_NS;
+            continue;
+        }
+
+        if(0 != f && 0 != f->entry) {
+            verdict = f->entry(rel_path(w, d), t->name, &t->e, f->arg);
+            t->hide = WALK_HIDE == verdict || WALK_SKIP == verdict;
+        }
+
+        if(WALK_D == t->e.type && WALK_PRUNE != verdict && WALK_SKIP != verdict) {
+            t->child = new_dir(join_path(d->path, t->name), d->depth + 1);
+
+            if(0 != t->child && 0 == t->child->path) {
+                free(t->child);
+                t->child = 0;
+            }
+
+            if(0 == t->child) {
+                t->e.type = WALK_DNR;
+                continue;
+            }
+
+            t->child->updev = d->dev;
+
+            if(w->jobs > 0) {
+                push_task(w, self, &t->child->task);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    if(d->n + n > d->cap) {
+        size_t cap = d->n + n > d->cap * 2 ? d->n + n : d->cap * 2;
+        struct went * grown = realloc(d->ents, cap * sizeof(struct went));
+
+        // the range is dropped and the directory reported as not read; a
+        // subdirectory no worker has started is claimed so none reads it
+        if(0 == grown) {
+            for(size_t i = 0; i < n; i++) {
+                if(0 != ents[i].child) {
+                    claim_task(&ents[i].child->task);
+                    unref_dir(w, ents[i].child);
+                }
+            }
+
+            d->error = errno = ENOMEM;
+            n = 0;
+        } else {
+            d->ents = grown;
+            d->cap = cap;
+        }
+    }
+
+    if(n > 0) {
+        memcpy(d->ents + d->n, ents, n * sizeof(struct went));
+        d->n += n;
+    }
+
+    d->names = splice_names(names, d->names);
+
+    finish_dir(w, d);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Names are read WALK_BATCH at a time into a fixed-size getdents buffer;
+ * each full batch is stat'ed inline or handed out as a range task.
+ */
+static void
+read_dir(struct walker * w, struct wdir * d, int self)
+{
+    const struct walk_filter * f = w->filter;
+    struct wscan s = {0};
+    struct stat st;
+    struct went * batch = 0;
+    struct wnames * names = 0;
+    const char * name;
+    const char * at;
+    unsigned char dtype;
+    size_t n = 0;
+    size_t at_len = 0;
+
+    pthread_mutex_lock(&w->lock);
+    d->busy = 1;
+    pthread_mutex_unlock(&w->lock);
+
+    if(0 != open_scan(d, &s)) {
+        pthread_mutex_lock(&w->lock);
+        d->error = errno ? errno : EIO;
+        finish_dir(w, d);
+        pthread_mutex_unlock(&w->lock);
+        close_scan(&s);
+        return;
+    }
+
+    // a mount point is still reported, only its contents are left out
+    if(0 != f && f->xdev && 0 == fstat(s.fd, &st)) {
+        d->dev = st.st_dev;
+
+        if(d->dev != d->updev) {
+            close_scan(&s);
+            pthread_mutex_lock(&w->lock);
+            finish_dir(w, d);
+            pthread_mutex_unlock(&w->lock);
+            return;
+        }
+    }
+
+    batch = calloc(WALK_BATCH, sizeof(struct went));
+    at = resume_at(w, d, &at_len);
+
+    while(0 != batch && !w->stop && 0 != (name = next_name(&s, &dtype))) {
+        // the component itself is walked again; its own entry is a no-op rewrite
+        if(0 != at && strncmp(name, at, at_len) < 0) {
+            continue;
+        }
+
+        if(0 != f && 0 != f->name && f->name(rel_path(w, d), name, d->depth + 1, f->arg)) {
+            continue;
+        }
+
+        if(0 == (batch[n].name = keep_name(&names, name))) {
+            break;
+        }
+
+        batch[n].dtype = dtype;
+
+        if(++n < WALK_BATCH) {
+            continue;
+        }
+
+        struct wtask * t = calloc(1, sizeof(struct wtask));
+
+        if(0 == t || w->jobs == 0) {
+            free(t);
+            pthread_mutex_lock(&w->lock);
+            d->busy++;
+            pthread_mutex_unlock(&w->lock);
+            stat_range(w, d, batch, n, names, self);
+            memset(batch, 0, WALK_BATCH * sizeof(struct went));
+            names = 0;
+            n = 0;
+            continue;
+        }
+
+        t->dir = d;
+        t->ents = batch;
+        t->names = names;
+        t->n = n;
+        pthread_mutex_lock(&w->lock);
+        d->busy++;
+        t->next = d->ranges;
+        d->ranges = t;
+        pthread_mutex_unlock(&w->lock);
+        push_task(w, self, t);
+
+        batch = calloc(WALK_BATCH, sizeof(struct went));
+        names = 0;
+        n = 0;
+    }
+
+    close_scan(&s);
+    pthread_mutex_lock(&w->lock);
+    d->busy++;
+    pthread_mutex_unlock(&w->lock);
+    stat_range(w, d, batch, n, names, self);
+    free(batch);
+
+    pthread_mutex_lock(&w->lock);
+    finish_dir(w, d);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* claims the task for the caller; called with w->lock held */
+static int
+claim_task(struct wtask * t)
+{
+    if(t == &t->dir->task) {
+        if(WD_QUEUED != t->dir->state) {
+            return 0;
+        }
+
+        t->dir->state = WD_CLAIMED;
+        return 1;
+    }
+
+    if(t->claimed) {
+        return 0;
+    }
+
+    t->claimed = 1;
+    return 1;
+}
+
+static void
+run_task(struct walker * w, struct wtask * t, int self)
+{
+    if(t == &t->dir->task) {
+        read_dir(w, t->dir, self);
+    } else {
+        stat_range(w, t->dir, t->ents, t->n, t->names, self);
+        free(t->ents);
+        t->ents = 0;
+        t->names = 0;
+    }
+}
+
+static void *
+walk_worker(void * arg)
+{
+    struct wslot * s = arg;
+    struct walker * w = s->w;
+
+    for(;;) {
+        struct wtask * t = deque_take(w, s->self, 0);
+
+        for(int i = 1; 0 == t && i <= w->jobs; i++) {
+            t = deque_take(w, (s->self + i) % (w->jobs + 1), 1);
+        }
+
+        pthread_mutex_lock(&w->lock);
+
+        if(0 == t) {
+            if(w->stop) {
+                pthread_mutex_unlock(&w->lock);
+                break;
+            }
+
+            if(0 == w->queued) {
+                pthread_cond_wait(&w->work, &w->lock);
+            }
+
+            pthread_mutex_unlock(&w->lock);
+            continue;
+        }
+
+        w->queued--;
+
+        while(t == &t->dir->task && w->ahead >= WALK_AHEAD && !w->stop) {
+            pthread_cond_wait(&w->room, &w->lock);
+        }
+
+        int mine = !w->stop && claim_task(t);
+        pthread_mutex_unlock(&w->lock);
+
+        if(mine) {
+            run_task(w, t, s->self);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        unref_dir(w, t->dir);
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return 0;
+}
+
+/* runs whatever d still needs on the consumer thread, or waits for it */
+static void
+wait_dir(struct walker * w, struct wdir * d)
+{
+    pthread_mutex_lock(&w->lock);
+
+    while(WD_READY != d->state) {
+        struct wtask * t = &d->task;
+
+        if(WD_QUEUED != d->state) {
+            for(t = d->ranges; 0 != t && t->claimed; t = t->next) {
+                ;
+            }
+        }
+
+        if(0 != t && claim_task(t)) {
+            pthread_mutex_unlock(&w->lock);
+            run_task(w, t, w->jobs);
+            pthread_mutex_lock(&w->lock);
+            continue;
+        }
+
+        pthread_cond_wait(&w->ready, &w->lock);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void
+stop_workers(struct walker * w)
+{
+    pthread_mutex_lock(&w->lock);
+
+    if(w->stop) {
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+
+    w->stop = 1;
+    pthread_cond_broadcast(&w->work);
+    pthread_cond_broadcast(&w->room);
+    pthread_mutex_unlock(&w->lock);
+
+    for(int i = 0; i < w->jobs; i++) {
+        pthread_join(w->threads[i], 0);
+    }
+
+    for(int i = 0; i <= w->jobs; i++) {
+        struct wtask * t;
+
+        while(0 != (t = deque_take(w, i, 0))) {
+            pthread_mutex_lock(&w->lock);
+            unref_dir(w, t->dir);
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+}
+
+static int
+emit_dir(struct walker * w, struct wdir * d, struct walk_entry * e, int hide)
+{
+    int rc = 0;
+
+    wait_dir(w, d);
+    e->path = d->path;
+
+    if(0 != d->error) {
+        e->type = WALK_DNR;
+    }
+
+    if(!hide) {
+        rc = w->fn(e, w->arg);
+    }
+
+    for(size_t i = 0; 0 == rc && i < d->n; i++) {
+        struct went * t = &d->ents[i];
+        char * path = 0;
+
+        if(0 != t->child) {
+            rc = emit_dir(w, t->child, &t->e, t->hide);
+            pthread_mutex_lock(&w->lock);
+            unref_dir(w, t->child);
+            t->child = 0;
+            pthread_mutex_unlock(&w->lock);
+            continue;
+        }
+
+        if(t->hide) {
+            continue;
+        }
+
+        if(0 == (path = join_path(d->path, t->name))) {
+            rc = errno = ENOMEM;
+            break;
+        }
+
+        t->e.path = path;
+        rc = w->fn(&t->e, w->arg);
+        free(path);
+    }
+
+    if(0 != rc) {
+        stop_workers(w);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->ahead--;
+    pthread_cond_signal(&w->room);
+    pthread_mutex_unlock(&w->lock);
+    return rc;
+}
+
+int
+walk_tree(const char * const root, walk_fn fn, void * arg)
+{
+    struct walker w = {0};
+    struct walk_entry e = {0};
+    struct stat st;
+    size_t base_len = strlen(root);
+    int verdict = WALK_KEEP;
+    int rc = 0;
+    int nq = 0;
+
+    if(0 != lstat(root, &st)) {
+        return -1;
+    }
+
+    e.path = root;
+    fill_entry(&e, &st);
+
+    if(0 != walk_base && 0 == strncmp(root, walk_base, strlen(walk_base)) &&
+            '/' == root[strlen(walk_base)]) {
+        base_len = strlen(walk_base);
+
+        for(const char * p = root + base_len; '\0' != *p; p++) {
+            e.depth += '/' == p[0] && '/' != p[1] && '\0' != p[1];
+        }
+    }
+
+    if(0 != walk_filter && 0 != walk_filter->entry) {
+        char * dir = strdup(root + base_len);
+        char * name = 0 != dir ? strrchr(dir, '/') : 0;
+
+        if(0 == name) {
+            verdict = walk_filter->entry("", root, &e, walk_filter->arg);
+        } else {
+            *name++ = '\0';
+            verdict = walk_filter->entry(dir + strspn(dir, "/"), name, &e, walk_filter->arg);
+        }
+
+        free(dir);
+    }
+
+    if(WALK_D != e.type) {
+        return WALK_HIDE == verdict || WALK_SKIP == verdict ? 0 : fn(&e, arg);
+    }
+
+    struct wdir * d = new_dir(strdup(root), e.depth);
+
+    if(0 == d || 0 == d->path) {
+        free(d);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    d->updev = st.st_dev;
+    w.fn = fn;
+    w.arg = arg;
+    w.filter = walk_filter;
+    w.after = walk_after;
+    w.root_len = base_len;
+    w.jobs = walk_jobs > 0 ? walk_jobs : 0;
+    nq = w.jobs + 1;
+    w.q = calloc(nq, sizeof(struct wdeque));
+    w.threads = calloc(nq, sizeof(pthread_t));
+    pthread_mutex_init(&w.lock, 0);
+    pthread_cond_init(&w.work, 0);
+    pthread_cond_init(&w.room, 0);
+    pthread_cond_init(&w.ready, 0);
+
+    for(int i = 0; i < nq; i++) {
+        pthread_mutex_init(&w.q[i].lock, 0);
+    }
+
+    struct wslot * slots = calloc(nq, sizeof(struct wslot));
+
+    for(int i = 0; i < w.jobs; i++) {
+        slots[i].w = &w;
+        slots[i].self = i;
+
+        // only those started are joined; the consumer then walks alone
+        if(0 != pthread_create(&w.threads[i], 0, walk_worker, &slots[i])) {
+            w.jobs = i;
+            stop_workers(&w);
+            w.stop = 0;
+            w.jobs = 0;
+            break;
+        }
+    }
+
+    // the root is always read; a verdict on it only decides whether it is reported
+    rc = emit_dir(&w, d, &e, WALK_HIDE == verdict || WALK_SKIP == verdict);
+    stop_workers(&w);
+
+    pthread_mutex_lock(&w.lock);
+    unref_dir(&w, d);
+    pthread_mutex_unlock(&w.lock);
+
+    for(int i = 0; i < nq; i++) {
+        pthread_mutex_destroy(&w.q[i].lock);
+        free(w.q[i].buf);
+    }
+
+    pthread_cond_destroy(&w.ready);
+    pthread_cond_destroy(&w.room);
+    pthread_cond_destroy(&w.work);
+    pthread_mutex_destroy(&w.lock);
+    free(slots);
+    free(w.threads);
+    free(w.q);
+    return rc;
+}
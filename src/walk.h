@@ -0,0 +1,70 @@
+#ifndef _SRC_WALK_H_
+#define _SRC_WALK_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+enum walk_type {
+    WALK_F,         // regular file
+    WALK_D,         // directory, reported before its contents
+    WALK_DNR,       // directory that could not be read
+    WALK_SL,        // symbolic link, never followed
+    WALK_NS,        // stat failed
+    WALK_OTHER,     // fifo, socket or device node; never opened
+};
+
+struct walk_entry {
+    const char * path;
+    int type;
+    int depth;
+    dev_t dev;
+    ino_t ino;
+    mode_t mode;
+    nlink_t nlink;
+    off_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+};
+
+typedef int (*walk_fn)(const struct walk_entry * const, void *);
+
+enum walk_verdict {
+    WALK_KEEP,      // report it and, for a directory, descend
+    WALK_HIDE,      // do not report it, but still descend
+    WALK_PRUNE,     // report it, but do not descend
+    WALK_SKIP,      // neither
+};
+
+/*
+ * Consulted by the workers while reading directories, so both hooks must
+ * be safe to call concurrently.  Paths are relative to the walk root.
+ * `name` sees a directory's path and an entry's name before the entry is
+ * stat'ed and returns nonzero to drop it; `entry` returns a walk_verdict
+ * once the stat is known.  With `xdev` set, directories on another device
+ * than their parent are reported but not read.  When a walk starts below
+ * `walk_base`, paths and depths are measured from there instead, so a
+ * subtree is filtered exactly as it would be in a walk of the whole base.
+ *
+ * With `walk_after` set to such a relative path, every entry that the walk
+ * would have reported before it is skipped without being stat'ed.
+ */
+struct walk_filter {
+    int (*name)(const char * const, const char * const, int, void *);
+    int (*entry)(const char * const, const char * const, const struct walk_entry * const, void *);
+    int xdev;
+    void * arg;
+};
+
+extern int walk_jobs;
+extern const struct walk_filter * walk_filter;
+extern const char * walk_base;
+extern const char * walk_after;
+
+extern const size_t WALK_BATCH;
+extern const size_t WALK_AHEAD;
+extern const size_t WALK_DENTS;
+extern const size_t WALK_NAMES;
+
+int walk_tree(const char * const, walk_fn, void *);
+
+#endif /*_SRC_WALK_H_*/
@@ -0,0 +1,713 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#define WATCH_NOTIFY
+#endif
+
+#include "index.h"
+#include "table.h"
+#include "walk.h"
+#include "watch.h"
+#include "fnv/fnv.h"
+#include "sqlite/sqlite3.h"
+
+const int WATCH_QUIET_MS = 200;
+const int WATCH_MAX_MS = 2000;
+const int WATCH_POLL_MS = 10000;
+
+static const size_t WATCH_RUN = 32;
+
+/*
+ * Keeps the index current after the initial scan.  Notifications only
+ * name paths; those are coalesced into a dirty set and, once the tree has
+ * been quiet for WATCH_QUIET_MS or WATCH_MAX_MS after the first event,
+ * reconciled in a single transaction: vanished paths lose their rows and
+ * everything else is walked again incrementally, so only files whose stat
+ * changed are hashed.  fanotify covers the whole filesystem with one mark;
+ * inotify needs a watch on every directory; failing both, the root is
+ * rescanned every WATCH_POLL_MS.
+ */
+
+enum {
+    WATCH_FANOTIFY,
+    WATCH_INOTIFY,
+    WATCH_POLL,
+};
+
+struct wwatch {
+    int wd;
+    char * path;
+};
+
+struct watcher {
+    int kind;
+    int fd;
+    int mount_fd;
+    char * root;
+    size_t root_len;
+    char * db;
+    size_t db_len;
+    struct table dirty;
+    char ** paths;
+    size_t n;
+    size_t cap;
+    struct table wds;
+    int64_t first;
+    int64_t last;
+};
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void
+on_signal(int sig)
+{
+    watch_stop = sig;
+}
+
+static int64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+path_match(const void * val, const void * arg)
+{
+    return 0 == strcmp((const char *)val, (const char *)arg);
+}
+
+static int
+path_cmp(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int
+below(const char * const path, const char * const dir, size_t len)
+{
+    return 0 == strncmp(path, dir, len) &&
+           ('\0' == path[len] || '/' == path[len] || (len > 0 && '/' == dir[len - 1]));
+}
+
+static char *
+join(const char * const dir, const char * const name)
+{
+    size_t len = strlen(dir) + 1 + strlen(name) + 1;
+    char * path = malloc(len);
+
+    if(0 != path) {
+        snprintf(path, len, "%s/%s", dir, name);
+    }
+
+    return path;
+}
+
+/* true when a rule drops path or a directory above it, as a full walk would */
+static int
+filtered(const struct watcher * w, const char * const path)
+{
+    const struct walk_filter * f = walk_filter;
+    char * rel;
+    char * name;
+    int depth = 0;
+    int drop = 0;
+
+    if(0 == f || 0 == f->name || 0 == (rel = strdup(path + w->root_len))) {
+        return 0;
+    }
+
+    name = rel + strspn(rel, "/");
+
+    while(!drop && '\0' != *name) {
+        char * slash = strchr(name, '/');
+
+        if(0 != slash) {
+            *slash = '\0';
+        }
+
+        if(name > rel) {
+            name[-1] = '\0';
+        }
+
+        drop = f->name(name > rel ? rel + strspn(rel, "/") : "", name, ++depth, f->arg);
+
+        if(name > rel) {
+            name[-1] = '/';
+        }
+
+        if(0 == slash) {
+            break;
+        }
+
+        *slash = '/';
+        name = slash + 1;
+    }
+
+    free(rel);
+    return drop;
+}
+
+/* queues path for the next flush; the database and its journals never are */
+static void
+mark_dirty(struct watcher * w, const char * const path)
+{
+    Fnv64_t key;
+    char * copy;
+
+    if(!below(path, w->root, w->root_len) || filtered(w, path)) {
+        return;
+    }
+
+    if(0 != w->db && 0 == strncmp(path, w->db, w->db_len) &&
+            ('\0' == path[w->db_len] || '-' == path[w->db_len])) {
+        return;
+    }
+
+    w->last = now_ms();
+    key = fnv_64a_str((char *)path, FNV1A_64_INIT);
+
+    if(0 != table_get(&w->dirty, key, path_match, path)) {
+        return;
+    }
+
+    if(w->n == w->cap) {
+        size_t cap = w->cap ? 2 * w->cap : 256;
+        char ** paths = realloc(w->paths, cap * sizeof(char *));
+
+        if(0 == paths) {
+            return;
+        }
+
+        w->paths = paths;
+        w->cap = cap;
+    }
+
+    if(0 == (copy = strdup(path)) || 0 != table_put(&w->dirty, key, copy)) {
+        free(copy);
+        return;
+    }
+
+    if(0 == w->n) {
+        w->first = w->last;
+    }
+
+    w->paths[w->n++] = copy;
+}
+
+/* returns 1 when path now stands for everything below it as well */
+static int
+reconcile(const char * const path)
+{
+    struct stat st;
+
+    if(0 != lstat(path, &st)) {
+        if(ENOENT != errno && ENOTDIR != errno) {
+            fprintf(stderr, "Can't stat %s; %s\n", path, strerror(errno));
+            return 0;
+        }
+
+        remove_path(path);
+        return 1;
+    }
+
+    if(0 != process_directory(path)) {
+        fprintf(stderr, "Can't walk dir %s; %s\n", path, strerror(errno));
+    }
+
+    return S_ISDIR(st.st_mode);
+}
+
+/*
+ * Paths are handled in sorted order so a directory that was walked or
+ * removed covers every dirty path below it, and a long run of siblings is
+ * folded into one walk of their parent.
+ */
+static void
+flush(struct watcher * w)
+{
+    const char * cover = 0;
+    char * parent = 0;
+    size_t cover_len = 0;
+    char * zErrMsg = 0;
+
+    if(0 == w->n) {
+        return;
+    }
+
+    qsort(w->paths, w->n, sizeof(char *), path_cmp);
+
+    if(SQLITE_OK != sqlite3_exec(DB, "BEGIN", 0, 0, &zErrMsg)) {
+        fprintf(stderr, "Can't begin transaction; %s\n", zErrMsg);
+        sqlite3_free(zErrMsg);
+        zErrMsg = 0;
+    }
+
+    for(size_t i = 0; i < w->n; i++) {
+        const char * path = w->paths[i];
+        const char * slash = strrchr(path, '/');
+        size_t len = slash ? (size_t)(slash - path) : 0;
+        size_t j = i + 1;
+
+        if(0 != cover && below(path, cover, cover_len)) {
+            continue;
+        }
+
+        while(j < w->n && 0 == strncmp(w->paths[j], path, len) &&
+                '/' == w->paths[j][len] && 0 == strchr(w->paths[j] + len + 1, '/')) {
+            j++;
+        }
+
+        if(j - i >= WATCH_RUN && len >= w->root_len && 0 != (path = strndup(path, len))) {
+            cover = cover == parent ? 0 : cover;
+            free(parent);
+            parent = (char *)path;
+            i = j - 1;
+        }
+
+        if(reconcile(path)) {
+            cover = path;
+            cover_len = strlen(path);
+        }
+    }
+
+    if(SQLITE_OK != sqlite3_exec(DB, "COMMIT", 0, 0, &zErrMsg)) {
+        fprintf(stderr, "Can't commit transaction; %s\n", zErrMsg);
+        sqlite3_free(zErrMsg);
+    }
+
+    free(parent);
+    table_free(&w->dirty, free);
+    w->n = 0;
+    fflush(stdout);
+}
+
+#if defined(WATCH_NOTIFY)
+static const uint64_t FAN_EVENTS =
+    FAN_MODIFY | FAN_ATTRIB | FAN_CLOSE_WRITE | FAN_CREATE | FAN_DELETE |
+    FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE_SELF | FAN_MOVE_SELF | FAN_ONDIR;
+
+static const uint32_t IN_EVENTS =
+    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+/*
+ * A filesystem mark sees every change on the device, so paths outside the
+ * root are dropped in mark_dirty.  With names reported each event points
+ * at the entry itself; with bare file ids a directory event only says
+ * that something in it changed, and the whole directory is walked again.
+ */
+static int
+fan_setup(struct watcher * w)
+{
+    static const unsigned int reports[] = {
+#if defined(FAN_REPORT_DFID_NAME)
+        FAN_REPORT_DFID_NAME,
+#endif
+        FAN_REPORT_FID,
+    };
+
+    for(size_t i = 0; i < sizeof(reports) / sizeof(reports[0]); i++) {
+        int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | reports[i],
+                               O_RDONLY | O_LARGEFILE);
+
+        if(fd < 0) {
+            continue;
+        }
+
+        if(0 == fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_EVENTS,
+                              AT_FDCWD, w->root) &&
+                0 <= (w->mount_fd = open(w->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC))) {
+            w->fd = fd;
+            w->kind = WATCH_FANOTIFY;
+            return 0;
+        }
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+static void
+fan_mark(struct watcher * w, struct file_handle * fh, const char * const name)
+{
+    char link[64];
+    char dir[PATH_MAX];
+    char * path;
+    ssize_t len = 0;
+    int fd;
+
+    // a handle that no longer opens was deleted; its parent's event covers it
+    if(0 > (fd = open_by_handle_at(w->mount_fd, fh, O_PATH | O_CLOEXEC))) {
+        return;
+    }
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    len = readlink(link, dir, sizeof(dir) - 1);
+    close(fd);
+
+    if(len <= 0) {
+        return;
+    }
+
+    dir[len] = '\0';
+
+    if(len > 10 && 0 == strcmp(dir + len - 10, " (deleted)")) {
+        return;
+    }
+
+    if(0 == name || 0 == strcmp(name, ".")) {
+        mark_dirty(w, dir);
+    } else if(0 != (path = join(dir, name))) {
+        mark_dirty(w, path);
+        free(path);
+    }
+}
+
+static int
+fan_read(struct watcher * w)
+{
+    static char buf[64 << 10] __attribute__((aligned(8)));
+    const struct fanotify_event_metadata * m;
+    ssize_t len = 0;
+
+    while(!watch_stop && 0 < (len = read(w->fd, buf, sizeof(buf)))) {
+        for(m = (const void *)buf; FAN_EVENT_OK(m, len); m = FAN_EVENT_NEXT(m, len)) {
+            const char * info = (const char *)(m + 1);
+            const char * end = (const char *)m + m->event_len;
+
+            if(FANOTIFY_METADATA_VERSION != m->vers) {
+                errno = EPROTO;
+                return -1;
+            }
+
+            if(m->mask & FAN_Q_OVERFLOW) {
+                mark_dirty(w, w->root);
+            }
+
+            while(info + sizeof(struct fanotify_event_info_fid) <= end) {
+                const struct fanotify_event_info_fid * fid = (const void *)info;
+                struct file_handle * fh = (struct file_handle *)fid->handle;
+
+                if(0 == fid->hdr.len) {
+                    break;
+                }
+
+                switch(fid->hdr.info_type) {
+#if defined(FAN_EVENT_INFO_TYPE_DFID_NAME)
+                case FAN_EVENT_INFO_TYPE_DFID_NAME:
+                    fan_mark(w, fh, (const char *)fh->f_handle + fh->handle_bytes);
+                    break;
+#endif
+
+                case FAN_EVENT_INFO_TYPE_FID:
+                    fan_mark(w, fh, 0);
+                    break;
+                }
+
+                info += fid->hdr.len;
+            }
+
+            if(m->fd >= 0) {
+                close(m->fd);
+            }
+        }
+    }
+
+    return len < 0 && EAGAIN != errno ? -1 : 0;
+}
+
+static int
+wd_match(const void * val, const void * arg)
+{
+    return ((const struct wwatch *)val)->wd == *(const int *)arg;
+}
+
+static void
+wd_release(void * val)
+{
+    free(((struct wwatch *)val)->path);
+    free(val);
+}
+
+/* a moved directory keeps its descriptor, so the path is refreshed in place */
+static int
+ino_add(const struct walk_entry * const e, void * arg)
+{
+    struct watcher * w = arg;
+    struct wwatch * ww;
+    int wd;
+
+    if(WALK_D != e->type) {
+        return 0;
+    }
+
+    if(0 > (wd = inotify_add_watch(w->fd, e->path, IN_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW))) {
+        if(ENOENT != errno) {
+            fprintf(stderr, "Can't watch dir %s; %s\n", e->path, strerror(errno));
+        }
+
+        return 0;
+    }
+
+    if(0 != (ww = table_get(&w->wds, wd, wd_match, &wd))) {
+        if(0 != strcmp(ww->path, e->path)) {
+            char * path = strdup(e->path);
+
+            if(0 != path) {
+                free(ww->path);
+                ww->path = path;
+            }
+        }
+
+        return 0;
+    }
+
+    if(0 == (ww = malloc(sizeof(struct wwatch))) || 0 == (ww->path = strdup(e->path))) {
+        free(ww);
+        return 0;
+    }
+
+    ww->wd = wd;
+
+    if(0 != table_put(&w->wds, wd, ww)) {
+        wd_release(ww);
+    }
+
+    return 0;
+}
+
+static int
+ino_setup(struct watcher * w)
+{
+    if(0 > (w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC))) {
+        return -1;
+    }
+
+    if(0 != walk_tree(w->root, ino_add, w) || 0 == w->wds.count) {
+        close(w->fd);
+        w->fd = -1;
+        table_free(&w->wds, wd_release);
+        return -1;
+    }
+
+    w->kind = WATCH_INOTIFY;
+    return 0;
+}
+
+static int
+ino_read(struct watcher * w)
+{
+    static char buf[64 << 10] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = 0;
+
+    while(!watch_stop && 0 < (len = read(w->fd, buf, sizeof(buf)))) {
+        const struct inotify_event * ev;
+
+        for(char * p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            struct wwatch * ww;
+            char * path;
+
+            ev = (const struct inotify_event *)p;
+
+            if(ev->mask & IN_Q_OVERFLOW) {
+                walk_tree(w->root, ino_add, w);
+                mark_dirty(w, w->root);
+                continue;
+            }
+
+            if(0 == (ww = table_get(&w->wds, ev->wd, wd_match, &ev->wd))) {
+                continue;
+            }
+
+            if(ev->mask & IN_IGNORED) {
+                ww->wd = -1;
+                continue;
+            }
+
+            if(0 == (path = ev->len ? join(ww->path, ev->name) : strdup(ww->path))) {
+                continue;
+            }
+
+            // watched before the flush walks it, so nothing created in between is lost
+            if((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                walk_tree(path, ino_add, w);
+            }
+
+            mark_dirty(w, path);
+            free(path);
+        }
+    }
+
+    return len < 0 && EAGAIN != errno ? -1 : 0;
+}
+#else
+static int
+fan_setup(struct watcher * w)
+{
+    return -1;
+}
+
+static int
+fan_read(struct watcher * w)
+{
+    return 0;
+}
+
+static int
+ino_setup(struct watcher * w)
+{
+    return -1;
+}
+
+static int
+ino_read(struct watcher * w)
+{
+    return 0;
+}
+
+static void
+wd_release(void * val)
+{
+}
+#endif
+
+static const char *
+watch_engine(const struct watcher * w)
+{
+    switch(w->kind) {
+    case WATCH_FANOTIFY:
+        return "fanotify";
+
+    case WATCH_INOTIFY:
+        return "inotify";
+
+    default:
+        return "polling";
+    }
+}
+
+int
+watch_directory(const char * const dir)
+{
+    struct watcher w = {0};
+    struct sigaction sa = {0};
+    int result = 0;
+
+    if(NULL == dir || '\0' == *dir) {
+        return errno = EINVAL;
+    }
+
+    if(0 == (w.root = realpath(dir, NULL))) {
+        return errno;
+    }
+
+    w.root_len = strlen(w.root);
+    w.fd = -1;
+    w.mount_fd = -1;
+    w.kind = WATCH_POLL;
+
+    if(0 != (w.db = realpath(db_name, NULL))) {
+        w.db_len = strlen(w.db);
+    }
+
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // watch first so nothing that changes during the initial scan is missed
+    if(0 != fan_setup(&w)) {
+        ino_setup(&w);
+    }
+
+    fprintf(stderr, "Watching %s with %s\n", w.root, watch_engine(&w));
+    prune_missing = incremental;
+
+    if(0 != (result = process_directory(dir))) {
+        goto out;
+    }
+
+    fflush(stdout);
+    incremental = 1;
+    prune_missing = 1;
+    walk_base = w.root;
+
+    while(!watch_stop) {
+        int64_t now = now_ms();
+        int timeout = WATCH_POLL == w.kind ? WATCH_POLL_MS : -1;
+        struct pollfd pfd = {w.fd, POLLIN, 0};
+        int ready;
+
+        if(w.n > 0) {
+            int64_t quiet = w.last + WATCH_QUIET_MS - now;
+            int64_t late = w.first + WATCH_MAX_MS - now;
+
+            timeout = quiet < late ? quiet : late;
+            timeout = timeout > 0 ? timeout : 0;
+        }
+
+        if(0 > (ready = poll(&pfd, w.fd < 0 ? 0 : 1, timeout))) {
+            if(EINTR == errno) {
+                continue;
+            }
+
+            result = errno;
+            break;
+        }
+
+        if(ready > 0 && 0 != (WATCH_FANOTIFY == w.kind ? fan_read(&w) : ino_read(&w))) {
+            result = errno;
+            fprintf(stderr, "Can't read events for %s; %s\n", w.root, strerror(errno));
+            break;
+        }
+
+        if(0 == ready && WATCH_POLL == w.kind && 0 == w.n) {
+            mark_dirty(&w, w.root);
+            w.first = w.last = 0;
+        }
+
+        now = now_ms();
+
+        if(w.n > 0 && (now - w.last >= WATCH_QUIET_MS || now - w.first >= WATCH_MAX_MS)) {
+            flush(&w);
+        }
+    }
+
+    flush(&w);
+
+out:
+    if(w.fd >= 0) {
+        close(w.fd);
+    }
+
+    if(w.mount_fd >= 0) {
+        close(w.mount_fd);
+    }
+
+    table_free(&w.dirty, free);
+    table_free(&w.wds, wd_release);
+    free(w.paths);
+    free(w.root);
+    free(w.db);
+    return errno = result;
+}
@@ -0,0 +1,10 @@
+#ifndef _SRC_WATCH_H_
+#define _SRC_WATCH_H_
+
+extern const int WATCH_QUIET_MS;
+extern const int WATCH_MAX_MS;
+extern const int WATCH_POLL_MS;
+
+int watch_directory(const char * const);
+
+#endif /*_SRC_WATCH_H_*/
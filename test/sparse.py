@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+Indexes a multi-terabyte sparse file and checks what was stored: the
+file's size and FNV-1a 64 hash, ordinals 0..n-1 whose blobs add up to the
+file, and every blob read back through SQLite's incremental blob reader
+matching the file where it came from.  Blobs are a fixed BLOB bytes, more
+than ix streams at once and few enough to keep the database small, and
+more of them than ix holds in memory for a file.  Holes are never read
+but for the one blob of zeros, so the run takes seconds.
+
+    test/sparse.py <ix> [<scratch dir>]
+"""
+
+import os
+import shutil
+import sqlite3
+import subprocess
+import sys
+import tempfile
+
+SIZE = 2 << 40
+BLOB = 64 << 20
+MARKS = [0, 1 << 40, (1 << 40) + BLOB - 7, SIZE - 4096]
+WINDOW = 8 << 20
+
+FNV_OFFSET = 0xcbf29ce484222325
+FNV_PRIME = 0x100000001b3
+MASK = (1 << 64) - 1
+
+
+def fnv_bytes(h, data):
+    for b in data:
+        h = ((h ^ b) * FNV_PRIME) & MASK
+    return h
+
+
+def fnv_zeros(h, n):
+    return (h * pow(FNV_PRIME, n, 1 << 64)) & MASK
+
+
+def data_runs(fd, size):
+    """(offset, length) of each data extent of fd, holes left out"""
+    at = 0
+    while at < size:
+        try:
+            start = os.lseek(fd, at, os.SEEK_DATA)
+        except OSError:
+            return
+        end = min(os.lseek(fd, start, os.SEEK_HOLE), size)
+        yield start, end - start
+        at = end
+
+
+def file_hash(fd, size):
+    h = FNV_OFFSET
+    at = 0
+    for start, n in data_runs(fd, size):
+        h = fnv_zeros(h, start - at)
+        h = fnv_bytes(h, os.pread(fd, n, start))
+        at = start + n
+    return fnv_zeros(h, size - at)
+
+
+def check_blob(db, fd, row, off, size):
+    """the blob at row, read a window at a time, is the file's bytes at off"""
+    with db.blobopen("blobs", "blob", row, readonly=True) as blob:
+        if len(blob) != size:
+            return "blob %d is %d bytes, not %d" % (row, len(blob), size)
+        for at in range(0, size, WINDOW):
+            n = min(WINDOW, size - at)
+            blob.seek(at)
+            if blob.read(n) != os.pread(fd, n, off + at).ljust(n, b"\0"):
+                return "blob %d differs from the file at %d" % (row, off + at)
+    return None
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+
+    ix = os.path.abspath(sys.argv[1])
+    scratch = tempfile.mkdtemp(prefix="ix-sparse-", dir=sys.argv[2] if len(sys.argv) > 2 else None)
+
+    try:
+        root = os.path.join(scratch, "tree")
+        path = os.path.join(root, "sparse")
+        os.mkdir(root)
+
+        with open(path, "wb") as f:
+            try:
+                f.truncate(SIZE)
+            except OSError as e:
+                print("SKIP: can't make a %d byte sparse file in %s; %s" % (SIZE, scratch, e))
+                return 0
+            for m in MARKS:
+                f.seek(m)
+                f.write(b"ix sparse mark at %d\n" % m)
+
+        fd = os.open(path, os.O_RDONLY)
+        want = file_hash(fd, SIZE)
+        dbpath = os.path.join(scratch, "ix.db")
+        run = subprocess.run([ix, "-d", dbpath, "-C", "fixed:%d" % BLOB, "-r", root],
+                             stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+
+        if run.returncode != 0:
+            print("FAIL: ix exited %d\n%s" % (run.returncode, run.stderr))
+            return 1
+
+        db = sqlite3.connect(dbpath)
+        errors = []
+        got = db.execute("SELECT hash, size FROM files WHERE path = ?",
+                         (os.path.realpath(path),)).fetchone()
+
+        if got is None:
+            print("FAIL: no files row for %s" % path)
+            return 1
+
+        if got[1] != SIZE:
+            errors.append("size %d, not %d" % (got[1], SIZE))
+
+        if got[0] & MASK != want:
+            errors.append("hash %016x, not %016x" % (got[0] & MASK, want))
+
+        rows = db.execute("SELECT f.ordinal, b.rowid, b.size FROM file_blobs f "
+                          "JOIN blobs b ON b.hash = f.blob_hash "
+                          "WHERE f.file_hash = ? ORDER BY f.ordinal", (got[0],)).fetchall()
+
+        if [r[0] for r in rows] != list(range(len(rows))):
+            errors.append("ordinals are not 0..%d" % (len(rows) - 1))
+
+        if sum(r[2] for r in rows) != SIZE:
+            errors.append("blobs add up to %d bytes" % sum(r[2] for r in rows))
+
+        # a blob of zeros is shared by every hole it covers, so it is read once
+        off = 0
+        seen = set()
+        for _, row, size in rows:
+            holes = all(s + n <= off or s >= off + size for s, n in data_runs(fd, SIZE))
+            if not holes or row not in seen:
+                err = check_blob(db, fd, row, off, size)
+                if err:
+                    errors.append(err)
+                seen.add(row)
+            off += size
+
+        for e in errors:
+            print("FAIL: " + e)
+
+        if not errors:
+            print("sparse: %d byte file, hash %016x, %d blobs (%d distinct) round-trip"
+                  % (SIZE, want, len(rows), len(seen)))
+
+        return 1 if errors else 0
+    finally:
+        shutil.rmtree(scratch, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())